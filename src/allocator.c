@@ -32,137 +32,2451 @@
 
 /*
  * allocator.c -- allocator implementation implementation
+ *
+ * The heap is an array of 4MB lines following the pool's metadata.
+ * Small objects are carved by each thread out of a line of its own,
+ * every block starting with a header holding its size, which is then
+ * rounded up to one of ALLOC_CLASSES size classes.  Freed blocks go on
+ * a persistent free list per size class, and are handed out again by
+ * pmalloc() before any fresh space is used.  There's a set of free lists
+ * for each of ALLOC_ARENAS arenas, threads use the one of the CPU they
+ * run on, so threads on different CPUs seldom wait for the same lock.
+ * In front of the free lists each thread has a cache of freed blocks per
+ * pool, marked cached in their headers, which is trimmed back onto the
+ * free lists when it grows too big and when the thread exits.
+ *
+ * Objects too big for a line go into segments, runs of lines cut up
+ * into extents.  An extent is a multiple of 4KB with a header in front,
+ * so the object in it is page aligned.  Freed extents are merged with
+ * the free ones next to them, and once a whole segment is free its
+ * lines go back on the list of free runs.
  */
 
+#define	_GNU_SOURCE	/* for sched_getcpu() */
+
 #include <stdbool.h>
 #include <stdint.h>
-#include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include <libpmem.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/param.h>
 #include "pmem.h"
+#include "util.h"
+#include "out.h"
 #include "allocator.h"
 
 #define	KB 1024
-#define	MB 1024 * KB
+#define	MB (1024 * KB)
+
+#define	LINE_SIZE	(4 * MB)
+#define	LINE_ALIGN	4096	/* alignment of the first line */
+#define	LINE_HDR_SIZE	64	/* line header, data starts after it */
+#define	LINE_RESERVE	(64 * 1024)	/* space a thread reserves at once */
 
-#define	LINE_SIZE	4 * MB
+#define	LINE_OFFSET(allocator, n)\
+((allocator)->base_offset + (uint64_t)(n) * LINE_SIZE)
 
-#define	LINE_OFFSET(base, n)      \
-(uintptr_t)(base) +               \
-sizeof (struct thread_line_info) + \
-((n) * LINE_SIZE)
+#define	OFF_PTR(allocator, off)\
+((void *)((uintptr_t)(allocator)->base + (off)))
 
-#define	ALIGN(v) (((v) & ~7)+8)
-#define	ALIGN_HUGE(v) (((v) & ~(LINE_SIZE - 1)) + LINE_SIZE)
+#define	ALIGN(v) (((v) + 7) & ~7)
 
 #define	LINE_INFO_VALID 0x95857284
 #define	HUGE_INFO_VALID 0x85629667
+#define	FREE_INFO_VALID 0x70238164
+#define	SUMMARY_VALID 0x64851937
+#define	EXTENT_USED_VALID 0x38562093
+#define	EXTENT_FREE_VALID 0x29640731
+
+#define	EXTENT_HDR_SIZE	64	/* extent header, the object starts after it */
+#define	EXTENT_UNIT	4096	/* extents are a multiple of it in size */
+
+/* where a segment's first extent starts, so huge objects are page aligned */
+#define	SEG_HDR_SIZE	(EXTENT_UNIT - EXTENT_HDR_SIZE)
+
+#define	PARTIAL_OWNED 1		/* flag in a partial slot, a thread owns it */
+
+#define	ALIGNED_TRIES 8		/* free blocks pmalloc_aligned() looks at */
+#define	STEAL_MAX 64		/* blocks class_pop() moves between arenas */
+#define	RECOUNT_MAX_THREADS 16	/* threads stats_recount() uses at most */
 
-__thread struct thread_line_info {
+/*
+ * Header of a line in use by threads for small objects.  The space up to
+ * offset is reserved by the thread allocating from the line, which
+ * carves blocks out of it without touching the header.  After a restart
+ * the blocks actually handed out are found by walking their headers,
+ * which works because the space past the last block is zeroed: either
+ * the line was never used before, or it's dirty and every reservation
+ * gets zeroed before it's made.
+ */
+struct thread_line_info {
 	uint64_t valid;
-	uint64_t offset;
-} *thread_line;
+	uint64_t offset;	/* end of the reserved space, from line start */
+	uint64_t dirty;		/* held data before, reservations get zeroed */
+	uint64_t carved;	/* first free byte at the last reservation */
+};
 
+/* header of a run of lines holding huge objects, or free */
 struct huge_info {
 	uint64_t valid;
-	uint64_t lines;
+	uint64_t lines;		/* lines in the run */
+	uint64_t next;		/* next free run (free runs only) */
+};
+
+/*
+ * Header of an extent.  The run of lines holding huge objects, called a
+ * segment, is cut up into extents, one for each object plus free ones.
+ * A free extent is merged with the free extents next to it, and when a
+ * whole segment is free its lines go back on the free runs.
+ */
+struct extent {
+	uint64_t valid;
+	uint64_t size;		/* extent size, header included */
+	uint64_t seg;		/* offset of the segment's first line */
+	uint64_t next;		/* next free extent (free extents only) */
+};
+
+/* header in front of every block handed out by pmalloc() */
+struct block_hdr {
+	uint64_t size;		/* block size, header included */
+};
+
+/* a block on a free list, next is stored where the object used to be */
+struct free_block {
+	struct block_hdr hdr;
+	uint64_t next;
+};
+
+#define	BLOCK_HUGE 1		/* flag in block_hdr.size, block owns lines */
+#define	BLOCK_CACHED 2		/* flag in block_hdr.size, block is cached */
+#define	BLOCK_MIN (sizeof (struct free_block))
+
+/* largest block taken from a thread line, bigger ones are huge */
+#define	SMALL_MAX (class_size(ALLOC_CLASSES - 1))
+
+/*
+ * The line each thread allocates from.  It's only good for the pool
+ * whose allocator has the same id, as a thread may use several pools.
+ */
+static __thread struct {
+	uint64_t id;
+	uint64_t idx;
+	struct thread_line_info *line;
+	uint64_t next;		/* first free byte, from the line's start */
+} Thread_line;
+
+static uint64_t Next_id;
+
+/* arena of a thread when the CPU it runs on can't be told */
+static __thread unsigned Thread_arena;
+static unsigned Next_arena;
+
+#define	TCACHE_MAX 64		/* default blocks cached per class */
+
+/*
+ * Cache of blocks freed by a thread, one list for each class, from which
+ * the thread's next allocations of the same class are served without
+ * taking any lock.  The lists are linked through free_block.next but
+ * never made persistent; what makes a cached block free after a crash is
+ * BLOCK_CACHED in its header, see stats_recount().  The caches of a pool
+ * are listed in its allocator, so they can all be emptied when it closes.
+ * A thread's caches are emptied and freed when it exits, see thread_exit().
+ */
+struct tcache {
+	struct tcache *next;	/* next cache of the pool */
+	void *owner;		/* thread using it, see tcache_get() */
+	uint64_t hits;		/* allocations served from the cache */
+	uint64_t misses;	/* allocations the cache had no block for */
+	uint64_t flushed;	/* blocks given back to the free lists */
+	uint64_t free[ALLOC_CLASSES];	/* first block of each class */
+	unsigned count[ALLOC_CLASSES];	/* blocks cached of each class */
 };
 
-pthread_mutex_t line_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the cache the thread uses for the pool whose allocator has the same id */
+static __thread struct {
+	uint64_t id;
+	struct tcache *tc;
+} Thread_cache;
+
+/* set for threads with a line or a cache, to run thread_exit() */
+static pthread_key_t Thread_key;
+static pthread_once_t Thread_key_once = PTHREAD_ONCE_INIT;
+static int Thread_key_ok;
+
+/* allocators of the open pools, for thread_exit() to look through */
+static struct allocator *Allocators;
+static pthread_mutex_t Allocators_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Run-time state of the allocator of an open pool, kept out of the pool
+ * so none of it gets written to media.
+ */
+struct allocator {
+	struct allocator *next;		/* next on Allocators */
+	struct allocator_hdr *hdr;	/* the allocator's state in the pool */
+	void *base;			/* mapped pool */
+	size_t size;			/* size of the pool */
+	uint64_t base_offset;		/* where the first line starts */
+	uint64_t nlines;		/* lines in the pool */
+	uint64_t id;			/* tells thread lines of pools apart */
+	int is_pmem;
+	int unlisted;			/* a thread line isn't in partial */
+	int stale;			/* summary not persistent, rebuild */
+	pthread_mutex_t runs_lock;	/* protects the free runs list */
+	pthread_mutex_t extent_lock;	/* protects extents, taken first */
+	unsigned narenas;		/* arenas threads are spread over */
+	pthread_mutex_t class_lock[ALLOC_ARENAS][ALLOC_CLASSES];
+	struct tcache *tcaches;		/* caches of the threads using it */
+	pthread_mutex_t tcache_lock;	/* protects the list of caches */
+	unsigned tcache_max;		/* blocks cached per class */
+	uint64_t tcache_hits;		/* counters of the caches freed */
+	uint64_t tcache_misses;
+	uint64_t tcache_flushed;
+};
+
+static int summary_rebuild(struct allocator *allocator);
+static int tcache_destroy(struct allocator *allocator);
+static void thread_key_set(void);
+
+/*
+ * class_of -- (internal) return the smallest class holding bsize bytes
+ *
+ * Classes are 16 bytes apart up to 128 bytes, then there are four
+ * classes for each power of two, so rounding up a block to its class
+ * never wastes more than a quarter of it.
+ */
+static unsigned
+class_of(size_t bsize)
+{
+	if (bsize <= 128)
+		return bsize <= 16 ? 0 : (unsigned)(bsize + 15) / 16 - 1;
+
+	/* 2^p < bsize <= 2^(p + 1) */
+	unsigned p = 63 - __builtin_clzll(bsize - 1);
+	size_t step = (size_t)1 << (p - 2);
+	size_t k = (bsize - ((size_t)1 << p) + step - 1) / step;
+
+	return 8 + (p - 7) * 4 + (unsigned)k - 1;
+}
+
+/*
+ * class_size -- (internal) return the block size of a class
+ */
+static size_t
+class_size(unsigned c)
+{
+	if (c < 8)
+		return (c + 1) * 16;
+
+	unsigned p = 7 + (c - 8) / 4;
+	unsigned k = (c - 8) % 4 + 1;
+
+	return ((size_t)1 << p) + k * ((size_t)1 << (p - 2));
+}
+
+/*
+ * class_floor -- (internal) return the largest class a block can serve
+ */
+static unsigned
+class_floor(size_t bsize)
+{
+	unsigned c = class_of(bsize);
+
+	return class_size(c) > bsize ? c - 1 : c;
+}
+
+/*
+ * line_end -- (internal) return the offset just past a run of lines
+ *
+ * The last line of the pool is shorter if the pool size isn't a
+ * multiple of the line size.
+ */
+static uint64_t
+line_end(struct allocator *allocator, uint64_t idx, uint64_t n)
+{
+	uint64_t end = LINE_OFFSET(allocator, idx + n);
+
+	return end < allocator->size ? end : allocator->size;
+}
+
+/*
+ * seg_end -- (internal) return the offset just past a segment
+ */
+static uint64_t
+seg_end(struct allocator *allocator, uint64_t seg)
+{
+	struct huge_info *huge = OFF_PTR(allocator, seg);
+
+	return line_end(allocator, (seg - allocator->base_offset) / LINE_SIZE,
+			huge->lines);
+}
 
-bool
-allocator_init(struct allocator_hdr *allocator, uint64_t base_offset,
-	int is_pmem)
+/*
+ * allocator_new -- set up the allocator of an open pool
+ *
+ * hdr is the allocator's state in the pool, the lines start at
+ * base_offset or the next LINE_ALIGN boundary past it.  Returns the
+ * allocator, or NULL with errno set.
+ */
+struct allocator *
+allocator_new(struct allocator_hdr *hdr, void *base, size_t size,
+	uint64_t base_offset, int is_pmem)
 {
-	allocator->base_offset = ALIGN(base_offset);
-	allocator->lines_used = 0;
+	struct allocator *allocator = Malloc(sizeof (*allocator));
+
+	if (allocator == NULL) {
+		LOG(1, "!Malloc");
+		return NULL;
+	}
+
+	allocator->hdr = hdr;
+	allocator->base = base;
+	allocator->size = size;
+	allocator->base_offset = roundup(base_offset, LINE_ALIGN);
 	allocator->is_pmem = is_pmem;
+	allocator->unlisted = 0;
+	allocator->stale = 0;
+	allocator->id = __sync_add_and_fetch(&Next_id, 1);
+
+	allocator->nlines = 0;
+	if (size > allocator->base_offset) {
+		allocator->nlines = (size - allocator->base_offset +
+				LINE_SIZE - 1) / LINE_SIZE;
+
+		/* a short last line must at least fit a block */
+		uint64_t last = allocator->nlines - 1;
+		if (line_end(allocator, last, 1) - LINE_OFFSET(allocator, last)
+				< LINE_HDR_SIZE + BLOCK_MIN)
+			allocator->nlines--;
+	}
+
+	LOG(3, "base_offset %ju nlines %ju",
+		(uintmax_t)allocator->base_offset,
+		(uintmax_t)allocator->nlines);
+
+	ASSERT(SMALL_MAX <= LINE_SIZE - LINE_HDR_SIZE);
+	ASSERTeq(class_of(SMALL_MAX), ALLOC_CLASSES - 1);
+
+	pthread_mutex_init(&allocator->runs_lock, NULL);
+	pthread_mutex_init(&allocator->extent_lock, NULL);
+	pthread_mutex_init(&allocator->tcache_lock, NULL);
+	for (int a = 0; a < ALLOC_ARENAS; a++)
+		for (int c = 0; c < ALLOC_CLASSES; c++)
+			pthread_mutex_init(&allocator->class_lock[a][c], NULL);
+
+	/* arenas past the CPUs are only used for what they already hold */
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	allocator->narenas = ncpus < 1 ? 1 :
+			ncpus < ALLOC_ARENAS ? (unsigned)ncpus : ALLOC_ARENAS;
+
+	/* PMEM_ALLOC_TCACHE=n caches up to n blocks per class, 0 none */
+	char *ptr;
+	allocator->tcaches = NULL;
+	allocator->tcache_max = TCACHE_MAX;
+	allocator->tcache_hits = 0;
+	allocator->tcache_misses = 0;
+	allocator->tcache_flushed = 0;
+	if ((ptr = getenv("PMEM_ALLOC_TCACHE")) != NULL)
+		allocator->tcache_max = (unsigned)atoi(ptr);
 
 	/*
-	 * These variables are initialized every time right now,
-	 * but that might change later on.
-	 * libpmem_persist(is_pmem, allocator, sizeof (*allocator));
+	 * Without a clean close the summary can't be trusted, it's made
+	 * up again from the line headers.  Either way it's only good again
+	 * once the pool is closed.  If the rebuilt one can't be made
+	 * persistent, it's rebuilt again on the next open.
 	 */
-	return true;
+	if (allocator->hdr->summary != SUMMARY_VALID ||
+			allocator->hdr->lines_used > allocator->nlines) {
+		LOG(3, "rebuilding heap summary");
+		if (summary_rebuild(allocator) < 0) {
+			LOG(1, "!summary_rebuild");
+			allocator->stale = 1;
+		}
+	}
+
+	allocator->hdr->summary = 0;
+	libpmem_persist(is_pmem, &allocator->hdr->summary,
+			sizeof (allocator->hdr->summary));
+
+	pthread_mutex_lock(&Allocators_lock);
+	allocator->next = Allocators;
+	Allocators = allocator;
+	pthread_mutex_unlock(&Allocators_lock);
+
+	return allocator;
+}
+
+/*
+ * allocator_delete -- release the allocator's run-time state
+ *
+ * The blocks in thread caches go back on the free lists.  Lines threads
+ * were allocating from are written to the summary, to be handed out
+ * again after the pool is opened next, along with the counters kept for
+ * allocator_stats().  If any of that fails to reach the media, the
+ * summary is left invalid, so the next open rebuilds it.
+ */
+void
+allocator_delete(struct allocator *allocator)
+{
+	/* exiting threads stop looking at it once it's off the list */
+	pthread_mutex_lock(&Allocators_lock);
+	struct allocator **ap = &Allocators;
+	while (*ap != allocator)
+		ap = &(*ap)->next;
+	*ap = allocator->next;
+	pthread_mutex_unlock(&Allocators_lock);
+
+	if (tcache_destroy(allocator) < 0) {
+		LOG(1, "!tcache_destroy");
+		allocator->stale = 1;
+	}
+
+	for (int i = 0; i < ALLOC_PARTIAL; i++)
+		allocator->hdr->partial[i] &= ~(uint64_t)PARTIAL_OWNED;
+
+	if (libpmem_persist(allocator->is_pmem, &allocator->hdr->lines_used,
+			offsetof(struct allocator_hdr, huge_bytes) +
+			sizeof (allocator->hdr->huge_bytes) -
+			offsetof(struct allocator_hdr, lines_used)) < 0) {
+		LOG(1, "!libpmem_persist");
+		allocator->stale = 1;
+	}
+
+	if (!allocator->unlisted && !allocator->stale) {
+		allocator->hdr->summary = SUMMARY_VALID;
+		libpmem_persist(allocator->is_pmem, &allocator->hdr->summary,
+				sizeof (allocator->hdr->summary));
+	}
+
+	pthread_mutex_destroy(&allocator->runs_lock);
+	pthread_mutex_destroy(&allocator->extent_lock);
+	pthread_mutex_destroy(&allocator->tcache_lock);
+	for (int a = 0; a < ALLOC_ARENAS; a++)
+		for (int c = 0; c < ALLOC_CLASSES; c++)
+			pthread_mutex_destroy(&allocator->class_lock[a][c]);
+
+	Free(allocator);
+}
+
+/*
+ * arena_of -- (internal) return the arena of the calling thread
+ *
+ * That's the arena of the CPU the thread runs on, so a thread that
+ * migrates changes arenas with it.  Without sched_getcpu() threads are
+ * spread over the arenas as they first allocate.
+ */
+static unsigned
+arena_of(struct allocator *allocator)
+{
+	int cpu = sched_getcpu();
+
+	if (cpu >= 0)
+		return (unsigned)cpu % allocator->narenas;
+
+	if (Thread_arena == 0)
+		Thread_arena = __sync_add_and_fetch(&Next_arena, 1);
+
+	return Thread_arena % allocator->narenas;
+}
+
+/*
+ * class_push -- (internal) put a block on the free list of its class
+ *
+ * The block goes to the arena of the calling thread.  The link to the
+ * rest of the list must be persistent before the block is, so a crash
+ * can only lose the block, never the list.
+ */
+static void
+class_push(struct allocator *allocator, uint64_t off, PMEMflushset *fsp)
+{
+	struct free_block *blk = OFF_PTR(allocator, off);
+	unsigned c = class_floor(blk->hdr.size);
+	unsigned a = arena_of(allocator);
+
+	pthread_mutex_lock(&allocator->class_lock[a][c]);
+	blk->next = allocator->hdr->free[a][c];
+	libpmem_persist(allocator->is_pmem, &blk->next, sizeof (blk->next));
+	allocator->hdr->free[a][c] = off;
+	pmem_flushset_add(fsp, &allocator->hdr->free[a][c], sizeof (uint64_t));
+	allocator->hdr->class_free[a][c]++;
+	pthread_mutex_unlock(&allocator->class_lock[a][c]);
+}
+
+/*
+ * class_splice -- (internal) put a chain of n blocks on a free list
+ *
+ * The chain runs from first to last and is off every list, so, as in
+ * class_push(), a crash can only lose it.
+ */
+static void
+class_splice(struct allocator *allocator, unsigned a, unsigned c,
+	uint64_t first, uint64_t last, unsigned n)
+{
+	struct free_block *blk = OFF_PTR(allocator, last);
+
+	pthread_mutex_lock(&allocator->class_lock[a][c]);
+	blk->next = allocator->hdr->free[a][c];
+	libpmem_persist(allocator->is_pmem, &blk->next, sizeof (blk->next));
+	allocator->hdr->free[a][c] = first;
+	libpmem_persist(allocator->is_pmem, &allocator->hdr->free[a][c],
+			sizeof (uint64_t));
+	allocator->hdr->class_free[a][c] += n;
+	pthread_mutex_unlock(&allocator->class_lock[a][c]);
 }
 
-struct thread_line_info *get_thread_line(struct allocator_hdr *allocator,
-	size_t size)
+/*
+ * class_pop -- (internal) take a block off a free list of a class
+ *
+ * The arena of the calling thread is tried first, then the others, so
+ * blocks freed on one CPU are still found by threads on the others.
+ * From another arena half its list is taken at once, up to STEAL_MAX
+ * blocks, and the rest of it goes on the thread's own list, so the
+ * next allocations don't go looking through the other arenas' locks
+ * again.  The new head must be persistent before the block is handed
+ * out, as the caller's data overwrites the link to it.  Returns the
+ * block's offset, or 0 if the lists are empty.
+ */
+static uint64_t
+class_pop(struct allocator *allocator, unsigned c)
 {
-	if (thread_line != NULL && (thread_line->offset + size) > LINE_SIZE)
-		thread_line = NULL;
+	unsigned own = arena_of(allocator);
+
+	for (unsigned i = 0; i < ALLOC_ARENAS; i++) {
+		unsigned a = (own + i) % ALLOC_ARENAS;
+
+		if (allocator->hdr->free[a][c] == 0)
+			continue;
 
-	if (thread_line != NULL)
-		return thread_line;
+		pthread_mutex_lock(&allocator->class_lock[a][c]);
+		uint64_t off = allocator->hdr->free[a][c];
+		uint64_t last = off;
+		unsigned n = 0;
+		if (off) {
+			uint64_t want = 1;
+			if (a != own) {
+				want = (allocator->hdr->class_free[a][c] + 1)
+						/ 2;
+				if (want > STEAL_MAX)
+					want = STEAL_MAX;
+			}
 
-	pthread_mutex_lock(&line_lock);
-	while (thread_line == NULL) {
-		uint64_t line_idx = allocator->lines_used++;
-		thread_line = (void *) LINE_OFFSET(allocator, line_idx);
-		if (thread_line->valid == HUGE_INFO_VALID) {
-			struct huge_info *huge =
-				(struct huge_info *)thread_line;
-			allocator->lines_used += huge->lines - 1;
-			thread_line = NULL;
-		} else if (thread_line->valid != LINE_INFO_VALID) {
-			thread_line->offset =
-				LINE_OFFSET(allocator->base_offset, line_idx);
-			thread_line->valid = LINE_INFO_VALID - 1;
-			libpmem_persist(allocator->is_pmem, thread_line,
-				sizeof (*thread_line));
-			thread_line->valid = LINE_INFO_VALID;
-			libpmem_persist(allocator->is_pmem, thread_line,
-				sizeof (*thread_line));
-		} else if (thread_line->offset + size > LINE_SIZE) {
-			thread_line = NULL;
+			struct free_block *blk = OFF_PTR(allocator, last);
+			for (n = 1; n < want && blk->next; n++) {
+				last = blk->next;
+				blk = OFF_PTR(allocator, last);
+			}
+
+			allocator->hdr->free[a][c] = blk->next;
+			libpmem_persist(allocator->is_pmem,
+					&allocator->hdr->free[a][c],
+					sizeof (uint64_t));
+			allocator->hdr->class_free[a][c] -= n;
+		}
+		pthread_mutex_unlock(&allocator->class_lock[a][c]);
+
+		if (off == 0)
+			continue;
+
+		if (n > 1) {
+			struct free_block *blk = OFF_PTR(allocator, off);
+			class_splice(allocator, own, c, blk->next, last, n - 1);
 		}
+
+		return off;
 	}
-	pthread_mutex_unlock(&line_lock);
 
-	return thread_line;
+	return 0;
 }
 
-void
-thread_alloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size)
+/*
+ * block_count -- (internal) count a block just made, for allocator_stats()
+ *
+ * Counted in the thread's arena, so threads on other CPUs don't fight
+ * over the counter.  Only the sum over the arenas means anything.
+ */
+static void
+block_count(struct allocator *allocator, size_t bsize)
 {
-	struct thread_line_info *line = get_thread_line(allocator, size);
-	size = ALIGN(size);
-	*ptr = line->offset;
-	line->offset += size;
-	libpmem_persist(allocator->is_pmem, thread_line, sizeof (*thread_line));
+	__sync_fetch_and_add(&allocator->hdr->class_blocks[arena_of(allocator)][
+			class_floor(bsize)], 1);
 }
 
-void
-huge_alloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size)
+/*
+ * block_uncount -- (internal) count a block gone, see block_count()
+ *
+ * The arena's counter may wrap if the block was counted in another
+ * one, the sum still comes out right.
+ */
+static void
+block_uncount(struct allocator *allocator, size_t bsize)
 {
-	size = ALIGN_HUGE(size);
-	pthread_mutex_lock(&line_lock);
-	struct huge_info *huge =
-		(void *) LINE_OFFSET(allocator, allocator->lines_used);
-	huge->valid = HUGE_INFO_VALID;
-	huge->lines = size / LINE_SIZE;
+	__sync_fetch_and_sub(&allocator->hdr->class_blocks[arena_of(allocator)][
+			class_floor(bsize)], 1);
+}
 
-	*ptr = LINE_OFFSET(allocator->base_offset, allocator->lines_used) +
-		(sizeof (struct huge_info));
-	libpmem_persist(allocator->is_pmem, huge, sizeof (*huge));
-	allocator->lines_used += huge->lines;
-	pthread_mutex_unlock(&line_lock);
+/*
+ * tcache_get -- (internal) return the thread's cache for the pool
+ *
+ * A thread that used another pool since looks its cache up again.  The
+ * owner is told by the address of its Thread_cache.  Returns NULL if
+ * caching is off or there's no memory for a cache.
+ */
+static struct tcache *
+tcache_get(struct allocator *allocator)
+{
+	if (Thread_cache.id == allocator->id)
+		return Thread_cache.tc;
+
+	thread_key_set();
+
+	struct tcache *tc;
+
+	pthread_mutex_lock(&allocator->tcache_lock);
+	for (tc = allocator->tcaches; tc; tc = tc->next)
+		if (tc->owner == &Thread_cache)
+			break;
+
+	if (tc == NULL && allocator->tcache_max &&
+			(tc = Malloc(sizeof (*tc))) != NULL) {
+		memset(tc, 0, sizeof (*tc));
+		tc->owner = &Thread_cache;
+		tc->next = allocator->tcaches;
+		allocator->tcaches = tc;
+	}
+	pthread_mutex_unlock(&allocator->tcache_lock);
+
+	if (tc) {
+		Thread_cache.id = allocator->id;
+		Thread_cache.tc = tc;
+	}
+
+	return tc;
 }
 
-void
-pmalloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size)
+/*
+ * tcache_trim -- (internal) give the cached blocks of class c over keep back
+ *
+ * A block must be persistently out of the cache before it's on a free
+ * list, or it could end up on the list twice after a crash.
+ */
+static void
+tcache_trim(struct allocator *allocator, struct tcache *tc, unsigned c,
+	unsigned keep, PMEMflushset *fsp)
 {
-	if (size >= LINE_SIZE - (sizeof (struct thread_line_info))) {
-		huge_alloc(allocator, ptr, size);
-	} else {
-		thread_alloc(allocator, ptr, size);
+	while (tc->count[c] > keep) {
+		uint64_t off = tc->free[c];
+		struct free_block *blk = OFF_PTR(allocator, off);
+
+		tc->free[c] = blk->next;
+		tc->count[c]--;
+		tc->flushed++;
+
+		blk->hdr.size &= ~(uint64_t)BLOCK_CACHED;
+		libpmem_persist(allocator->is_pmem, &blk->hdr,
+				sizeof (blk->hdr));
+		class_push(allocator, off, fsp);
 	}
 }
 
-void
-pfree(struct allocator_hdr *allocator, uint64_t ptr)
+/*
+ * tcache_push -- (internal) put a freed block in the thread's cache
+ *
+ * Once a class has more blocks cached than allowed, half of them go
+ * back on the free list.  Returns 0 if the block is cached, otherwise -1.
+ */
+static int
+tcache_push(struct allocator *allocator, uint64_t off, PMEMflushset *fsp)
+{
+	struct tcache *tc = tcache_get(allocator);
+
+	if (tc == NULL)
+		return -1;
+
+	struct free_block *blk = OFF_PTR(allocator, off);
+	unsigned c = class_floor(blk->hdr.size);
+	unsigned max = allocator->tcache_max;
+
+	if (tc->count[c] >= max) {
+		tcache_trim(allocator, tc, c, max / 2, fsp);
+		if (max == 0)
+			return -1;
+	}
+
+	blk->next = tc->free[c];
+	tc->free[c] = off;
+	tc->count[c]++;
+
+	blk->hdr.size |= BLOCK_CACHED;
+	pmem_flushset_add(fsp, &blk->hdr, sizeof (blk->hdr));
+
+	return 0;
+}
+
+/*
+ * tcache_pop -- (internal) take a block of class c from the thread's cache
+ *
+ * Returns the block's offset, or 0 if there's none cached.
+ */
+static uint64_t
+tcache_pop(struct allocator *allocator, unsigned c, PMEMflushset *fsp)
+{
+	struct tcache *tc = tcache_get(allocator);
+
+	if (tc == NULL)
+		return 0;
+
+	uint64_t off = tc->free[c];
+	if (off == 0) {
+		tc->misses++;
+		return 0;
+	}
+
+	struct free_block *blk = OFF_PTR(allocator, off);
+
+	tc->free[c] = blk->next;
+	tc->count[c]--;
+	tc->hits++;
+
+	blk->hdr.size &= ~(uint64_t)BLOCK_CACHED;
+	pmem_flushset_add(fsp, &blk->hdr, sizeof (blk->hdr));
+
+	return off;
+}
+
+/*
+ * tcache_destroy -- (internal) empty and free all caches of the pool
+ *
+ * Returns -1 with errno set if the free lists couldn't be made
+ * persistent.
+ */
+static int
+tcache_destroy(struct allocator *allocator)
+{
+	PMEMflushset fs;
+	libpmem_flushset_init(&fs, allocator->is_pmem, NULL);
+
+	while (allocator->tcaches) {
+		struct tcache *tc = allocator->tcaches;
+
+		for (unsigned c = 0; c < ALLOC_CLASSES; c++)
+			tcache_trim(allocator, tc, c, 0, &fs);
+
+		allocator->tcaches = tc->next;
+		Free(tc);
+	}
+
+	return pmem_flushset_drain(&fs);
+}
+
+/*
+ * partial_add -- (internal) remember a line a thread allocates from
+ */
+static void
+partial_add(struct allocator *allocator, uint64_t start)
+{
+	for (int i = 0; i < ALLOC_PARTIAL; i++)
+		if (__sync_bool_compare_and_swap(&allocator->hdr->partial[i], 0,
+				start | PARTIAL_OWNED))
+			return;
+
+	/* the line's room would be lost after a close, rebuild then */
+	allocator->unlisted = 1;
+}
+
+/*
+ * partial_del -- (internal) forget a line threads are done with
+ */
+static void
+partial_del(struct allocator *allocator, uint64_t start)
+{
+	for (int i = 0; i < ALLOC_PARTIAL; i++)
+		if (__sync_bool_compare_and_swap(&allocator->hdr->partial[i],
+				start | PARTIAL_OWNED, 0))
+			break;
+}
+
+/*
+ * partial_release -- (internal) let other threads take over a line
+ */
+static void
+partial_release(struct allocator *allocator, uint64_t start)
+{
+	for (int i = 0; i < ALLOC_PARTIAL; i++)
+		if (__sync_bool_compare_and_swap(&allocator->hdr->partial[i],
+				start | PARTIAL_OWNED, start))
+			break;
+}
+
+/*
+ * thread_exit -- (internal) give back what an exiting thread holds
+ *
+ * Called by the thread as it exits.  The caches it has in any pool are
+ * emptied and freed, and the line it allocates from is left to other
+ * threads, which find where it ends as they do after a restart.
+ * Otherwise all of that would be lost until the pool is closed.
+ */
+static void
+thread_exit(void *owner)
+{
+	pthread_mutex_lock(&Allocators_lock);
+
+	for (struct allocator *allocator = Allocators; allocator;
+			allocator = allocator->next) {
+		if (Thread_line.id == allocator->id)
+			partial_release(allocator,
+				LINE_OFFSET(allocator, Thread_line.idx));
+
+		pthread_mutex_lock(&allocator->tcache_lock);
+		struct tcache **tcp = &allocator->tcaches;
+		while (*tcp && (*tcp)->owner != owner)
+			tcp = &(*tcp)->next;
+		struct tcache *tc = *tcp;
+		if (tc)
+			*tcp = tc->next;
+		pthread_mutex_unlock(&allocator->tcache_lock);
+
+		if (tc == NULL)
+			continue;
+
+		PMEMflushset fs;
+		libpmem_flushset_init(&fs, allocator->is_pmem, NULL);
+
+		for (unsigned c = 0; c < ALLOC_CLASSES; c++)
+			tcache_trim(allocator, tc, c, 0, &fs);
+
+		if (pmem_flushset_drain(&fs) < 0) {
+			LOG(1, "!pmem_flushset_drain");
+			allocator->stale = 1;
+		}
+
+		pthread_mutex_lock(&allocator->tcache_lock);
+		allocator->tcache_hits += tc->hits;
+		allocator->tcache_misses += tc->misses;
+		allocator->tcache_flushed += tc->flushed;
+		pthread_mutex_unlock(&allocator->tcache_lock);
+
+		Free(tc);
+	}
+
+	Thread_line.id = 0;
+	Thread_cache.id = 0;
+
+	pthread_mutex_unlock(&Allocators_lock);
+}
+
+/*
+ * thread_key_create -- (internal) create the key that runs thread_exit()
+ */
+static void
+thread_key_create(void)
+{
+	int err = pthread_key_create(&Thread_key, thread_exit);
+
+	if (err)
+		LOG(1, "pthread_key_create: %s", strerror(err));
+	else
+		Thread_key_ok = 1;
+}
+
+/*
+ * thread_key_set -- (internal) make the thread run thread_exit() on exit
+ *
+ * Without the key, what the thread holds is only given back when the
+ * pool closes.
+ */
+static void
+thread_key_set(void)
 {
-	/* uint64_t line_idx = ALIGN_LINE(ptr); */
-	/* XXX implement freelist bins */
+	pthread_once(&Thread_key_once, thread_key_create);
+
+	if (Thread_key_ok && pthread_getspecific(Thread_key) == NULL)
+		pthread_setspecific(Thread_key, &Thread_cache);
+}
+
+/*
+ * line_retire -- (internal) stop allocating from a line
+ *
+ * Whatever is left at the end of the line, from used on, is put on a
+ * free list.  The line is marked full first, so the tail can't be handed
+ * out twice.
+ */
+static void
+line_retire(struct allocator *allocator, uint64_t idx,
+	struct thread_line_info *line, uint64_t used, PMEMflushset *fsp)
+{
+	uint64_t start = LINE_OFFSET(allocator, idx);
+	uint64_t end = line_end(allocator, idx, 1);
+	uint64_t off = start + used;
+
+	line->offset = end - start;
+	libpmem_persist(allocator->is_pmem, line, sizeof (*line));
+	partial_del(allocator, start);
+
+	if (end - off < BLOCK_MIN)
+		return;
+
+	struct block_hdr *hdr = OFF_PTR(allocator, off);
+	hdr->size = end - off;
+	libpmem_persist(allocator->is_pmem, hdr, sizeof (*hdr));
+	block_count(allocator, hdr->size);
+	class_push(allocator, off, fsp);
+}
+
+/*
+ * line_scan -- (internal) find the end of the blocks handed out from a line
+ *
+ * Walks the block headers in the last reservation made in the line,
+ * stopping at the first one that can't be a block.  Returns the offset,
+ * from the line's start, allocation can go on from.
+ */
+static uint64_t
+line_scan(struct allocator *allocator, uint64_t idx,
+	struct thread_line_info *line)
+{
+	uint64_t start = LINE_OFFSET(allocator, idx);
+	uint64_t end = line_end(allocator, idx, 1) - start;
+	uint64_t used = LINE_HDR_SIZE;
+
+	if (line->offset < end)
+		end = line->offset;
+
+	/* blocks carved before the last reservation are all there */
+	if (line->carved > used && line->carved <= end)
+		used = line->carved;
+
+	while (used + sizeof (struct block_hdr) <= end) {
+		struct block_hdr *hdr = OFF_PTR(allocator, start + used);
+		uint64_t size = hdr->size & ~(uint64_t)BLOCK_CACHED;
+
+		if (size < sizeof (*hdr) || (size & 7) || size > end - used)
+			break;
+
+		used += size;
+	}
+
+	return used;
+}
+
+/*
+ * runs_take -- (internal) take n lines off the list of free runs
+ *
+ * The smallest run big enough is used, split if it's bigger, so thread
+ * lines don't break up the runs huge objects need.  The caller must hold
+ * runs_lock.  Returns the index of the first line, or -1.
+ */
+static int64_t
+runs_take(struct allocator *allocator, uint64_t n)
+{
+	uint64_t *bestp = NULL;
+	struct huge_info *run = NULL;
+
+	for (uint64_t *prevp = &allocator->hdr->free_lines; *prevp; ) {
+		struct huge_info *r = OFF_PTR(allocator, *prevp);
+
+		if (r->lines >= n && (run == NULL || r->lines < run->lines)) {
+			bestp = prevp;
+			run = r;
+		}
+		prevp = &r->next;
+	}
+
+	if (run == NULL)
+		return -1;
+
+	uint64_t idx = (*bestp - allocator->base_offset) / LINE_SIZE;
+	uint64_t next = run->next;
+
+	if (run->lines > n) {
+		/* split, the rest of the run stays free */
+		struct huge_info *rest = OFF_PTR(allocator,
+				LINE_OFFSET(allocator, idx + n));
+		rest->lines = run->lines - n;
+		rest->next = run->next;
+		rest->valid = FREE_INFO_VALID;
+		libpmem_persist(allocator->is_pmem, rest, sizeof (*rest));
+		next = LINE_OFFSET(allocator, idx + n);
+	}
+
+	*bestp = next;
+	libpmem_persist(allocator->is_pmem, bestp, sizeof (*bestp));
+	return (int64_t)idx;
+}
+
+/*
+ * fresh_take -- (internal) take n lines never handed out so far
+ *
+ * Lines are claimed by moving lines_used past them with a CAS, so
+ * threads refilling their lines don't wait for each other.  Returns the
+ * index of the first line, or -1.
+ */
+static int64_t
+fresh_take(struct allocator *allocator, uint64_t n)
+{
+	uint64_t idx;
+
+	while ((idx = allocator->hdr->lines_used) + n <= allocator->nlines)
+		if (__sync_bool_compare_and_swap(&allocator->hdr->lines_used,
+				idx, idx + n))
+			return (int64_t)idx;
+
+	return -1;
+}
+
+/*
+ * lines_take -- (internal) take a run of n lines
+ *
+ * Single lines come from fresh space first, so the free runs are kept
+ * whole for huge objects for as long as possible, and so refilling a
+ * thread line only takes runs_lock once the pool is used up.  Returns
+ * the index of the first line, or -1 if there's no room left.
+ */
+static int64_t
+lines_take(struct allocator *allocator, uint64_t n)
+{
+	int64_t idx = -1;
+
+	if (n == 1)
+		idx = fresh_take(allocator, n);
+
+	if (idx < 0 && allocator->hdr->free_lines) {
+		pthread_mutex_lock(&allocator->runs_lock);
+		idx = runs_take(allocator, n);
+		pthread_mutex_unlock(&allocator->runs_lock);
+	}
+
+	if (idx < 0 && n > 1)
+		idx = fresh_take(allocator, n);
+
+	return idx;
+}
+
+/*
+ * line_recover -- (internal) make a line left by an earlier run usable
+ *
+ * What was reserved in the line but never used is given back.  If that
+ * leaves less than bsize bytes the line is retired instead.  Returns
+ * true if the line can be allocated from.
+ */
+static int
+line_recover(struct allocator *allocator, uint64_t idx, size_t bsize,
+	PMEMflushset *fsp)
+{
+	struct thread_line_info *line =
+			OFF_PTR(allocator, LINE_OFFSET(allocator, idx));
+	uint64_t len = line_end(allocator, idx, 1) -
+			LINE_OFFSET(allocator, idx);
+	uint64_t used = line_scan(allocator, idx, line);
+
+	if (len - used < bsize) {
+		line_retire(allocator, idx, line, used, fsp);
+		return 0;
+	}
+
+	line->offset = used;
+	line->carved = used;
+	libpmem_persist(allocator->is_pmem, line, sizeof (*line));
+
+	return 1;
+}
+
+/*
+ * partial_take -- (internal) take a line left by the last run of the pool
+ *
+ * Returns the index of a line with room for bsize bytes, or -1.
+ */
+static int64_t
+partial_take(struct allocator *allocator, size_t bsize,
+	PMEMflushset *fsp)
+{
+	for (int i = 0; i < ALLOC_PARTIAL; i++) {
+		uint64_t start = allocator->hdr->partial[i];
+
+		if (start == 0 || (start & PARTIAL_OWNED) ||
+				!__sync_bool_compare_and_swap(
+					&allocator->hdr->partial[i], start,
+					start | PARTIAL_OWNED))
+			continue;
+
+		uint64_t idx = (start - allocator->base_offset) / LINE_SIZE;
+		if (line_recover(allocator, idx, bsize, fsp))
+			return (int64_t)idx;
+	}
+
+	return -1;
+}
+
+/*
+ * lines_put -- (internal) put a run of lines on the list of free runs
+ *
+ * Free runs right before or after it are taken off the list and merged
+ * into it.  The caller must hold runs_lock.
+ */
+static void
+lines_put(struct allocator *allocator, uint64_t idx, uint64_t n)
+{
+	uint64_t start = LINE_OFFSET(allocator, idx);
+	uint64_t end = LINE_OFFSET(allocator, idx + n);
+	uint64_t *prevp = &allocator->hdr->free_lines;
+
+	while (*prevp) {
+		struct huge_info *run = OFF_PTR(allocator, *prevp);
+		uint64_t run_end = *prevp + run->lines * LINE_SIZE;
+
+		if (run_end != start && *prevp != end) {
+			prevp = &run->next;
+			continue;
+		}
+
+		if (run_end == start)
+			start = *prevp;
+		else
+			end = run_end;
+
+		*prevp = run->next;
+		libpmem_persist(allocator->is_pmem, prevp, sizeof (*prevp));
+	}
+
+	struct huge_info *run = OFF_PTR(allocator, start);
+
+	run->lines = (end - start) / LINE_SIZE;
+	run->next = allocator->hdr->free_lines;
+	run->valid = FREE_INFO_VALID;
+	libpmem_persist(allocator->is_pmem, run, sizeof (*run));
+	allocator->hdr->free_lines = start;
+	libpmem_persist(allocator->is_pmem, &allocator->hdr->free_lines,
+			sizeof (allocator->hdr->free_lines));
+}
+
+/*
+ * What one stats_recount() thread counts, and the blocks it found still
+ * marked as cached, chained up by class to go back on the free lists.
+ */
+struct recount {
+	struct allocator *allocator;
+	unsigned n;			/* threads counting */
+	unsigned w;			/* this one's share */
+	int error;			/* errno of a failed drain, or 0 */
+	PMEMflushset fs;
+	uint64_t blocks[ALLOC_CLASSES];
+	uint64_t free[ALLOC_ARENAS][ALLOC_CLASSES];
+	uint64_t huge_objects;
+	uint64_t huge_bytes;
+	uint64_t first[ALLOC_CLASSES];	/* chains of formerly cached blocks */
+	uint64_t last[ALLOC_CLASSES];
+	unsigned count[ALLOC_CLASSES];
+};
+
+/*
+ * recount_line -- (internal) count the blocks carved out of a thread line
+ *
+ * Cached blocks are unmarked and chained up in rp.  Both the headers and
+ * the links are added to rp's flush set, to be persistent before the
+ * chains go on a free list.
+ */
+static void
+recount_line(struct recount *rp, uint64_t idx)
+{
+	struct allocator *allocator = rp->allocator;
+	uint64_t start = LINE_OFFSET(allocator, idx);
+	struct thread_line_info *line = OFF_PTR(allocator, start);
+	uint64_t end = line_end(allocator, idx, 1);
+	uint64_t off = start + LINE_HDR_SIZE;
+
+	if (start + line->offset < end)
+		end = start + line->offset;
+
+	while (off + sizeof (struct block_hdr) <= end) {
+		struct free_block *blk = OFF_PTR(allocator, off);
+		uint64_t size = blk->hdr.size & ~(uint64_t)BLOCK_CACHED;
+
+		if (size < sizeof (blk->hdr) || (size & 7) || size > end - off)
+			break;
+
+		if (size >= BLOCK_MIN)
+			rp->blocks[class_floor(size)]++;
+
+		if (blk->hdr.size & BLOCK_CACHED) {
+			unsigned c = class_floor(size);
+
+			blk->hdr.size = size;
+			blk->next = rp->first[c];
+			pmem_flushset_add(&rp->fs, blk, sizeof (*blk));
+			if (rp->count[c]++ == 0)
+				rp->last[c] = off;
+			rp->first[c] = off;
+		}
+		off += size;
+	}
+}
+
+/*
+ * recount_seg -- (internal) count the huge objects in a segment
+ */
+static void
+recount_seg(struct recount *rp, uint64_t start)
+{
+	struct allocator *allocator = rp->allocator;
+	uint64_t end = seg_end(allocator, start);
+	uint64_t off = start + SEG_HDR_SIZE;
+
+	while (off + sizeof (struct extent) <= end) {
+		struct extent *ext = OFF_PTR(allocator, off);
+
+		if (ext->size < EXTENT_UNIT || ext->size > end - off)
+			break;
+
+		if (ext->valid == EXTENT_USED_VALID) {
+			rp->huge_objects++;
+			rp->huge_bytes += ext->size;
+		}
+		off += ext->size;
+	}
+}
+
+/*
+ * recount_thread -- (internal) count one thread's share of the heap
+ *
+ * Every thread hops over the line headers, which is one read per line,
+ * and walks every n-th free list, thread line and segment it finds.
+ * The only pool writes are to blocks still marked cached in the thread
+ * lines it was given, which recount_line() chains together and flushes
+ * through its own flush set.  The shared free lists are only read here,
+ * the chains are spliced onto them after all threads are joined.
+ */
+static void *
+recount_thread(void *arg)
+{
+	struct recount *rp = arg;
+	struct allocator *allocator = rp->allocator;
+	struct allocator_hdr *hdr = allocator->hdr;
+
+	for (unsigned i = rp->w; i < ALLOC_ARENAS * ALLOC_CLASSES; i += rp->n) {
+		unsigned a = i / ALLOC_CLASSES;
+		unsigned c = i % ALLOC_CLASSES;
+
+		for (uint64_t off = hdr->free[a][c]; off; off =
+				((struct free_block *)
+				OFF_PTR(allocator, off))->next)
+			rp->free[a][c]++;
+	}
+
+	uint64_t idx = 0;
+	unsigned k = 0;		/* lines and segments found so far */
+
+	while (idx < hdr->lines_used) {
+		uint64_t start = LINE_OFFSET(allocator, idx);
+		struct huge_info *huge = OFF_PTR(allocator, start);
+		uint64_t next = idx + 1;
+		int mine = k++ % rp->n == rp->w;
+
+		if (huge->valid == LINE_INFO_VALID) {
+			if (mine)
+				recount_line(rp, idx);
+		} else if (huge->valid == HUGE_INFO_VALID ||
+				huge->valid == FREE_INFO_VALID) {
+			if (huge->lines &&
+					huge->lines <= allocator->nlines - idx)
+				next = idx + huge->lines;
+			if (mine && huge->valid == HUGE_INFO_VALID)
+				recount_seg(rp, start);
+		}
+
+		idx = next;
+	}
+
+	if (pmem_flushset_drain(&rp->fs) < 0)
+		rp->error = errno;
+
+	return NULL;
+}
+
+/*
+ * stats_recount -- (internal) count blocks and huge objects from scratch
+ *
+ * Walks every block in the heap, so it's only done when the counters
+ * kept in the summary can't be trusted.  The walk is spread over up to
+ * RECOUNT_MAX_THREADS threads, one per CPU; if a thread can't be
+ * created, its share is counted by the calling thread.  Blocks still
+ * marked as cached were in a thread cache when the pool wasn't closed
+ * cleanly, they go back on the free lists once everything is counted.
+ * Returns -1 with errno set if those couldn't be made persistent.
+ */
+static int
+stats_recount(struct allocator *allocator)
+{
+	struct allocator_hdr *hdr = allocator->hdr;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned n = ncpus < 1 ? 1 : ncpus < RECOUNT_MAX_THREADS ?
+			(unsigned)ncpus : RECOUNT_MAX_THREADS;
+
+	if (hdr->lines_used < n)
+		n = hdr->lines_used ? (unsigned)hdr->lines_used : 1;
+
+	struct recount one;
+	struct recount *rv = NULL;
+
+	if (n > 1 && (rv = Malloc(n * sizeof (*rv))) == NULL)
+		LOG(1, "!Malloc");
+	if (rv == NULL) {
+		n = 1;
+		rv = &one;
+	}
+
+	pthread_t threads[RECOUNT_MAX_THREADS];
+	int started[RECOUNT_MAX_THREADS];
+
+	for (unsigned w = 0; w < n; w++) {
+		memset(&rv[w], 0, sizeof (rv[w]));
+		rv[w].allocator = allocator;
+		rv[w].n = n;
+		rv[w].w = w;
+		libpmem_flushset_init(&rv[w].fs, allocator->is_pmem, NULL);
+
+		/* the calling thread takes the last share itself */
+		started[w] = w + 1 < n && pthread_create(&threads[w], NULL,
+				recount_thread, &rv[w]) == 0;
+		if (!started[w])
+			recount_thread(&rv[w]);
+	}
+
+	for (unsigned w = 0; w < n; w++)
+		if (started[w])
+			pthread_join(threads[w], NULL);
+
+	memset(hdr->class_blocks, 0, sizeof (hdr->class_blocks));
+	memset(hdr->class_free, 0, sizeof (hdr->class_free));
+	hdr->huge_objects = 0;
+	hdr->huge_bytes = 0;
+
+	int error = 0;
+
+	for (unsigned w = 0; w < n; w++) {
+		struct recount *rp = &rv[w];
+
+		for (unsigned c = 0; c < ALLOC_CLASSES; c++)
+			hdr->class_blocks[0][c] += rp->blocks[c];
+		for (unsigned a = 0; a < ALLOC_ARENAS; a++)
+			for (unsigned c = 0; c < ALLOC_CLASSES; c++)
+				hdr->class_free[a][c] += rp->free[a][c];
+		hdr->huge_objects += rp->huge_objects;
+		hdr->huge_bytes += rp->huge_bytes;
+
+		/* unmarked, but not linked persistently, leave them lost */
+		if (rp->error) {
+			if (error == 0)
+				error = rp->error;
+			continue;
+		}
+
+		unsigned own = arena_of(allocator);
+		for (unsigned c = 0; c < ALLOC_CLASSES; c++)
+			if (rp->count[c])
+				class_splice(allocator, own, c, rp->first[c],
+						rp->last[c], rp->count[c]);
+	}
+
+	if (rv != &one)
+		Free(rv);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * summary_rebuild -- (internal) make the heap summary up from line headers
+ *
+ * Lines threads were allocating from are listed as partial ones, or
+ * retired if there's no slot left for them.  Lines below the last one
+ * used that never got a header are put on the free runs.  That much is
+ * one header read per line, plus the last reservation of each partial
+ * line.  The statistics cost a walk over every block and free list
+ * though, which is why stats_recount() spreads it over threads.
+ * Returns -1 with errno set if the free lists couldn't be made
+ * persistent.
+ */
+static int
+summary_rebuild(struct allocator *allocator)
+{
+	PMEMflushset fs;
+	libpmem_flushset_init(&fs, allocator->is_pmem, NULL);
+
+	memset(allocator->hdr->partial, 0, sizeof (allocator->hdr->partial));
+
+	int nlisted = 0;
+	uint64_t hole = 0;	/* first line of the run without headers */
+	uint64_t idx = 0;
+
+	while (idx < allocator->nlines) {
+		struct huge_info *huge =
+			OFF_PTR(allocator, LINE_OFFSET(allocator, idx));
+		uint64_t next = idx + 1;
+
+		if (huge->valid == HUGE_INFO_VALID ||
+				huge->valid == FREE_INFO_VALID) {
+			if (huge->lines &&
+					huge->lines <= allocator->nlines - idx)
+				next = idx + huge->lines;
+		} else if (huge->valid == LINE_INFO_VALID) {
+			struct thread_line_info *line = (void *)huge;
+			uint64_t len = line_end(allocator, idx, 1) -
+					LINE_OFFSET(allocator, idx);
+
+			/* a line filled up to its end has been retired */
+			if (line->offset < len && nlisted < ALLOC_PARTIAL) {
+				if (line_recover(allocator, idx, BLOCK_MIN,
+						&fs))
+					allocator->hdr->partial[nlisted++] =
+						LINE_OFFSET(allocator, idx);
+			} else if (line->offset < len) {
+				line_retire(allocator, idx, line,
+					line_scan(allocator, idx, line), &fs);
+			}
+		} else {
+			idx = next;
+			continue;
+		}
+
+		if (hole < idx)
+			lines_put(allocator, hole, idx - hole);
+		hole = idx = next;
+	}
+
+	allocator->hdr->lines_used = hole;
+
+	int ret = stats_recount(allocator);
+
+	if (pmem_flushset_drain(&fs) < 0)
+		ret = -1;
+
+	return ret;
+}
+
+/*
+ * line_reserve -- (internal) reserve room for bsize more bytes in a line
+ *
+ * A whole LINE_RESERVE is reserved at a time, so only one allocation in
+ * many has to persist the line header.
+ */
+static void
+line_reserve(struct allocator *allocator, struct thread_line_info *line,
+	uint64_t len, size_t bsize)
+{
+	uint64_t end = Thread_line.next + bsize + LINE_RESERVE;
+
+	if (end > len)
+		end = len;
+
+	if (line->dirty) {
+		void *addr = (char *)line + line->offset;
+
+		memset(addr, 0, end - line->offset);
+		libpmem_persist(allocator->is_pmem, addr, end - line->offset);
+	}
+
+	line->offset = end;
+	line->carved = Thread_line.next;
+	libpmem_persist(allocator->is_pmem, line, sizeof (*line));
+}
+
+/*
+ * get_thread_line -- (internal) return a line with room for bsize bytes
+ */
+static struct thread_line_info *
+get_thread_line(struct allocator *allocator, size_t bsize,
+	PMEMflushset *fsp)
+{
+	struct thread_line_info *line = Thread_line.line;
+
+	if (Thread_line.id == allocator->id) {
+		uint64_t idx = Thread_line.idx;
+		uint64_t len = line_end(allocator, idx, 1) -
+				LINE_OFFSET(allocator, idx);
+
+		if (Thread_line.next + bsize <= line->offset)
+			return line;
+
+		if (Thread_line.next + bsize <= len) {
+			line_reserve(allocator, line, len, bsize);
+			return line;
+		}
+
+		line_retire(allocator, idx, line, Thread_line.next, fsp);
+	}
+
+	Thread_line.line = NULL;
+	Thread_line.id = 0;
+
+	thread_key_set();
+
+	int64_t idx = partial_take(allocator, bsize, fsp);
+
+	if (idx < 0) {
+		idx = lines_take(allocator, 1);
+		if (idx < 0)
+			return NULL;
+		partial_add(allocator, LINE_OFFSET(allocator, idx));
+	}
+
+	line = OFF_PTR(allocator, LINE_OFFSET(allocator, idx));
+	uint64_t len = line_end(allocator, idx, 1) -
+			LINE_OFFSET(allocator, idx);
+
+	if (line->valid != LINE_INFO_VALID) {
+		/*
+		 * The header must be good before it's marked valid.  Lines
+		 * from free runs held huge objects, fresh ones are zeroed.
+		 */
+		line->dirty = line->valid == FREE_INFO_VALID;
+		line->offset = LINE_HDR_SIZE;
+		Thread_line.next = LINE_HDR_SIZE;
+		line_reserve(allocator, line, len, bsize);
+		line->valid = LINE_INFO_VALID;
+		libpmem_persist(allocator->is_pmem, line, sizeof (*line));
+	} else {
+		/* a line left over by the last run, see partial_take() */
+		Thread_line.next = line->offset;
+		line_reserve(allocator, line, len, bsize);
+	}
+
+	Thread_line.id = allocator->id;
+	Thread_line.idx = (uint64_t)idx;
+	Thread_line.line = line;
+
+	return line;
+}
+
+/*
+ * thread_alloc -- (internal) carve a block out of the thread's line
+ *
+ * The block is placed so the object in it is aligned to align bytes.
+ * Only the block header has to become persistent, the line header
+ * already covers the block.
+ */
+static uint64_t
+thread_alloc(struct allocator *allocator, size_t bsize, size_t align,
+	PMEMflushset *fsp)
+{
+	size_t slack = align - sizeof (struct block_hdr);
+	struct thread_line_info *line =
+			get_thread_line(allocator, bsize + slack, fsp);
+
+	if (line == NULL)
+		return 0;
+
+	uint64_t off = LINE_OFFSET(allocator, Thread_line.idx) +
+			Thread_line.next;
+	uint64_t gap = roundup(off + sizeof (struct block_hdr), align) -
+			sizeof (struct block_hdr) - off;
+
+	if (gap) {
+		/* what's skipped is a block too, line_scan() walks it */
+		struct block_hdr *pad = OFF_PTR(allocator, off);
+		pad->size = gap;
+
+		if (gap >= BLOCK_MIN) {
+			libpmem_persist(allocator->is_pmem, pad,
+					sizeof (*pad));
+			block_count(allocator, gap);
+			class_push(allocator, off, fsp);
+		} else {
+			pmem_flushset_add(fsp, pad, sizeof (*pad));
+		}
+
+		off += gap;
+	}
+
+	Thread_line.next += gap + bsize;
+
+	struct block_hdr *hdr = OFF_PTR(allocator, off);
+	hdr->size = bsize;
+	pmem_flushset_add(fsp, hdr, sizeof (*hdr));
+	block_count(allocator, bsize);
+
+	return off;
+}
+
+/*
+ * thread_extend -- (internal) grow the block at off to bsize bytes in place
+ *
+ * Only the block carved last out of the thread's line can grow, into
+ * the space following it.  The header is persisted right away, as
+ * line_scan() must see the bigger block before anything gets stored
+ * past its old end.  Returns 0 on success, otherwise -1.
+ */
+static int
+thread_extend(struct allocator *allocator, uint64_t off, size_t bsize)
+{
+	struct block_hdr *hdr = OFF_PTR(allocator, off);
+	struct thread_line_info *line = Thread_line.line;
+
+	if (Thread_line.id != allocator->id)
+		return -1;
+
+	uint64_t idx = Thread_line.idx;
+	uint64_t start = LINE_OFFSET(allocator, idx);
+	uint64_t len = line_end(allocator, idx, 1) - start;
+	size_t grow = bsize - hdr->size;
+
+	if (off + hdr->size != start + Thread_line.next ||
+			Thread_line.next + grow > len)
+		return -1;
+
+	if (Thread_line.next + grow > line->offset)
+		line_reserve(allocator, line, len, grow);
+
+	block_uncount(allocator, hdr->size);
+	block_count(allocator, bsize);
+
+	Thread_line.next += grow;
+	hdr->size = bsize;
+	libpmem_persist(allocator->is_pmem, hdr, sizeof (*hdr));
+
+	return 0;
+}
+
+/*
+ * block_take -- (internal) take the free block at off off its list
+ *
+ * The block is looked for in the thread's cache, then on the free lists
+ * of its class, up to STEAL_MAX blocks into each.  Returns 0 if it was
+ * found and is the caller's now, otherwise -1.
+ */
+static int
+block_take(struct allocator *allocator, uint64_t off, size_t size,
+	PMEMflushset *fsp)
+{
+	struct free_block *blk = OFF_PTR(allocator, off);
+	unsigned c = class_floor(size);
+	struct tcache *tc = tcache_get(allocator);
+
+	if (tc != NULL) {
+		uint64_t *prevp = &tc->free[c];
+
+		while (*prevp && *prevp != off)
+			prevp = &((struct free_block *)
+					OFF_PTR(allocator, *prevp))->next;
+
+		if (*prevp) {
+			*prevp = blk->next;
+			tc->count[c]--;
+			blk->hdr.size &= ~(uint64_t)BLOCK_CACHED;
+			pmem_flushset_add(fsp, &blk->hdr, sizeof (blk->hdr));
+			return 0;
+		}
+	}
+
+	for (unsigned a = 0; a < ALLOC_ARENAS; a++) {
+		if (allocator->hdr->free[a][c] == 0)
+			continue;
+
+		pthread_mutex_lock(&allocator->class_lock[a][c]);
+		uint64_t *prevp = &allocator->hdr->free[a][c];
+		unsigned n = 0;
+
+		while (*prevp && *prevp != off && n++ < STEAL_MAX)
+			prevp = &((struct free_block *)
+					OFF_PTR(allocator, *prevp))->next;
+
+		int found = *prevp == off;
+		if (found) {
+			*prevp = blk->next;
+			libpmem_persist(allocator->is_pmem, prevp,
+					sizeof (*prevp));
+			allocator->hdr->class_free[a][c]--;
+		}
+		pthread_mutex_unlock(&allocator->class_lock[a][c]);
+
+		if (found)
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * block_split -- (internal) cut the block at off down to bsize bytes
+ *
+ * The rest is freed, unless it's too small to be a block, then the block
+ * keeps it.  The rest's header is persisted before the block shrinks, so
+ * line_scan() never finds a hole.
+ */
+static void
+block_split(struct allocator *allocator, uint64_t off, size_t bsize,
+	PMEMflushset *fsp)
+{
+	struct block_hdr *hdr = OFF_PTR(allocator, off);
+	size_t rest = hdr->size - bsize;
+
+	if (rest < BLOCK_MIN)
+		return;
+
+	struct block_hdr *rhdr = OFF_PTR(allocator, off + bsize);
+	rhdr->size = rest;
+	libpmem_persist(allocator->is_pmem, rhdr, sizeof (*rhdr));
+
+	block_uncount(allocator, hdr->size);
+	block_count(allocator, bsize);
+	block_count(allocator, rest);
+
+	hdr->size = bsize;
+	libpmem_persist(allocator->is_pmem, hdr, sizeof (*hdr));
+
+	if (tcache_push(allocator, off + bsize, fsp) < 0)
+		class_push(allocator, off + bsize, fsp);
+}
+
+/*
+ * block_absorb -- (internal) grow the block at off to bsize bytes in place
+ *
+ * Works for any block whose neighbor is free, on a free list or in the
+ * calling thread's cache: the neighbor is taken and merged in, and what
+ * isn't needed of it is freed again.  Returns 0 on success, otherwise -1.
+ */
+static int
+block_absorb(struct allocator *allocator, uint64_t off, size_t bsize,
+	PMEMflushset *fsp)
+{
+	struct block_hdr *hdr = OFF_PTR(allocator, off);
+	uint64_t idx = (off - allocator->base_offset) / LINE_SIZE;
+	uint64_t start = LINE_OFFSET(allocator, idx);
+	struct thread_line_info *line = OFF_PTR(allocator, start);
+	uint64_t end = line_end(allocator, idx, 1);
+	uint64_t next = off + hdr->size;
+
+	if (start + line->offset < end)
+		end = start + line->offset;
+	if (next + BLOCK_MIN > end)
+		return -1;
+
+	/* only trusted once the block is found on a list */
+	struct block_hdr *nhdr = OFF_PTR(allocator, next);
+	uint64_t nsize = nhdr->size & ~(uint64_t)BLOCK_CACHED;
+
+	if (nsize < BLOCK_MIN || (nsize & 7) || nsize > end - next ||
+			hdr->size + nsize < bsize)
+		return -1;
+
+	if (block_take(allocator, next, nsize, fsp) < 0)
+		return -1;
+
+	block_uncount(allocator, hdr->size);
+	block_uncount(allocator, nsize);
+	block_count(allocator, hdr->size + nsize);
+
+	hdr->size += nsize;
+	libpmem_persist(allocator->is_pmem, hdr, sizeof (*hdr));
+
+	block_split(allocator, off, bsize, fsp);
+
+	return 0;
+}
+
+/*
+ * extent_link -- (internal) put a free extent on the list as it is
+ */
+static void
+extent_link(struct allocator *allocator, uint64_t off, uint64_t size,
+	uint64_t seg)
+{
+	struct extent *ext = OFF_PTR(allocator, off);
+
+	ext->size = size;
+	ext->seg = seg;
+	ext->next = allocator->hdr->free_extents;
+	ext->valid = EXTENT_FREE_VALID;
+	libpmem_persist(allocator->is_pmem, ext, sizeof (*ext));
+	allocator->hdr->free_extents = off;
+	libpmem_persist(allocator->is_pmem, &allocator->hdr->free_extents,
+			sizeof (allocator->hdr->free_extents));
+}
+
+/*
+ * extent_put -- (internal) free an extent, merging it with its neighbors
+ *
+ * Free extents of the same segment right before or after it are taken
+ * off the list first, so a crash can only leak them.  If the whole
+ * segment ends up free, its lines are put on the free runs.  The caller
+ * must hold extent_lock.
+ */
+static void
+extent_put(struct allocator *allocator, uint64_t off, uint64_t size,
+	uint64_t seg)
+{
+	uint64_t end = off + size;
+	uint64_t *prevp = &allocator->hdr->free_extents;
+
+	while (*prevp) {
+		struct extent *ext = OFF_PTR(allocator, *prevp);
+
+		if (ext->seg != seg ||
+				(*prevp + ext->size != off && *prevp != end)) {
+			prevp = &ext->next;
+			continue;
+		}
+
+		if (*prevp < off)
+			off = *prevp;
+		else
+			end = *prevp + ext->size;
+
+		*prevp = ext->next;
+		libpmem_persist(allocator->is_pmem, prevp, sizeof (*prevp));
+	}
+
+	if (off == seg + SEG_HDR_SIZE && end == seg_end(allocator, seg)) {
+		struct huge_info *huge = OFF_PTR(allocator, seg);
+
+		pthread_mutex_lock(&allocator->runs_lock);
+		lines_put(allocator, (seg - allocator->base_offset) / LINE_SIZE,
+				huge->lines);
+		pthread_mutex_unlock(&allocator->runs_lock);
+		return;
+	}
+
+	extent_link(allocator, off, end - off, seg);
+}
+
+/*
+ * extent_take -- (internal) take an extent of at least size bytes
+ *
+ * The first free extent big enough is used, split if the rest makes a
+ * useful extent.  The caller must hold extent_lock.  Returns the offset
+ * of the extent, or 0.
+ */
+static uint64_t
+extent_take(struct allocator *allocator, uint64_t size)
+{
+	uint64_t *prevp = &allocator->hdr->free_extents;
+
+	while (*prevp) {
+		struct extent *ext = OFF_PTR(allocator, *prevp);
+
+		if (ext->size < size) {
+			prevp = &ext->next;
+			continue;
+		}
+
+		uint64_t off = *prevp;
+		uint64_t next = ext->next;
+
+		if (ext->size - size >= EXTENT_UNIT) {
+			/* split, the rest of the extent stays free */
+			struct extent *rest = OFF_PTR(allocator, off + size);
+			rest->size = ext->size - size;
+			rest->seg = ext->seg;
+			rest->next = ext->next;
+			rest->valid = EXTENT_FREE_VALID;
+			libpmem_persist(allocator->is_pmem, rest,
+					sizeof (*rest));
+			next = off + size;
+			ext->size = size;
+		}
+
+		*prevp = next;
+		libpmem_persist(allocator->is_pmem, prevp, sizeof (*prevp));
+
+		ext->valid = EXTENT_USED_VALID;
+		libpmem_persist(allocator->is_pmem, ext, sizeof (*ext));
+		return off;
+	}
+
+	return 0;
+}
+
+/*
+ * seg_grow -- (internal) add lines for extents of size bytes
+ *
+ * If a free extent ends where fresh space starts, the segment holding it
+ * grows into the fresh lines, so objects bigger than what's left get
+ * placed right after it.  Otherwise the lines make up a new segment.
+ * The caller must hold extent_lock.  Returns 0 on success, or -1.
+ */
+static int
+seg_grow(struct allocator *allocator, uint64_t size)
+{
+	struct extent *tail = NULL;
+	uint64_t fresh = LINE_OFFSET(allocator, allocator->hdr->lines_used);
+
+	for (uint64_t off = allocator->hdr->free_extents; off; ) {
+		struct extent *ext = OFF_PTR(allocator, off);
+
+		if (off + ext->size == fresh &&
+				seg_end(allocator, ext->seg) == fresh) {
+			tail = ext;
+			break;
+		}
+		off = ext->next;
+	}
+
+	int64_t idx;
+	uint64_t n;
+
+	if (tail) {
+		n = (size - tail->size + LINE_SIZE - 1) / LINE_SIZE;
+		idx = fresh_take(allocator, n);
+
+		if (idx >= 0 && LINE_OFFSET(allocator, idx) == fresh) {
+			/* lines holding data must never look fresh */
+			struct huge_info *huge = OFF_PTR(allocator, tail->seg);
+			huge->lines += n;
+			libpmem_persist(allocator->is_pmem, huge,
+					sizeof (*huge));
+
+			extent_put(allocator, fresh,
+				line_end(allocator, idx, n) - fresh, tail->seg);
+			return 0;
+		}
+
+		/* another thread took the lines next to it first */
+		if (idx >= 0) {
+			pthread_mutex_lock(&allocator->runs_lock);
+			lines_put(allocator, (uint64_t)idx, n);
+			pthread_mutex_unlock(&allocator->runs_lock);
+		}
+	}
+
+	n = (SEG_HDR_SIZE + size + LINE_SIZE - 1) / LINE_SIZE;
+	if ((idx = lines_take(allocator, n)) < 0)
+		return -1;
+
+	uint64_t start = LINE_OFFSET(allocator, idx);
+	uint64_t end = line_end(allocator, idx, n);
+
+	if (end - start < SEG_HDR_SIZE + size) {
+		/* only runs ending with a short last line get here */
+		pthread_mutex_lock(&allocator->runs_lock);
+		lines_put(allocator, (uint64_t)idx, n);
+		pthread_mutex_unlock(&allocator->runs_lock);
+		return -1;
+	}
+
+	struct huge_info *huge = OFF_PTR(allocator, start);
+	huge->valid = HUGE_INFO_VALID;
+	huge->lines = n;
+	libpmem_persist(allocator->is_pmem, huge, sizeof (*huge));
+
+	extent_link(allocator, start + SEG_HDR_SIZE,
+			end - start - SEG_HDR_SIZE, start);
+	return 0;
+}
+
+/*
+ * huge_alloc -- (internal) allocate an extent for one object
+ *
+ * Extents are rounded up to EXTENT_UNIT, not to whole lines.
+ */
+static int
+huge_alloc(struct allocator *allocator, uint64_t *ptr, size_t size,
+	PMEMflushset *fsp)
+{
+	uint64_t esize = roundup(EXTENT_HDR_SIZE + size, EXTENT_UNIT);
+	uint64_t off;
+
+	pthread_mutex_lock(&allocator->extent_lock);
+	while ((off = extent_take(allocator, esize)) == 0)
+		if (seg_grow(allocator, esize) < 0)
+			break;
+	if (off) {
+		allocator->hdr->huge_objects++;
+		allocator->hdr->huge_bytes += ((struct extent *)
+				OFF_PTR(allocator, off))->size;
+	}
+	pthread_mutex_unlock(&allocator->extent_lock);
+
+	if (off == 0) {
+		*ptr = 0;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	struct extent *ext = OFF_PTR(allocator, off);
+	*ptr = off + EXTENT_HDR_SIZE;
+
+	struct block_hdr *hdr = OFF_PTR(allocator, *ptr - sizeof (*hdr));
+	hdr->size = (ext->size - EXTENT_HDR_SIZE + sizeof (*hdr)) | BLOCK_HUGE;
+	pmem_flushset_add(fsp, hdr, sizeof (*hdr));
+
+	return 0;
+}
+
+/*
+ * pmalloc -- allocate size bytes, storing the offset in *ptr
+ *
+ * The allocator metadata updated by the allocation is added to the
+ * flush set fsp and becomes persistent when the caller drains it,
+ * together with anything else the caller added.  Returns 0 on success,
+ * otherwise -1 with errno set and *ptr zeroed.
+ */
+int
+pmalloc(struct allocator *allocator, uint64_t *ptr, size_t size,
+	PMEMflushset *fsp)
+{
+	size_t bsize = ALIGN(size + sizeof (struct block_hdr));
+
+	if (bsize > SMALL_MAX)
+		return huge_alloc(allocator, ptr, size, fsp);
+
+	unsigned c = class_of(bsize);
+	bsize = class_size(c);
+
+	uint64_t off = tcache_pop(allocator, c, fsp);
+	if (off == 0)
+		off = class_pop(allocator, c);
+	if (off == 0)
+		off = thread_alloc(allocator, bsize,
+				sizeof (struct block_hdr), fsp);
+
+	/* out of lines, any bigger free block will do */
+	while (off == 0 && ++c < ALLOC_CLASSES)
+		off = class_pop(allocator, c);
+
+	if (off == 0) {
+		*ptr = 0;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	*ptr = off + sizeof (struct block_hdr);
+	return 0;
+}
+
+/*
+ * aligned_pop -- (internal) take a free block of class c or bigger whose
+ *	data is aligned to align bytes
+ *
+ * Up to ALIGNED_TRIES blocks of each class are looked at, cached ones
+ * first.  Those that don't fit are put back once the class is done
+ * with, so the same block isn't popped twice.  Returns the block's
+ * offset, or 0 if none was found.
+ */
+static uint64_t
+aligned_pop(struct allocator *allocator, unsigned c, size_t align,
+	PMEMflushset *fsp)
+{
+	uint64_t found = 0;
+
+	for (; found == 0 && c < ALLOC_CLASSES; c++) {
+		uint64_t skipped[ALIGNED_TRIES];
+		unsigned n = 0;
+
+		while (n < ALIGNED_TRIES) {
+			uint64_t off = tcache_pop(allocator, c, fsp);
+			if (off == 0)
+				off = class_pop(allocator, c);
+			if (off == 0)
+				break;
+
+			if ((off + sizeof (struct block_hdr)) % align == 0) {
+				found = off;
+				break;
+			}
+			skipped[n++] = off;
+		}
+
+		while (n--)
+			if (tcache_push(allocator, skipped[n], fsp) < 0)
+				class_push(allocator, skipped[n], fsp);
+	}
+
+	return found;
+}
+
+/*
+ * pmalloc_aligned -- allocate size bytes aligned to alignment bytes
+ *
+ * Alignments up to a page are supported.  Small objects are carved
+ * out of the thread's line, the space skipped to align them goes on
+ * the free lists; once there are no lines left, a free block that
+ * happens to be aligned is used instead.  Huge objects are always
+ * page aligned.  Otherwise the same as pmalloc().
+ */
+int
+pmalloc_aligned(struct allocator *allocator, uint64_t *ptr,
+	size_t alignment, size_t size, PMEMflushset *fsp)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) ||
+			alignment > EXTENT_UNIT) {
+		LOG(1, "alignment %zu isn't a power of two up to %d",
+				alignment, EXTENT_UNIT);
+		*ptr = 0;
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (alignment <= sizeof (struct block_hdr))
+		return pmalloc(allocator, ptr, size, fsp);
+
+	size_t bsize = ALIGN(size + sizeof (struct block_hdr));
+
+	if (bsize > SMALL_MAX)
+		return huge_alloc(allocator, ptr, size, fsp);
+
+	unsigned c = class_of(bsize);
+	bsize = class_size(c);
+
+	uint64_t off = thread_alloc(allocator, bsize, alignment, fsp);
+	if (off == 0)
+		off = aligned_pop(allocator, c, alignment, fsp);
+
+	if (off == 0) {
+		*ptr = 0;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	*ptr = off + sizeof (struct block_hdr);
+	return 0;
+}
+
+/*
+ * pfree -- free a block allocated by pmalloc()
+ *
+ * As with pmalloc(), the free list heads changed are added to fsp.
+ */
+void
+pfree(struct allocator *allocator, uint64_t ptr, PMEMflushset *fsp)
+{
+	if (ptr == 0)
+		return;
+
+	uint64_t off = ptr - sizeof (struct block_hdr);
+	struct block_hdr *hdr = OFF_PTR(allocator, off);
+
+	if (!(hdr->size & BLOCK_HUGE)) {
+		ASSERT(!(hdr->size & BLOCK_CACHED));
+		if (tcache_push(allocator, off, fsp) < 0)
+			class_push(allocator, off, fsp);
+		return;
+	}
+
+	uint64_t start = ptr - EXTENT_HDR_SIZE;
+	struct extent *ext = OFF_PTR(allocator, start);
+
+	ASSERTeq(ext->valid, EXTENT_USED_VALID);
+
+	pthread_mutex_lock(&allocator->extent_lock);
+	allocator->hdr->huge_objects--;
+	allocator->hdr->huge_bytes -= ext->size;
+	extent_put(allocator, start, ext->size, ext->seg);
+	pthread_mutex_unlock(&allocator->extent_lock);
+}
+
+/*
+ * psize -- return the usable size of the block at ptr
+ *
+ * That's at least the size asked for when the block was allocated,
+ * found in the block's header, so it takes no lock.
+ */
+size_t
+psize(struct allocator *allocator, uint64_t ptr)
+{
+	struct block_hdr *hdr = OFF_PTR(allocator, ptr - sizeof (*hdr));
+
+	return (hdr->size & ~(uint64_t)(BLOCK_HUGE | BLOCK_CACHED)) -
+			sizeof (*hdr);
+}
+
+/*
+ * pextend -- grow the block at ptr in place to hold size bytes
+ *
+ * A small object grows into its thread's line if it was the last one
+ * carved out of it, up to the size of a class, so growing it again
+ * doesn't have to move it each time.  Otherwise it takes in the block
+ * following it, if that one is free, see block_absorb().  A huge object
+ * grows into the free extent following it, if there's one big enough.
+ * Returns 0 if the block holds size bytes now, otherwise -1, leaving it
+ * as it was.  pshrink() undoes it.
+ */
+int
+pextend(struct allocator *allocator, uint64_t ptr, size_t size,
+	PMEMflushset *fsp)
+{
+	struct block_hdr *hdr = OFF_PTR(allocator, ptr - sizeof (*hdr));
+
+	if (!(hdr->size & BLOCK_HUGE)) {
+		size_t bsize = ALIGN(size + sizeof (*hdr));
+
+		if (bsize <= hdr->size)
+			return 0;
+		if (bsize > SMALL_MAX)
+			return -1;
+
+		if (thread_extend(allocator, ptr - sizeof (*hdr),
+				class_size(class_of(bsize))) == 0)
+			return 0;
+
+		return block_absorb(allocator, ptr - sizeof (*hdr), bsize,
+				fsp);
+	}
+
+	uint64_t start = ptr - EXTENT_HDR_SIZE;
+	struct extent *ext = OFF_PTR(allocator, start);
+	uint64_t esize = roundup(EXTENT_HDR_SIZE + size, EXTENT_UNIT);
+
+	if (ext->size >= esize)
+		return 0;
+
+	int ret = -1;
+	uint64_t end = start + ext->size;
+	uint64_t *prevp = &allocator->hdr->free_extents;
+
+	pthread_mutex_lock(&allocator->extent_lock);
+	while (*prevp && *prevp != end)
+		prevp = &((struct extent *)OFF_PTR(allocator, *prevp))->next;
+
+	struct extent *next = *prevp ? OFF_PTR(allocator, *prevp) : NULL;
+
+	if (next && next->seg == ext->seg &&
+			ext->size + next->size >= esize) {
+		uint64_t total = ext->size + next->size;
+
+		*prevp = next->next;
+		libpmem_persist(allocator->is_pmem, prevp, sizeof (*prevp));
+
+		if (total - esize >= EXTENT_UNIT)
+			extent_link(allocator, start + esize, total - esize,
+					ext->seg);
+		else
+			esize = total;
+
+		allocator->hdr->huge_bytes += esize - ext->size;
+		ext->size = esize;
+		libpmem_persist(allocator->is_pmem, ext, sizeof (*ext));
+
+		hdr->size = (esize - EXTENT_HDR_SIZE + sizeof (*hdr)) |
+				BLOCK_HUGE;
+		pmem_flushset_add(fsp, hdr, sizeof (*hdr));
+		ret = 0;
+	}
+	pthread_mutex_unlock(&allocator->extent_lock);
+
+	return ret;
+}
+
+/*
+ * pshrink -- cut the block at ptr back to hold size bytes
+ *
+ * Undoes pextend(), size being what psize() said before.  What's cut
+ * off is freed, unless it's too small to be a block or an extent of its
+ * own, then the block keeps it.
+ */
+void
+pshrink(struct allocator *allocator, uint64_t ptr, size_t size,
+	PMEMflushset *fsp)
+{
+	struct block_hdr *hdr = OFF_PTR(allocator, ptr - sizeof (*hdr));
+
+	if (!(hdr->size & BLOCK_HUGE)) {
+		size_t bsize = ALIGN(size + sizeof (*hdr));
+
+		if (bsize < hdr->size)
+			block_split(allocator, ptr - sizeof (*hdr), bsize, fsp);
+		return;
+	}
+
+	uint64_t start = ptr - EXTENT_HDR_SIZE;
+	struct extent *ext = OFF_PTR(allocator, start);
+	uint64_t esize = roundup(EXTENT_HDR_SIZE + size, EXTENT_UNIT);
+
+	if (ext->size <= esize)
+		return;
+
+	pthread_mutex_lock(&allocator->extent_lock);
+
+	/* valid before the extent shrinks, a crash can only leak it */
+	uint64_t rest = ext->size - esize;
+	struct extent *rext = OFF_PTR(allocator, start + esize);
+
+	rext->valid = EXTENT_FREE_VALID;
+	rext->size = rest;
+	rext->seg = ext->seg;
+	rext->next = 0;
+	libpmem_persist(allocator->is_pmem, rext, sizeof (*rext));
+
+	allocator->hdr->huge_bytes -= rest;
+	ext->size = esize;
+	libpmem_persist(allocator->is_pmem, ext, sizeof (*ext));
+
+	hdr->size = (esize - EXTENT_HDR_SIZE + sizeof (*hdr)) | BLOCK_HUGE;
+	pmem_flushset_add(fsp, hdr, sizeof (*hdr));
+
+	extent_put(allocator, start + esize, rest, ext->seg);
+
+	pthread_mutex_unlock(&allocator->extent_lock);
+}
+
+/*
+ * allocator_class_stats -- return statistics of size class c
+ *
+ * Returns 0, or -1 with errno set if there's no such class.
+ */
+int
+allocator_class_stats(struct allocator *allocator, unsigned c,
+	struct pmemobj_class_stats *statsp)
+{
+	if (c >= ALLOC_CLASSES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* read without locks, the counts may be off by the blocks in flight */
+	uint64_t nfree = 0;
+	uint64_t nblocks = 0;
+
+	for (unsigned a = 0; a < ALLOC_ARENAS; a++) {
+		nblocks += allocator->hdr->class_blocks[a][c];
+		nfree += allocator->hdr->class_free[a][c];
+	}
+
+	pthread_mutex_lock(&allocator->tcache_lock);
+	for (struct tcache *tc = allocator->tcaches; tc; tc = tc->next)
+		nfree += tc->count[c];
+	pthread_mutex_unlock(&allocator->tcache_lock);
+
+	statsp->size = class_size(c);
+	statsp->free = nfree;
+	statsp->used = nblocks > nfree ? nblocks - nfree : 0;
+
+	return 0;
+}
+
+/*
+ * allocator_stats -- return statistics of the whole heap
+ *
+ * Only the lists of free runs and free extents are walked, both are
+ * short as their neighbors are merged.
+ */
+void
+allocator_stats(struct allocator *allocator,
+	struct pmemobj_heap_stats *statsp)
+{
+	memset(statsp, 0, sizeof (*statsp));
+
+	uint64_t heap_end = line_end(allocator, 0, allocator->nlines);
+	uint64_t fresh = LINE_OFFSET(allocator, allocator->hdr->lines_used);
+
+	statsp->heap_size = heap_end - allocator->base_offset;
+	statsp->lines_total = allocator->nlines;
+	statsp->lines_used = allocator->hdr->lines_used;
+	statsp->nclasses = ALLOC_CLASSES;
+
+	if (fresh < heap_end) {
+		statsp->free = heap_end - fresh;
+		statsp->largest_free = statsp->free;
+	}
+
+	for (unsigned c = 0; c < ALLOC_CLASSES; c++) {
+		struct pmemobj_class_stats cs;
+
+		allocator_class_stats(allocator, c, &cs);
+		statsp->used += cs.used * cs.size;
+		statsp->free += cs.free * cs.size;
+		if (cs.free && cs.size > statsp->largest_free)
+			statsp->largest_free = cs.size;
+	}
+
+	pthread_mutex_lock(&allocator->extent_lock);
+	statsp->huge_objects = allocator->hdr->huge_objects;
+	statsp->huge_bytes = allocator->hdr->huge_bytes;
+	for (uint64_t off = allocator->hdr->free_extents; off; ) {
+		struct extent *ext = OFF_PTR(allocator, off);
+
+		statsp->free_extents++;
+		statsp->free += ext->size;
+		if (ext->size > statsp->largest_free)
+			statsp->largest_free = ext->size;
+		off = ext->next;
+	}
+	pthread_mutex_unlock(&allocator->extent_lock);
+
+	statsp->used += statsp->huge_bytes;
+
+	pthread_mutex_lock(&allocator->runs_lock);
+	for (uint64_t off = allocator->hdr->free_lines; off; ) {
+		struct huge_info *run = OFF_PTR(allocator, off);
+		uint64_t idx = (off - allocator->base_offset) / LINE_SIZE;
+		uint64_t size = line_end(allocator, idx, run->lines) - off;
+
+		statsp->free_runs++;
+		statsp->free += size;
+		if (size > statsp->largest_free)
+			statsp->largest_free = size;
+		off = run->next;
+	}
+	pthread_mutex_unlock(&allocator->runs_lock);
+
+	if (statsp->free)
+		statsp->fragmentation = 1.0 -
+			(double)statsp->largest_free / statsp->free;
+}
+
+/*
+ * allocator_tcache_flush -- give the blocks in the thread's cache back
+ *
+ * As with pfree(), the free list heads changed are added to fsp.
+ */
+void
+allocator_tcache_flush(struct allocator *allocator, PMEMflushset *fsp)
+{
+	if (Thread_cache.id != allocator->id)
+		return;
+
+	for (unsigned c = 0; c < ALLOC_CLASSES; c++)
+		tcache_trim(allocator, Thread_cache.tc, c, 0, fsp);
+}
+
+/*
+ * allocator_tcache_limit -- set how many blocks of a class a thread caches
+ *
+ * The thread's own cache is trimmed right away, the others the next
+ * time their threads free a block of a class over the limit.  With max
+ * 0, threads that haven't cached anything yet don't get a cache.
+ */
+void
+allocator_tcache_limit(struct allocator *allocator, unsigned max,
+	PMEMflushset *fsp)
+{
+	allocator->tcache_max = max;
+
+	if (Thread_cache.id != allocator->id)
+		return;
+
+	for (unsigned c = 0; c < ALLOC_CLASSES; c++)
+		tcache_trim(allocator, Thread_cache.tc, c, max, fsp);
+}
+
+/*
+ * allocator_tcache_stats -- return the counters of all thread caches
+ *
+ * The counters of caches freed as their threads exited are kept too.
+ */
+void
+allocator_tcache_stats(struct allocator *allocator,
+	struct pmemobj_tcache_stats *statsp)
+{
+	memset(statsp, 0, sizeof (*statsp));
+
+	pthread_mutex_lock(&allocator->tcache_lock);
+	statsp->hits = allocator->tcache_hits;
+	statsp->misses = allocator->tcache_misses;
+	statsp->flushed = allocator->tcache_flushed;
+	for (struct tcache *tc = allocator->tcaches; tc; tc = tc->next) {
+		statsp->caches++;
+		statsp->hits += tc->hits;
+		statsp->misses += tc->misses;
+		statsp->flushed += tc->flushed;
+		for (unsigned c = 0; c < ALLOC_CLASSES; c++)
+			statsp->cached += tc->count[c];
+	}
+	pthread_mutex_unlock(&allocator->tcache_lock);
 }
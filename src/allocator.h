@@ -34,13 +34,57 @@
  * allocator.h -- internal definitions for allocator module
  */
 
+/* number of small object size classes, see class_of() in allocator.c */
+#define	ALLOC_CLASSES 67
+
+/* sets of free lists, threads use the one of the CPU they run on */
+#define	ALLOC_ARENAS 8
+
+/* lines threads allocate from that are remembered across a close */
+#define	ALLOC_PARTIAL 64
+
+struct allocator;
+
+/*
+ * The allocator's state kept in the pool, zeroed when the pool is
+ * created.  Its run-time state lives in a struct allocator, see
+ * allocator_new().
+ */
 struct allocator_hdr {
-    uint64_t base_offset;
-    uint64_t lines_used;
-    int is_pmem;
+	uint64_t free_lines;		/* first free run of lines */
+	uint64_t free_extents;		/* first free extent for huge objects */
+	uint64_t free[ALLOC_ARENAS][ALLOC_CLASSES]; /* free block lists */
+
+	/* summary of the heap, only good if closed cleanly... */
+	uint64_t summary;		/* valid after a clean close */
+	uint64_t lines_used;		/* lines handed out so far */
+	uint64_t partial[ALLOC_PARTIAL]; /* lines with room left */
+	uint64_t class_blocks[ALLOC_ARENAS][ALLOC_CLASSES]; /* blocks made */
+	uint64_t class_free[ALLOC_ARENAS][ALLOC_CLASSES]; /* blocks on them */
+	uint64_t huge_objects;		/* huge objects allocated */
+	uint64_t huge_bytes;		/* size of their extents */
 };
 
-bool allocator_init(struct allocator_hdr *allocator, uint64_t base_offset,
-	int is_pmem);
-void pmalloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size);
-void pfree(struct allocator_hdr *allocator, uint64_t ptr);
+struct allocator *allocator_new(struct allocator_hdr *hdr, void *base,
+	size_t size, uint64_t base_offset, int is_pmem);
+void allocator_delete(struct allocator *allocator);
+int pmalloc(struct allocator *allocator, uint64_t *ptr, size_t size,
+	PMEMflushset *fsp);
+int pmalloc_aligned(struct allocator *allocator, uint64_t *ptr,
+	size_t alignment, size_t size, PMEMflushset *fsp);
+void pfree(struct allocator *allocator, uint64_t ptr, PMEMflushset *fsp);
+int pextend(struct allocator *allocator, uint64_t ptr, size_t size,
+	PMEMflushset *fsp);
+void pshrink(struct allocator *allocator, uint64_t ptr, size_t size,
+	PMEMflushset *fsp);
+size_t psize(struct allocator *allocator, uint64_t ptr);
+void allocator_stats(struct allocator *allocator,
+	struct pmemobj_heap_stats *statsp);
+int allocator_class_stats(struct allocator *allocator, unsigned c,
+	struct pmemobj_class_stats *statsp);
+void allocator_tcache_flush(struct allocator *allocator,
+	PMEMflushset *fsp);
+void allocator_tcache_limit(struct allocator *allocator, unsigned max,
+	PMEMflushset *fsp);
+void allocator_tcache_stats(struct allocator *allocator,
+	struct pmemobj_tcache_stats *statsp);
@@ -0,0 +1,541 @@
+/*
+ * Copyright (c) 2015, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * async.c -- asynchronous background persistence
+ *
+ * Making a range persistent on a pool that isn't pmem means writing the
+ * pages back with msync(), which waits for the device.  When async mode
+ * is started, pmem_persist_async() just queues the range and returns a
+ * ticket.  One or more flusher threads take everything queued so far,
+ * merge overlapping and adjacent pages, write back the merged runs and
+ * then complete the requests.  Tickets are handed out in order, so a
+ * caller needing a durability point waits for the newest ticket it got.
+ *
+ * Ranges on pmem are always flushed inline, that's cheap enough already.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <libpmem.h>
+#include "pmem.h"
+#include "util.h"
+#include "out.h"
+
+#define	ASYNC_MAX_THREADS 64
+#define	ASYNC_MAX_FAILED 64	/* failed tickets remembered for waiters */
+
+/*
+ * one queued persist request
+ */
+struct async_req {
+	struct async_req *next;
+	uint64_t ticket;
+	uintptr_t base;		/* page aligned */
+	uintptr_t end;
+	void (*callback)(void *arg, int error);
+	void *arg;
+	int error;
+};
+
+/*
+ * a batch being written back by one of the flusher threads
+ */
+struct async_batch {
+	struct async_batch *next;
+	uint64_t first;		/* lowest ticket in the batch */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* something queued, or stopping */
+	pthread_cond_t done;		/* a batch completed */
+	struct async_req *head;		/* queued requests, oldest first */
+	struct async_req *tail;
+	struct async_batch *inflight;	/* batches being written back */
+	uint64_t next_ticket;
+	struct {
+		uint64_t ticket;
+		int error;
+	} failed[ASYNC_MAX_FAILED];	/* ring of recently failed tickets */
+	unsigned nfailed;		/* failures recorded so far */
+	uint64_t forgot_ticket;		/* newest failure pushed out */
+	int forgot_errno;
+	int running;
+	int stopping;
+	unsigned nthreads;
+	pthread_t threads[ASYNC_MAX_THREADS];
+} Async = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.next_ticket = 1,
+};
+
+/*
+ * async_completed -- (internal) return the newest ticket known complete
+ *
+ * Everything older than the oldest request still queued or in flight
+ * has been written back.  Called with Async.lock held.
+ */
+static uint64_t
+async_completed(void)
+{
+	uint64_t oldest = Async.next_ticket;
+
+	if (Async.head != NULL && Async.head->ticket < oldest)
+		oldest = Async.head->ticket;
+
+	for (struct async_batch *b = Async.inflight; b != NULL; b = b->next)
+		if (b->first < oldest)
+			oldest = b->first;
+
+	return oldest - 1;
+}
+
+/*
+ * async_failed -- (internal) record the failure of a ticket
+ *
+ * Only the last ASYNC_MAX_FAILED failures are kept.  Once one is pushed
+ * out, a waiter on that ticket or any older one that isn't recorded
+ * can't be told whether its write-back failed, and is told it did.
+ * Called with Async.lock held.
+ */
+static void
+async_failed(uint64_t ticket, int error)
+{
+	unsigned slot = Async.nfailed++ % ASYNC_MAX_FAILED;
+
+	if (Async.nfailed > ASYNC_MAX_FAILED &&
+			Async.failed[slot].ticket > Async.forgot_ticket) {
+		Async.forgot_ticket = Async.failed[slot].ticket;
+		Async.forgot_errno = Async.failed[slot].error;
+	}
+
+	Async.failed[slot].ticket = ticket;
+	Async.failed[slot].error = error;
+}
+
+/*
+ * async_error -- (internal) return the error a ticket failed with, or 0
+ *
+ * Called with Async.lock held.
+ */
+static int
+async_error(uint64_t ticket)
+{
+	unsigned n = Async.nfailed < ASYNC_MAX_FAILED ?
+			Async.nfailed : ASYNC_MAX_FAILED;
+
+	for (unsigned i = 0; i < n; i++)
+		if (Async.failed[i].ticket == ticket)
+			return Async.failed[i].error;
+
+	if (ticket <= Async.forgot_ticket)
+		return Async.forgot_errno;
+
+	return 0;
+}
+
+/*
+ * async_batch_done -- (internal) take a batch off the in flight list
+ *
+ * Wakes up the waiters.  Called with Async.lock held.
+ */
+static void
+async_batch_done(struct async_batch *batch)
+{
+	struct async_batch **bp = &Async.inflight;
+
+	while (*bp != batch)
+		bp = &(*bp)->next;
+	*bp = batch->next;
+
+	pthread_cond_broadcast(&Async.done);
+}
+
+/*
+ * req_compare -- (internal) qsort helper, order requests by address
+ */
+static int
+req_compare(const void *a, const void *b)
+{
+	const struct async_req *ra = *(struct async_req * const *)a;
+	const struct async_req *rb = *(struct async_req * const *)b;
+
+	if (ra->base < rb->base)
+		return -1;
+	if (ra->base > rb->base)
+		return 1;
+	return 0;
+}
+
+/*
+ * async_writeback -- (internal) write back all ranges in a batch
+ *
+ * The requests are sorted by address and runs of overlapping or adjacent
+ * pages are written back with a single msync().  Every request in a run
+ * gets the run's result.
+ */
+static void
+async_writeback(struct async_req *list, unsigned n)
+{
+	struct async_req *stackv[64];
+	struct async_req **v = stackv;
+
+	if (n > 64 && (v = Malloc(n * sizeof (*v))) == NULL) {
+		/* no memory to sort, write back one by one */
+		for (struct async_req *r = list; r != NULL; r = r->next)
+			if (libpmem_msync((void *)r->base,
+					r->end - r->base) < 0)
+				r->error = errno;
+		return;
+	}
+
+	unsigned i = 0;
+	for (struct async_req *r = list; r != NULL; r = r->next)
+		v[i++] = r;
+
+	qsort(v, n, sizeof (*v), req_compare);
+
+	for (i = 0; i < n; ) {
+		uintptr_t base = v[i]->base;
+		uintptr_t end = v[i]->end;
+		unsigned j;
+
+		for (j = i + 1; j < n && v[j]->base <= end; j++)
+			if (v[j]->end > end)
+				end = v[j]->end;
+
+		LOG(5, "msync %p len %zu (%u requests)",
+				(void *)base, end - base, j - i);
+
+		int error = 0;
+		if (libpmem_msync((void *)base, end - base) < 0)
+			error = errno;
+
+		for (; i < j; i++)
+			v[i]->error = error;
+	}
+
+	if (v != stackv)
+		Free(v);
+}
+
+/*
+ * async_thread -- (internal) flusher thread main loop
+ */
+static void *
+async_thread(void *arg)
+{
+	pthread_mutex_lock(&Async.lock);
+
+	for (;;) {
+		while (Async.head == NULL && !Async.stopping)
+			pthread_cond_wait(&Async.work, &Async.lock);
+
+		if (Async.head == NULL)
+			break;
+
+		/* take everything queued so far */
+		struct async_req *list = Async.head;
+		struct async_batch batch = { Async.inflight, list->ticket };
+		unsigned n = 0;
+
+		for (struct async_req *r = list; r != NULL; r = r->next)
+			n++;
+
+		Async.head = Async.tail = NULL;
+		Async.inflight = &batch;
+
+		pthread_mutex_unlock(&Async.lock);
+
+		async_writeback(list, n);
+
+		for (struct async_req *r = list; r != NULL; r = r->next)
+			if (r->callback)
+				(*r->callback)(r->arg, r->error);
+
+		pthread_mutex_lock(&Async.lock);
+
+		for (struct async_req *r = list; r != NULL; r = r->next)
+			if (r->error)
+				async_failed(r->ticket, r->error);
+
+		async_batch_done(&batch);
+
+		while (list != NULL) {
+			struct async_req *r = list;
+
+			list = r->next;
+			Free(r);
+		}
+	}
+
+	pthread_mutex_unlock(&Async.lock);
+
+	return NULL;
+}
+
+/*
+ * pmem_async_start -- start the flusher threads, enabling async mode
+ */
+int
+pmem_async_start(unsigned nthreads)
+{
+	LOG(3, "nthreads %u", nthreads);
+
+	if (nthreads == 0 || nthreads > ASYNC_MAX_THREADS) {
+		LOG(1, "invalid number of threads %u", nthreads);
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&Async.lock);
+
+	if (Async.running || Async.stopping) {
+		pthread_mutex_unlock(&Async.lock);
+		LOG(1, "async mode already started");
+		errno = EBUSY;
+		return -1;
+	}
+
+	int err = 0;
+
+	for (Async.nthreads = 0; Async.nthreads < nthreads; Async.nthreads++) {
+		err = pthread_create(&Async.threads[Async.nthreads], NULL,
+				async_thread, NULL);
+		if (err) {
+			LOG(1, "pthread_create: %s", strerror(err));
+			break;
+		}
+	}
+
+	if (err) {
+		/* fewer threads than asked for, undo the ones started */
+		Async.stopping = 1;
+		pthread_cond_broadcast(&Async.work);
+		pthread_mutex_unlock(&Async.lock);
+
+		for (unsigned i = 0; i < Async.nthreads; i++)
+			pthread_join(Async.threads[i], NULL);
+
+		pthread_mutex_lock(&Async.lock);
+		Async.nthreads = 0;
+		Async.stopping = 0;
+		pthread_mutex_unlock(&Async.lock);
+
+		errno = err;
+		return -1;
+	}
+
+	Async.running = 1;
+	pthread_mutex_unlock(&Async.lock);
+
+	return 0;
+}
+
+/*
+ * pmem_async_stop -- complete everything queued and stop the threads
+ */
+void
+pmem_async_stop(void)
+{
+	LOG(3, NULL);
+
+	pthread_mutex_lock(&Async.lock);
+
+	if (!Async.running) {
+		pthread_mutex_unlock(&Async.lock);
+		return;
+	}
+
+	Async.running = 0;
+	Async.stopping = 1;
+	pthread_cond_broadcast(&Async.work);
+	pthread_mutex_unlock(&Async.lock);
+
+	for (unsigned i = 0; i < Async.nthreads; i++)
+		pthread_join(Async.threads[i], NULL);
+
+	pthread_mutex_lock(&Async.lock);
+	Async.nthreads = 0;
+	Async.stopping = 0;
+	pthread_mutex_unlock(&Async.lock);
+}
+
+/*
+ * libpmem_async_running -- true if async mode is on
+ *
+ * Only a hint for the pools choosing how to persist, async mode may be
+ * stopped right after this returns.
+ */
+int
+libpmem_async_running(void)
+{
+	pthread_mutex_lock(&Async.lock);
+	int running = Async.running;
+	pthread_mutex_unlock(&Async.lock);
+
+	return running;
+}
+
+/*
+ * pmem_persist_async -- make a range persistent in the background
+ *
+ * Returns a ticket for pmem_async_wait().  If a callback is given, it
+ * is called from a flusher thread once the range is persistent (or the
+ * write-back failed), before waiters on the ticket are woken up.  The
+ * callback may queue more requests but must not wait for them.
+ *
+ * Without async mode, and for ranges on pmem, the range is made
+ * persistent before returning and the callback is called right away,
+ * with the error if that failed.
+ * Returns 0 if the request couldn't be queued.
+ */
+uint64_t
+pmem_persist_async(void *addr, size_t len,
+		void (*callback)(void *arg, int error), void *arg)
+{
+	LOG(5, "addr %p len %zu", addr, len);
+
+	int is_pmem = pmem_is_pmem(addr, len);
+	struct async_req *r = NULL;
+
+	/* allocate outside the lock if it looks like r will be queued */
+	if (!is_pmem && libpmem_async_running()) {
+		if ((r = Malloc(sizeof (*r))) == NULL) {
+			LOG(1, "!Malloc");
+			return 0;
+		}
+
+		r->next = NULL;
+		r->base = (uintptr_t)addr & ~(Pagesize - 1);
+		r->end = ((uintptr_t)addr + len + Pagesize - 1) &
+				~(Pagesize - 1);
+		r->callback = callback;
+		r->arg = arg;
+		r->error = 0;
+	}
+
+	pthread_mutex_lock(&Async.lock);
+
+	if (!Async.running || r == NULL) {
+		/*
+		 * Async mode is off, or got switched on or off since the
+		 * check above.  If stopped, the flusher threads are gone
+		 * and nobody would complete r.
+		 */
+		if (r != NULL)
+			Free(r);
+
+		/* in flight until persistent, so nobody reports it early */
+		struct async_batch batch = { Async.inflight,
+				Async.next_ticket++ };
+
+		Async.inflight = &batch;
+		pthread_mutex_unlock(&Async.lock);
+
+		int error = 0;
+		if (libpmem_persist(is_pmem, addr, len) < 0)
+			error = errno;
+		if (callback)
+			(*callback)(arg, error);
+
+		pthread_mutex_lock(&Async.lock);
+		if (error)
+			async_failed(batch.first, error);
+		async_batch_done(&batch);
+		pthread_mutex_unlock(&Async.lock);
+
+		return batch.first;
+	}
+
+	/* r may be completed and freed as soon as the lock is dropped */
+	uint64_t ticket = r->ticket = Async.next_ticket++;
+	if (Async.tail)
+		Async.tail->next = r;
+	else
+		Async.head = r;
+	Async.tail = r;
+
+	pthread_cond_signal(&Async.work);
+	pthread_mutex_unlock(&Async.lock);
+
+	__sync_fetch_and_add(&Persist_stats.ranges, 1);
+
+	/* on pmem this request would have been written back inline */
+	libpmem_emul_write(addr, len);
+	libpmem_emul_drain();
+
+	return ticket;
+}
+
+/*
+ * pmem_async_wait -- wait until all requests up to ticket are persistent
+ *
+ * Returns -1 with errno set if the write-back for this ticket failed.
+ * Failures of older tickets are reported to their own callbacks and
+ * waiters only, they may belong to another pool.
+ */
+int
+pmem_async_wait(uint64_t ticket)
+{
+	LOG(5, "ticket %ju", (uintmax_t)ticket);
+
+	pthread_mutex_lock(&Async.lock);
+
+	if (ticket >= Async.next_ticket) {
+		pthread_mutex_unlock(&Async.lock);
+		LOG(1, "unknown ticket %ju", (uintmax_t)ticket);
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (async_completed() < ticket)
+		pthread_cond_wait(&Async.done, &Async.lock);
+
+	int err = async_error(ticket);
+
+	pthread_mutex_unlock(&Async.lock);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
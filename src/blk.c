@@ -40,6 +40,7 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -71,18 +72,91 @@ blk_init(void)
 	util_init();
 }
 
+#ifdef DEBUG
+/*
+ * lane_guard_release -- (internal) protect what the lane made writable
+ */
+static void
+lane_guard_release(PMEMblk *pbp, int lane)
+{
+	struct blk_lane *lanep = LANE(pbp, lane);
+
+	for (int i = 0; i < lanep->nheld; i++)
+		ASSERT(util_guard_ro(pbp->guard, lanep->held[i].addr,
+				lanep->held[i].len) >= 0);
+
+	lanep->nheld = 0;
+}
+
+/*
+ * lane_guard_rw -- (internal) make a range writable until lane_exit()
+ *
+ * A btt operation writes the same few pages (flog, map) more than
+ * once, so the lane remembers what it made writable and protects it
+ * all again in one go when the operation is done.
+ */
+static void
+lane_guard_rw(PMEMblk *pbp, int lane, void *addr, size_t len)
+{
+	struct blk_lane *lanep = LANE(pbp, lane);
+	uintptr_t start = (uintptr_t)addr & ~(Pagesize - 1);
+	uintptr_t end = roundup((uintptr_t)addr + len, Pagesize);
+
+	for (int i = 0; i < lanep->nheld; i++) {
+		uintptr_t hstart = (uintptr_t)lanep->held[i].addr;
+
+		if (start >= hstart && end <= hstart + lanep->held[i].len)
+			return;
+	}
+
+	if (lanep->nheld == LANE_HELD_MAX)
+		lane_guard_release(pbp, lane);
+
+	ASSERT(util_guard_rw(pbp->guard, (void *)start, end - start) >= 0);
+
+	lanep->held[lanep->nheld].addr = (void *)start;
+	lanep->held[lanep->nheld].len = end - start;
+	lanep->nheld++;
+}
+
+#define	LANE_RW(pbp, lane, addr, len) lane_guard_rw(pbp, lane, addr, len)
+#define	LANE_RELEASE(pbp, lane) lane_guard_release(pbp, lane)
+
+#else
+
+/* nondebug version */
+#define	LANE_RW(pbp, lane, addr, len)
+#define	LANE_RELEASE(pbp, lane)
+
+#endif	/* DEBUG */
+
 /*
  * lane_enter -- (internal) acquire a unique lane number
+ *
+ * On a NUMA system, lanes belonging to the node the caller runs on
+ * are preferred.
  */
 static int
 lane_enter(PMEMblk *pbp)
 {
-	int mylane;
+	int mylane = -1;
+
+	if (pbp->node_lanes) {
+		int node = util_current_node();
+		int first = pbp->node_first[node];
+		int n = pbp->node_first[node + 1] - first;
+
+		if (n > 0)
+			mylane = pbp->node_lanes[first +
+				__sync_fetch_and_add(&pbp->node_next[node], 1)
+				% n];
+	}
 
-	mylane = __sync_fetch_and_add(&pbp->next_lane, 1) % pbp->nlane;
+	if (mylane < 0)
+		mylane = __sync_fetch_and_add(&pbp->next_lane, 1) % pbp->nlane;
 
 	/* lane selected, grab the per-lane lock */
-	if (pthread_mutex_lock(&pbp->locks[mylane]) < 0) {
+	if (pthread_mutex_lock(&LANE(pbp, mylane)->lock) < 0) {
 		LOG(1, "!pthread_mutex_lock");
 		return -1;
 	}
@@ -96,7 +170,10 @@ lane_enter(PMEMblk *pbp)
 static int
 lane_exit(PMEMblk *pbp, int mylane)
 {
-	if (pthread_mutex_unlock(&pbp->locks[mylane]) < 0) {
+	/* protect the lane's writes again (debug version only) */
+	LANE_RELEASE(pbp, mylane);
+
+	if (pthread_mutex_unlock(&LANE(pbp, mylane)->lock) < 0) {
 		LOG(1, "!pthread_mutex_unlock");
 		return -1;
 	}
@@ -129,6 +206,28 @@ nsread(void *ns, int lane, void *buf, size_t count, off_t off)
 	return 0;
 }
 
+/*
+ * nspersist_async -- (internal) persist a range through the async engine
+ *
+ * The lane still waits for its range, but writes from concurrent lanes
+ * queued meanwhile are written back together by the flusher threads.
+ */
+static int
+nspersist_async(void *addr, size_t len)
+{
+	uint64_t ticket = pmem_persist_async(addr, len, NULL, NULL);
+
+	if (ticket == 0)
+		return libpmem_persist(0, addr, len);
+
+	if (pmem_async_wait(ticket) < 0) {
+		LOG(1, "!pmem_async_wait");
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  * nswrite -- (internal) write data to the namespace encapsulating the BTT
  *
@@ -151,37 +250,78 @@ nswrite(void *ns, int lane, const void *buf, size_t count, off_t off)
 
 	void *dest = pbp->data + off;
 
-#ifdef DEBUG
-	/* grab debug write lock */
-	if (pthread_mutex_lock(&pbp->write_lock))
-		LOG(1, "!pthread_mutex_lock");
-#endif
+	/* unprotect the memory until lane_exit() (debug version only) */
+	LANE_RW(pbp, lane, dest, count);
 
-	/* unprotect the memory (debug version only) */
-	RANGE_RW(dest, count);
+	if (pbp->is_pmem || !libpmem_async_running()) {
+		libpmem_memcpy_persist(pbp->is_pmem, dest, buf, count);
+		return 0;
+	}
 
 	memcpy(dest, buf, count);
 
-	/* protect the memory again (debug version only) */
-	RANGE_RO(dest, count);
+	return nspersist_async(dest, count);
+}
 
-#ifdef DEBUG
-	/* release debug write lock */
-	if (pthread_mutex_unlock(&pbp->write_lock))
-		LOG(1, "!pthread_mutex_unlock");
-#endif
+/*
+ * nswrite_nosync -- (internal) write data, flushing it on the next nsdrain
+ *
+ * The written range is added to the lane's flush set, so several small
+ * writes sharing cache lines (or pages) end up costing one flush each
+ * and a single fence.
+ *
+ * This routine is provided to btt_init() to allow the btt module to
+ * do I/O on the memory pool containing the BTT layout.
+ */
+static int
+nswrite_nosync(void *ns, int lane, const void *buf, size_t count, off_t off)
+{
+	struct pmemblk *pbp = (struct pmemblk *)ns;
 
-	libpmem_persist(pbp->is_pmem, dest, count);
+	LOG(13, "pbp %p lane %d count %zu off %zu", pbp, lane, count, off);
+
+	if (off + count >= pbp->datasize) {
+		LOG(1, "offset + count (%zu) past end of data area (%zu)",
+				off + count, pbp->datasize - 1);
+		errno = EINVAL;
+		return -1;
+	}
+
+	void *dest = pbp->data + off;
+
+	/* unprotect the memory until lane_exit() (debug version only) */
+	LANE_RW(pbp, lane, dest, count);
+
+	memcpy(dest, buf, count);
+
+	pmem_flushset_add(&LANE(pbp, lane)->flushset, dest, count);
 
 	return 0;
 }
 
+/*
+ * nsdrain -- (internal) flush everything written by nswrite_nosync
+ *
+ * This routine is provided to btt_init() to allow the btt module to
+ * do I/O on the memory pool containing the BTT layout.
+ */
+static int
+nsdrain(void *ns, int lane)
+{
+	struct pmemblk *pbp = (struct pmemblk *)ns;
+
+	LOG(12, "pbp %p lane %d", pbp, lane);
+
+	return pmem_flushset_drain(&LANE(pbp, lane)->flushset);
+}
+
 /*
  * nsmap -- (internal) allow direct access to a range of a namespace
  *
  * The caller requests a range to be "mapped" but the return value
  * may indicate a smaller amount (in which case the caller is expected
- * to call back later for another mapping).
+ * to call back later for another mapping).  The btt only reads through
+ * the mapping, so the range stays write-protected (debug version only).
  *
  * This routine is provided to btt_init() to allow the btt module to
  * do I/O on the memory pool containing the BTT layout.
@@ -229,7 +369,10 @@ nssync(void *ns, int lane, void *addr, size_t len)
 
 	LOG(12, "pbp %p lane %d addr %p len %zu", pbp, lane, addr, len);
 
-	libpmem_persist(pbp->is_pmem, addr, len);
+	if (pbp->is_pmem || !libpmem_async_running())
+		libpmem_persist(pbp->is_pmem, addr, len);
+	else
+		nspersist_async(addr, len);
 }
 
 /* callbacks for btt_init() */
@@ -237,7 +380,9 @@ static const struct ns_callback ns_cb = {
 	nsread,
 	nswrite,
 	nsmap,
-	nssync
+	nssync,
+	nswrite_nosync,
+	nsdrain
 };
 
 /*
@@ -257,7 +402,12 @@ pmemblk_map_common(int fd, size_t bsize, int rdonly)
 	/* things free by "goto err" if not NULL */
 	void *addr = NULL;
 	struct btt *bttp = NULL;
-	pthread_mutex_t *locks = NULL;
+	void *lanes = NULL;
+	struct pmem_dirty *dirty = NULL;
+	int *node_lanes = NULL;
+#ifdef DEBUG
+	struct util_guard *guard = NULL;
+#endif
 
 	struct stat stbuf;
 	if (fstat(fd, &stbuf) < 0) {
@@ -341,7 +491,7 @@ pmemblk_map_common(int fd, size_t bsize, int rdonly)
 		hdrp->ro_compat_features = htole32(BLK_FORMAT_RO_COMPAT);
 		uuid_generate(hdrp->uuid);
 		hdrp->crtime = htole64((uint64_t)time(NULL));
-		util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 1);
+		util_checksum_hdr(hdrp, BLK_FORMAT_INCOMPAT, 1);
 		hdrp->checksum = htole64(hdrp->checksum);
 
 		/* store pool's header */
@@ -371,36 +521,97 @@ pmemblk_map_common(int fd, size_t bsize, int rdonly)
 	if (ncpus < 1)
 		ncpus = 1;
 
+	int nnodes = util_numa_nodes();
+
+	pbp->home_node = util_addr_node(addr);
+	LOG(3, "home node %d", pbp->home_node);
+
+	/* btt never uses more lanes than ncpus, and may write during init */
+	pbp->lane_stride = roundup(sizeof (struct blk_lane),
+			nnodes > 1 ? Pagesize : 64);
+	pbp->lanes_size = roundup(ncpus * pbp->lane_stride, Pagesize);
+
+	if ((lanes = mmap(NULL, pbp->lanes_size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		LOG(1, "!mmap for lanes");
+		lanes = NULL;
+		goto err;
+	}
+
+	pbp->lanes = lanes;
+	pbp->maxlane = 0;
+
+	/* lanes share a dirty page tracker, not fatal if unavailable */
+	if (!is_pmem && !rdonly)
+		dirty = libpmem_dirty_new(addr, stbuf.st_size);
+	pbp->dirty = dirty;
+
+	/* lane n is meant for cpu n, its pages go on that cpu's node */
+	for (int i = 0; i < ncpus; i++) {
+		struct blk_lane *lanep = LANE(pbp, i);
+
+		lanep->node = util_cpu_node(i);
+		if (nnodes > 1)
+			util_mbind_node(lanep, pbp->lane_stride, lanep->node);
+
+		if (pthread_mutex_init(&lanep->lock, NULL) < 0) {
+			LOG(1, "!pthread_mutex_init");
+			goto err;
+		}
+		libpmem_flushset_init(&lanep->flushset, is_pmem, dirty);
+		pbp->maxlane++;
+	}
+
+#ifdef DEBUG
+	/* the data area is kept read-only outside of writes */
+	if ((guard = util_guard_new(pbp->data, pbp->datasize)) == NULL)
+		goto err;
+	pbp->guard = guard;
+	RANGE_RO(pbp->data, pbp->datasize);
+#endif
+
 	bttp = btt_init(pbp->datasize, (uint32_t)bsize, pbp->hdr.uuid,
 			ncpus, pbp, &ns_cb);
 
 	if (bttp == NULL)
 		goto err;	/* btt_init set errno, called LOG */
 
+	/* btt_init() doesn't use lane_enter() */
+	for (int i = 0; i < pbp->maxlane; i++)
+		LANE_RELEASE(pbp, i);
+
 	pbp->bttp = bttp;
 
 	pbp->nlane = btt_nlane(pbp->bttp);
 	pbp->next_lane = 0;
-	if ((locks = Malloc(pbp->nlane * sizeof (*locks))) == NULL) {
-		LOG(1, "!Malloc for lane locks");
-		goto err;
-	}
+	pbp->node_lanes = NULL;
 
-	for (int i = 0; i < pbp->nlane; i++)
-		if (pthread_mutex_init(&locks[i], NULL) < 0) {
-			LOG(1, "!pthread_mutex_init");
+	if (nnodes > 1) {
+		/* group the lane numbers by node, for lane_enter() */
+		size_t size = (pbp->nlane + nnodes + 1) * sizeof (int) +
+				nnodes * sizeof (unsigned);
+
+		if ((node_lanes = Malloc(size)) == NULL) {
+			LOG(1, "!Malloc for node lanes");
 			goto err;
 		}
+		memset(node_lanes, 0, size);
 
-	pbp->locks = locks;
+		int *node_first = node_lanes + pbp->nlane;
+		int n = 0;
 
-#ifdef DEBUG
-	/* initialize debug lock */
-	if (pthread_mutex_init(&pbp->write_lock, NULL) < 0) {
-		LOG(1, "!pthread_mutex_init");
-		goto err;
+		for (int node = 0; node < nnodes; node++) {
+			node_first[node] = n;
+			for (int i = 0; i < pbp->nlane; i++)
+				if (LANE(pbp, i)->node == node)
+					node_lanes[n++] = i;
+		}
+		node_first[nnodes] = n;
+
+		pbp->node_lanes = node_lanes;
+		pbp->node_first = node_first;
+		pbp->node_next = (unsigned *)(node_first + nnodes + 1);
 	}
-#endif
 
 	/*
 	 * If possible, turn off all permissions on the pool header page.
@@ -410,19 +621,27 @@ pmemblk_map_common(int fd, size_t bsize, int rdonly)
 	 */
 	util_range_none(addr, sizeof (struct pool_hdr));
 
-	/* the data area should be kept read-only for debug version */
-	RANGE_RO(pbp->data, pbp->datasize);
-
 	LOG(3, "pbp %p", pbp);
 	return pbp;
 
 err:
 	LOG(4, "error clean up");
 	int oerrno = errno;
-	if (locks)
-		Free((void *)locks);
+	if (node_lanes)
+		Free((void *)node_lanes);
 	if (bttp)
 		btt_fini(bttp);
+	if (lanes) {
+		for (int i = 0; i < pbp->maxlane; i++)
+			pthread_mutex_destroy(&LANE(pbp, i)->lock);
+		munmap(lanes, pbp->lanes_size);
+	}
+	if (dirty)
+		libpmem_dirty_delete(dirty);
+#ifdef DEBUG
+	if (guard)
+		util_guard_delete(guard);
+#endif
 	util_unmap(addr, stbuf.st_size);
 	errno = oerrno;
 	return NULL;
@@ -448,20 +667,38 @@ pmemblk_unmap(PMEMblk *pbp)
 	LOG(3, "pbp %p", pbp);
 
 	btt_fini(pbp->bttp);
-	if (pbp->locks) {
-		for (int i = 0; i < pbp->nlane; i++)
-			pthread_mutex_destroy(&pbp->locks[i]);
-		Free((void *)pbp->locks);
-	}
+	for (int i = 0; i < pbp->maxlane; i++)
+		pthread_mutex_destroy(&LANE(pbp, i)->lock);
+	munmap(pbp->lanes, pbp->lanes_size);
+	if (pbp->node_lanes)
+		Free((void *)pbp->node_lanes);
+	if (pbp->dirty)
+		libpmem_dirty_delete(pbp->dirty);
 
 #ifdef DEBUG
-	/* destroy debug lock */
-	pthread_mutex_destroy(&pbp->write_lock);
+	util_guard_delete(pbp->guard);
 #endif
 
 	util_unmap(pbp->addr, pbp->size);
 }
 
+/*
+ * pmemblk_prefault -- fault in the whole pool using nthreads
+ *
+ * Meant to be called right after mapping the pool, so the first
+ * requests don't pay for the page faults.
+ */
+void
+pmemblk_prefault(PMEMblk *pbp, unsigned nthreads)
+{
+	LOG(3, "pbp %p nthreads %u", pbp, nthreads);
+
+	/* the header is kept inaccessible, there's nothing to fault in */
+	util_prefault((char *)pbp->addr + sizeof (struct pool_hdr),
+			pbp->size - sizeof (struct pool_hdr), nthreads,
+			pbp->is_pmem);
+}
+
 /*
  * pmemblk_nblock -- return number of usable blocks in a block memory pool
  */
@@ -41,6 +41,32 @@
 #define	BLK_FORMAT_INCOMPAT 0x0000
 #define	BLK_FORMAT_RO_COMPAT 0x0000
 
+/* ranges a lane can hold writable (debug version only) */
+#define	LANE_HELD_MAX 8
+
+/*
+ * run-time state of each lane
+ *
+ * With more than one NUMA node, each lane gets pages of its own, placed
+ * on the node of the CPU the lane is meant for.
+ */
+struct blk_lane {
+	pthread_mutex_t lock;
+	PMEMflushset flushset;		/* for nswrite_nosync */
+	int node;			/* NUMA node the lane belongs to */
+#ifdef DEBUG
+	/* ranges held writable until lane_exit(), see LANE_RW() */
+	struct {
+		void *addr;
+		size_t len;
+	} held[LANE_HELD_MAX];
+	int nheld;
+#endif
+};
+
+#define	LANE(pbp, n)\
+	((struct blk_lane *)((char *)(pbp)->lanes + (n) * (pbp)->lane_stride))
+
 struct pmemblk {
 	struct pool_hdr hdr;	/* memory pool header */
 
@@ -59,11 +85,19 @@ struct pmemblk {
 	struct ns_callback *ns_cbp;	/* callbacks for btt_init() */
 	int nlane;			/* number of lanes */
 	unsigned next_lane;		/* used to rotate through lanes */
-	pthread_mutex_t *locks;		/* one per lane */
+	void *lanes;			/* lane state, see LANE() */
+	size_t lanes_size;		/* size of the lanes mapping */
+	size_t lane_stride;		/* distance between lanes */
+	int maxlane;			/* lanes initialized */
+	struct pmem_dirty *dirty;	/* dirty pages, if not pmem */
+	int home_node;			/* NUMA node backing the pool */
+	int *node_lanes;		/* lane numbers grouped by node */
+	int *node_first;		/* start of each node in node_lanes */
+	unsigned *node_next;		/* used to rotate within each node */
 
 #ifdef DEBUG
-	/* held during read/write mprotected sections */
-	pthread_mutex_t write_lock;
+	/* keeps the data area read-only outside of writes */
+	struct util_guard *guard;
 #endif
 };
 
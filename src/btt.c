@@ -37,19 +37,24 @@
  * single block powerfail write atomicity, as described by:
  * 	The NVDIMM Namespace Specification
  *
- * To use this module, the caller must provide three routines for
+ * To use this module, the caller must provide six routines for
  * accessing the namespace containing the data (in this context,
  * "namespace" refers to the storage containing the BTT layout, such
- * as a file).  All namespace I/O is done by these three calls:
+ * as a file).  All namespace I/O is done by these six calls:
  *
- * 	nsread	Read count bytes from namespace at offset off
- * 	nswrite	Write count bytes to namespace at offset off
- * 	nsmap	Return direct access to a range of a namespace
- * 	nssync	Flush changes made to an nsmap'd range
+ * 	nsread		Read count bytes from namespace at offset off
+ * 	nswrite		Write count bytes to namespace at offset off
+ * 	nsmap		Return direct access to a range of a namespace
+ * 	nssync		Flush changes made to an nsmap'd range
+ * 	nswrite_nosync	Like nswrite, but durable only after nsdrain
+ * 	nsdrain		Flush everything written by nswrite_nosync
  *
  * Data written by the nswrite callback is flushed out to the media
  * (made durable) when the call returns.  Data written directly via
- * the nsmap callback must be flushed explicitly using nssync.
+ * the nsmap callback must be flushed explicitly using nssync, though
+ * this module only reads through nsmap.  Data written by
+ * nswrite_nosync is flushed, for all such writes on the lane at once,
+ * by the next nsdrain.
  *
  * The caller passes these callbacks, along with information such as
  * namespace size and UUID to btt_init() and gets back an opaque handle
@@ -493,16 +498,26 @@ flog_update(struct btt *bttp, int lane, struct arena *arenap,
 
 	/* write out first three fields first */
 	/* XXX writing two fields and two fields will be faster */
-	if ((*bttp->ns_cbp->nswrite)(bttp->ns, lane, &new_flog,
+	if ((*bttp->ns_cbp->nswrite_nosync)(bttp->ns, lane, &new_flog,
 				sizeof (uint32_t) * 3, new_flog_off) < 0)
 		return -1;
 	new_flog_off += sizeof (uint32_t) * 3;
 
+	/*
+	 * Only aligned 8-byte stores are failure atomic, so the first
+	 * three fields must be durable before seq is written.
+	 */
+	if ((*bttp->ns_cbp->nsdrain)(bttp->ns, lane) < 0)
+		return -1;
+
 	/* write out seq field to make it active */
-	if ((*bttp->ns_cbp->nswrite)(bttp->ns, lane, &new_flog.seq,
+	if ((*bttp->ns_cbp->nswrite_nosync)(bttp->ns, lane, &new_flog.seq,
 				sizeof (uint32_t), new_flog_off) < 0)
 		return -1;
 
+	if ((*bttp->ns_cbp->nsdrain)(bttp->ns, lane) < 0)
+		return -1;
+
 	/* flog entry written successfully, update run-time state */
 	arenap->flogs[lane].next = 1 - arenap->flogs[lane].next;
 	arenap->flogs[lane].flog.lba = lba;
@@ -805,52 +820,30 @@ write_layout(struct btt *bttp, int lane, int write)
 
 		ASSERTeq(arena_datasize, mapoff - dataoff);
 
-		/* write out the initial map, identity style */
+		/*
+		 * Write out the initial map, identity style, a page worth
+		 * of entries at a time.  It's made durable along with the
+		 * flog below.
+		 */
 		off_t map_entry_off = arena_off + mapoff;
-		uint32_t *mapp = NULL;
-		int mlen = 0;
-		int next_index = 0;
-		int remaining = 0;
-		for (int i = 0; i < external_nlba; i++) {
-			if (remaining == 0) {
-				/* flush previous mapped area */
-				if (mapp != NULL) {
-					/*
-					 * Protect the memory again
-					 * (debug version only).
-					 * If (mapp != NULL) it had to be
-					 * unprotected earlier.
-					 */
-					RANGE_RO(mapp, mlen);
-
-					(*bttp->ns_cbp->nssync)(bttp->ns,
-						lane, mapp, mlen);
-				}
-				/* request a mapping of remaining map area */
-				mlen = (*bttp->ns_cbp->nsmap)(bttp->ns,
-					lane, (void **)&mapp,
-					(external_nlba - i) * sizeof (uint32_t),
-					map_entry_off);
-
-				if (mlen < 0)
-					return -1;
-
-				/* unprotect the memory (debug version only) */
-				RANGE_RW(mapp, mlen);
-
-				remaining = mlen;
-				next_index = 0;
-			}
-			mapp[next_index++] = htole32(i | BTT_MAP_ENTRY_ZERO);
-			remaining -= sizeof (uint32_t);
-		}
-
-		/* protect the memory again (debug version only) */
-		RANGE_RO(mapp, mlen);
+		uint32_t mapbuf[1024];
+		for (int i = 0; i < external_nlba; ) {
+			int n = external_nlba - i;
+			if (n > 1024)
+				n = 1024;
+
+			for (int j = 0; j < n; j++)
+				mapbuf[j] = htole32((i + j) |
+						BTT_MAP_ENTRY_ZERO);
+
+			if ((*bttp->ns_cbp->nswrite_nosync)(bttp->ns, lane,
+					mapbuf, n * sizeof (uint32_t),
+					map_entry_off) < 0)
+				return -1;
 
-		/* flush previous mapped area */
-		if (mapp != NULL)
-			(*bttp->ns_cbp->nssync)(bttp->ns, lane, mapp, mlen);
+			map_entry_off += n * sizeof (uint32_t);
+			i += n;
+		}
 
 		/* write out the initial flog */
 		off_t flog_entry_off = arena_off + flogoff;
@@ -869,21 +862,27 @@ write_layout(struct btt *bttp, int lane, int write)
 			LOG(6, "flog[%d] entry off %zu initial %u + zero = %u",
 					i, flog_entry_off, next_free_lba,
 					next_free_lba | BTT_MAP_ENTRY_ZERO);
-			if ((*bttp->ns_cbp->nswrite)(bttp->ns, lane, &flog,
-					sizeof (flog), flog_entry_off) < 0)
+			if ((*bttp->ns_cbp->nswrite_nosync)(bttp->ns, lane,
+					&flog, sizeof (flog),
+					flog_entry_off) < 0)
 				return -1;
 			flog_entry_off += sizeof (flog);
 
 			LOG(6, "flog[%d] entry off %zu zeros",
 					i, flog_entry_off);
-			if ((*bttp->ns_cbp->nswrite)(bttp->ns, lane, &Zflog,
-					sizeof (Zflog), flog_entry_off) < 0)
+			if ((*bttp->ns_cbp->nswrite_nosync)(bttp->ns, lane,
+					&Zflog, sizeof (Zflog),
+					flog_entry_off) < 0)
 				return -1;
 			flog_entry_off += sizeof (flog);
 
 			next_free_lba++;
 		}
 
+		/* the map and flog must be durable before the info blocks */
+		if ((*bttp->ns_cbp->nsdrain)(bttp->ns, lane) < 0)
+			return -1;
+
 		/*
 		 * Construct the BTT info block and write it out
 		 * at both the beginning and end of the arena.
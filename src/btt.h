@@ -42,6 +42,9 @@ struct ns_callback {
 		const void *buf, size_t count, off_t off);
 	int (*nsmap)(void *ns, int lane, void **addrp, size_t len, off_t off);
 	void (*nssync)(void *ns, int lane, void *addr, size_t len);
+	int (*nswrite_nosync)(void *ns, int lane,
+		const void *buf, size_t count, off_t off);
+	int (*nsdrain)(void *ns, int lane);
 };
 
 struct btt *btt_init(uint64_t rawsize, uint32_t lbasize, uint8_t parent_uuid[],
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2015, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * cpu.c -- CPU features detection
+ *
+ * Everything is read straight from the CPUID instruction, so checking
+ * for a feature costs no file I/O.  The vector features are reported
+ * as present only if the OS also saves the matching register state,
+ * as reported by XGETBV.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cpuid.h>
+
+#include "cpu.h"
+#include "out.h"
+
+/* leaf 1, EDX */
+#define	bit_CLFLUSH	(1 << 19)
+#define	bit_SSE2_EDX	(1 << 26)
+
+/* leaf 1, ECX */
+#define	bit_SSE42_ECX	(1 << 20)
+#define	bit_OSXSAVE_ECX	(1 << 27)
+#define	bit_AVX_ECX	(1 << 28)
+
+/* leaf 7, subleaf 0, EBX */
+#define	bit_AVX2_EBX	(1 << 5)
+#define	bit_AVX512F_EBX	(1 << 16)
+#define	bit_CLFLUSHOPT	(1 << 23)
+#define	bit_CLWB	(1 << 24)
+
+/* XCR0 state components which must be enabled by the OS */
+#define	XSTATE_SSE	(1 << 1)
+#define	XSTATE_YMM	(1 << 2)
+#define	XSTATE_AVX512	((1 << 5) | (1 << 6) | (1 << 7))
+
+/*
+ * cpuid_leaf -- (internal) run CPUID, returns 0 if the leaf isn't supported
+ */
+static int
+cpuid_leaf(unsigned leaf, unsigned subleaf, unsigned regs[4])
+{
+	if (__get_cpuid_max(leaf & 0x80000000, NULL) < leaf)
+		return 0;
+
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+	return 1;
+}
+
+/*
+ * xcr0 -- (internal) return the state components enabled by the OS
+ */
+static uint64_t
+xcr0(void)
+{
+	unsigned regs[4];
+
+	if (!cpuid_leaf(1, 0, regs) || !(regs[2] & bit_OSXSAVE_ECX))
+		return 0;
+
+	uint32_t lo, hi;
+	__asm__ volatile("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+
+	return (uint64_t)hi << 32 | lo;
+}
+
+/*
+ * is_cpu_feature -- (internal) check one feature bit
+ *
+ * reg is the index (EAX, EBX, ECX, EDX) of the register holding the bit.
+ */
+static int
+is_cpu_feature(unsigned leaf, int reg, unsigned bit)
+{
+	unsigned regs[4];
+
+	if (!cpuid_leaf(leaf, 0, regs))
+		return 0;
+
+	return (regs[reg] & bit) != 0;
+}
+
+/*
+ * is_cpu_clflush_present -- check if CLFLUSH instruction is supported
+ */
+int
+is_cpu_clflush_present(void)
+{
+	int ret = is_cpu_feature(1, 3, bit_CLFLUSH);
+	LOG(4, "clflush %ssupported", ret ? "" : "not ");
+	return ret;
+}
+
+/*
+ * is_cpu_clflushopt_present -- check if CLFLUSHOPT instruction is supported
+ */
+int
+is_cpu_clflushopt_present(void)
+{
+	int ret = is_cpu_feature(7, 1, bit_CLFLUSHOPT);
+	LOG(4, "clflushopt %ssupported", ret ? "" : "not ");
+	return ret;
+}
+
+/*
+ * is_cpu_clwb_present -- check if CLWB instruction is supported
+ */
+int
+is_cpu_clwb_present(void)
+{
+	int ret = is_cpu_feature(7, 1, bit_CLWB);
+	LOG(4, "clwb %ssupported", ret ? "" : "not ");
+	return ret;
+}
+
+/*
+ * is_cpu_sse2_present -- check if SSE2 instructions are supported
+ */
+int
+is_cpu_sse2_present(void)
+{
+	int ret = is_cpu_feature(1, 3, bit_SSE2_EDX);
+	LOG(4, "sse2 %ssupported", ret ? "" : "not ");
+	return ret;
+}
+
+/*
+ * is_cpu_sse42_present -- check if SSE4.2 (and so CRC32) is supported
+ */
+int
+is_cpu_sse42_present(void)
+{
+	int ret = is_cpu_feature(1, 2, bit_SSE42_ECX);
+	LOG(4, "sse4.2 %ssupported", ret ? "" : "not ");
+	return ret;
+}
+
+/*
+ * is_cpu_avx_present -- check if AVX instructions are supported and enabled
+ */
+int
+is_cpu_avx_present(void)
+{
+	uint64_t mask = XSTATE_SSE | XSTATE_YMM;
+	int ret = is_cpu_feature(1, 2, bit_AVX_ECX) && (xcr0() & mask) == mask;
+	LOG(4, "avx %ssupported", ret ? "" : "not ");
+	return ret;
+}
+
+/*
+ * is_cpu_avx2_present -- check if AVX2 is supported and enabled
+ */
+int
+is_cpu_avx2_present(void)
+{
+	uint64_t mask = XSTATE_SSE | XSTATE_YMM;
+	int ret = is_cpu_feature(7, 1, bit_AVX2_EBX) &&
+			(xcr0() & mask) == mask;
+	LOG(4, "avx2 %ssupported", ret ? "" : "not ");
+	return ret;
+}
+
+/*
+ * is_cpu_avx512f_present -- check if AVX-512F is supported and enabled
+ */
+int
+is_cpu_avx512f_present(void)
+{
+	uint64_t mask = XSTATE_SSE | XSTATE_YMM | XSTATE_AVX512;
+	int ret = is_cpu_feature(7, 1, bit_AVX512F_EBX) &&
+			(xcr0() & mask) == mask;
+	LOG(4, "avx512f %ssupported", ret ? "" : "not ");
+	return ret;
+}
@@ -68,11 +68,66 @@ typedef struct pmemlog PMEMlog;
  * basic PMEM flush-to-durability support...
  */
 void *pmem_map(int fd);
+
+/* access pattern hints for pmem_advise() */
+#define	PMEM_ADV_NORMAL 0	/* no special treatment */
+#define	PMEM_ADV_SEQUENTIAL 1	/* expect sequential access */
+#define	PMEM_ADV_RANDOM 2	/* expect random access */
+#define	PMEM_ADV_WILLNEED 3	/* expect access soon, read ahead */
+#define	PMEM_ADV_DONTNEED 4	/* not expecting access soon */
+int pmem_advise(void *addr, size_t len, int advice);
 int pmem_is_pmem(void *addr, size_t len);
+int pmem_is_pmem_refresh(void *addr, size_t len);
 void pmem_persist(void *addr, size_t len, int flags);
 void pmem_flush(void *addr, size_t len, int flags);
 void pmem_fence(void);
 void pmem_drain(void);
+void *pmem_memmove_persist(void *pmemdest, const void *src, size_t len);
+void *pmem_memcpy_persist(void *pmemdest, const void *src, size_t len);
+void *pmem_memset_persist(void *pmemdest, int c, size_t len);
+void *pmem_memmove_nodrain(void *pmemdest, const void *src, size_t len);
+void *pmem_memcpy_nodrain(void *pmemdest, const void *src, size_t len);
+void *pmem_memset_nodrain(void *pmemdest, int c, size_t len);
+
+/*
+ * A PMEMflushset collects ranges to be made persistent together.  Ranges
+ * are flushed, after merging any that share cache lines, and a single
+ * fence is issued when the set is drained.  Only use this for ranges
+ * which may become persistent in any order.  A set can be drained and
+ * filled again any number of times before it's deleted.
+ */
+typedef struct pmemflushset PMEMflushset;
+
+PMEMflushset *pmem_flushset_new(void);
+void pmem_flushset_delete(PMEMflushset *fsp);
+void pmem_flushset_add(PMEMflushset *fsp, void *addr, size_t len);
+int pmem_flushset_drain(PMEMflushset *fsp);
+
+/*
+ * Counters of the work done making ranges persistent on pools which
+ * aren't pmem, where it takes msync().  Comparing ranges to msyncs
+ * shows how much the library coalesced.
+ */
+struct pmem_persist_stats {
+	uint64_t ranges;	/* ranges made persistent */
+	uint64_t msyncs;	/* msync() calls issued */
+	uint64_t pages;		/* pages passed to msync() */
+};
+
+void pmem_persist_stats(struct pmem_persist_stats *statsp);
+
+/*
+ * Asynchronous persistence, for ranges that aren't pmem and are made
+ * persistent by writing back pages.  Async mode is off until started;
+ * until then pmem_persist_async() makes the range persistent before
+ * returning.  pmem_async_wait() waits for the given ticket and every
+ * older one, but only fails if the given ticket's write-back failed.
+ */
+int pmem_async_start(unsigned nthreads);
+void pmem_async_stop(void);
+uint64_t pmem_persist_async(void *addr, size_t len,
+		void (*callback)(void *arg, int error), void *arg);
+int pmem_async_wait(uint64_t ticket);
 
 /*
  * support for memory allocation and transactions in PMEM...
@@ -83,6 +138,7 @@ void pmem_drain(void);
 PMEMobjpool *pmemobj_pool_open(const char *path);
 PMEMobjpool *pmemobj_pool_open_mirrored(const char *path1, const char *path2);
 void pmemobj_pool_close(PMEMobjpool *pop);
+void pmemobj_pool_prefault(PMEMobjpool *pop, unsigned nthreads);
 int pmemobj_pool_check(const char *path);
 int pmemobj_pool_check_mirrored(const char *path1, const char *path2);
 
@@ -94,6 +150,34 @@ typedef struct pmemoid {
 	uint64_t off;
 } PMEMoid;
 
+/*
+ * Offline compaction moves the objects reached from the root object next
+ * to each other, in the order they're reached, and frees all the others.
+ * For every object reached, visit(arg, oid, vp) is called and must call
+ * pmemobj_visit_field(vp, fieldp) for each PMEMoid stored in the object,
+ * then return the alignment the object was allocated with, or 0.  Only
+ * the offsets of those PMEMoids are rewritten.  The pool is built again
+ * in a new file which then replaces it, so a crash leaves the pool as it
+ * was.  The pool must not be open.
+ */
+struct pmemobj_visit;
+
+typedef size_t (*pmemobj_visit_func)(void *arg, PMEMoid oid,
+		struct pmemobj_visit *vp);
+
+/* what pmemobj_pool_compact() did */
+struct pmemobj_compact_stats {
+	uint64_t objects;	/* objects reached, moved */
+	uint64_t bytes;		/* bytes in them */
+	uint64_t dropped;	/* objects not reached, freed */
+	uint64_t lines_before;	/* 4MB lines used before */
+	uint64_t lines_after;	/* and after */
+};
+
+int pmemobj_pool_compact(const char *path, pmemobj_visit_func visit,
+		void *arg, struct pmemobj_compact_stats *statsp);
+void pmemobj_visit_field(struct pmemobj_visit *vp, PMEMoid *fieldp);
+
 /*
  * transaction ID
  */
@@ -170,6 +254,58 @@ int pmemobj_free(PMEMoid oid);
 
 size_t pmemobj_size(PMEMoid oid);	/* no lock/tx required */
 
+/*
+ * Heap statistics, cheap enough to poll while other threads allocate.
+ * Small objects are counted by the block size of their class, and the
+ * room left in the lines threads allocate from counts as neither used
+ * nor free.  Fragmentation is the share of the free space that isn't
+ * in its largest piece.
+ */
+struct pmemobj_heap_stats {
+	size_t heap_size;	/* bytes the allocator hands out from */
+	size_t used;		/* bytes in objects, headers included */
+	size_t free;		/* bytes free for new objects */
+	size_t largest_free;	/* largest piece of free space */
+	double fragmentation;	/* 1 - largest_free / free */
+	size_t lines_total;	/* 4MB lines in the heap */
+	size_t lines_used;	/* lines taken into use so far */
+	size_t huge_objects;	/* objects too big for a line of blocks */
+	size_t huge_bytes;	/* bytes in them */
+	size_t free_extents;	/* free pieces between huge objects */
+	size_t free_runs;	/* runs of free lines */
+	unsigned nclasses;	/* size classes of small objects */
+};
+
+struct pmemobj_class_stats {
+	size_t size;		/* block size of the class */
+	size_t used;		/* blocks in use */
+	size_t free;		/* blocks on the class' free list */
+};
+
+void pmemobj_heap_stats(PMEMobjpool *pop, struct pmemobj_heap_stats *statsp);
+int pmemobj_class_stats(PMEMobjpool *pop, unsigned c,
+		struct pmemobj_class_stats *statsp);
+
+/*
+ * Each thread keeps the small objects it frees in a cache of its own,
+ * and allocates objects of the same size from it first.  Objects in a
+ * cache count as free in the heap statistics.  The number kept per
+ * size class can be set with PMEM_ALLOC_TCACHE in the environment, it's
+ * 64 by default.
+ */
+struct pmemobj_tcache_stats {
+	size_t caches;		/* threads with a cache */
+	size_t cached;		/* objects in the caches */
+	uint64_t hits;		/* allocations served from a cache */
+	uint64_t misses;	/* allocations a cache couldn't serve */
+	uint64_t flushed;	/* objects given back to the heap */
+};
+
+int pmemobj_tcache_flush(PMEMobjpool *pop);
+int pmemobj_tcache_limit(PMEMobjpool *pop, unsigned max);
+void pmemobj_tcache_stats(PMEMobjpool *pop,
+		struct pmemobj_tcache_stats *statsp);
+
 PMEMoid pmemobj_alloc_tid(PMEMtid tid, size_t size);
 PMEMoid pmemobj_zalloc_tid(PMEMtid tid, size_t size);
 PMEMoid pmemobj_realloc_tid(PMEMtid tid, PMEMoid oid, size_t size);
@@ -197,6 +333,7 @@ int pmemobj_memcpy_tid(PMEMtid tid, void *dstp, void *srcp, size_t size);
 #define	PMEMBLK_MIN_BLK ((size_t)512)
 PMEMblk *pmemblk_map(int fd, size_t bsize);
 void pmemblk_unmap(PMEMblk *pbp);
+void pmemblk_prefault(PMEMblk *pbp, unsigned nthreads);
 size_t pmemblk_nblock(PMEMblk *pbp);
 int pmemblk_read(PMEMblk *pbp, void *buf, off_t blockno);
 int pmemblk_write(PMEMblk *pbp, const void *buf, off_t blockno);
@@ -209,10 +346,12 @@ int pmemblk_set_error(PMEMblk *pbp, off_t blockno);
 #define	PMEMLOG_MIN_POOL ((size_t)(1024 * 1024 * 2)) /* min pool size: 2MB */
 PMEMlog *pmemlog_map(int fd);
 void pmemlog_unmap(PMEMlog *plp);
+void pmemlog_prefault(PMEMlog *plp, unsigned nthreads);
 size_t pmemlog_nbyte(PMEMlog *plp);
 int pmemlog_append(PMEMlog *plp, const void *buf, size_t count);
 int pmemlog_appendv(PMEMlog *plp, const struct iovec *iov, int iovcnt);
 off_t pmemlog_tell(PMEMlog *plp);
+int pmemlog_sync(PMEMlog *plp);
 void pmemlog_rewind(PMEMlog *plp);
 void pmemlog_walk(PMEMlog *plp, size_t chunksize,
 	int (*process_chunk)(const void *buf, size_t len, void *arg),
@@ -37,10 +37,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <libpmem.h>
 #include "pmem.h"
 #include "util.h"
@@ -111,21 +113,47 @@ pmem_set_funcs(
 	pmem_set_persist_func(persist_func);
 }
 
+/* counters for pmem_persist_stats() */
+struct pmem_persist_stats Persist_stats;
+
 /*
  * libpmem_persist -- libpmem's central routine for flushing to persistence
  *
  * This routine calls msync() or Persist(), depending on the is_pmem flag.
+ * Unless Persist() is pmem_persist(), which does it itself, the range is
+ * charged to pmem emulation here.  Returns the msync() result, errno is
+ * set on failure.
  */
-void
+int
 libpmem_persist(int is_pmem, void *addr, size_t len)
 {
 	LOG(5, "is_pmem %d addr %p len %zu", is_pmem, addr, len);
 
+	if (is_pmem && Persist == pmem_persist) {
+		pmem_persist(addr, len, 0);
+		return 0;
+	}
+
+	libpmem_emul_write(addr, len);
+	libpmem_emul_drain();
+
 	if (is_pmem) {
 		Persist(addr, len, 0);
-		return;
+		return 0;
 	}
 
+	__sync_fetch_and_add(&Persist_stats.ranges, 1);
+	return libpmem_msync(addr, len);
+}
+
+/*
+ * libpmem_msync -- write back the pages covering a range
+ *
+ * Returns the msync() result, errno is set on failure.
+ */
+int
+libpmem_msync(void *addr, size_t len)
+{
 	uintptr_t uptr;
 
 	/*
@@ -140,6 +168,522 @@ libpmem_persist(int is_pmem, void *addr, size_t len)
 	/* round addr down to page boundary */
 	uptr = (uintptr_t)addr & ~(Pagesize - 1);
 
-	if (msync((void *)uptr, len, MS_SYNC) < 0)
+	__sync_fetch_and_add(&Persist_stats.msyncs, 1);
+	__sync_fetch_and_add(&Persist_stats.pages,
+			(len + Pagesize - 1) / Pagesize);
+
+	int retval = msync((void *)uptr, len, MS_SYNC);
+	if (retval < 0) {
+		int oerrno = errno;
 		LOG(1, "!msync");
+		errno = oerrno;
+	}
+
+	return retval;
+}
+
+/*
+ * pmem_persist_stats -- return the msync() counters
+ */
+void
+pmem_persist_stats(struct pmem_persist_stats *statsp)
+{
+	statsp->ranges = __sync_fetch_and_add(&Persist_stats.ranges, 0);
+	statsp->msyncs = __sync_fetch_and_add(&Persist_stats.msyncs, 0);
+	statsp->pages = __sync_fetch_and_add(&Persist_stats.pages, 0);
+}
+
+/*
+ * libpmem_memcpy_persist -- copy a range into a pool and make it persistent
+ *
+ * On pmem this uses non-temporal stores, so the range is never read back
+ * into the cache just to be flushed.  When the pool isn't pmem, or when
+ * the application replaced the persist function, this is just memcpy()
+ * followed by libpmem_persist().
+ */
+void
+libpmem_memcpy_persist(int is_pmem, void *dest, const void *src, size_t len)
+{
+	LOG(5, "is_pmem %d dest %p src %p len %zu", is_pmem, dest, src, len);
+
+	if (is_pmem && Persist == pmem_persist) {
+		pmem_memcpy_persist(dest, src, len);
+		return;
+	}
+
+	memcpy(dest, src, len);
+	libpmem_persist(is_pmem, dest, len);
+}
+
+/*
+ * libpmem_memcpy_nodrain -- copy a range into a pool, persist it later
+ *
+ * The range must be made persistent with libpmem_drain() before
+ * anything depending on it is written.
+ */
+void
+libpmem_memcpy_nodrain(int is_pmem, void *dest, const void *src, size_t len)
+{
+	LOG(5, "is_pmem %d dest %p src %p len %zu", is_pmem, dest, src, len);
+
+	if (is_pmem && Persist == pmem_persist)
+		pmem_memcpy_nodrain(dest, src, len);
+	else
+		memcpy(dest, src, len);
+}
+
+/*
+ * libpmem_drain -- make ranges written by libpmem_memcpy_nodrain() persistent
+ *
+ * addr and len should cover everything written since the last drain.
+ * They are only used when the stores went through the cache.
+ */
+void
+libpmem_drain(int is_pmem, void *addr, size_t len)
+{
+	LOG(5, "is_pmem %d addr %p len %zu", is_pmem, addr, len);
+
+	if (is_pmem && Persist == pmem_persist) {
+		pmem_fence();
+		pmem_drain();
+		return;
+	}
+
+	libpmem_persist(is_pmem, addr, len);
+}
+
+/*
+ * Dirty page tracker, kept for each pool that isn't pmem.
+ *
+ * Flush sets on such a pool mark the pages they cover in a bitmap
+ * shared by all threads, instead of remembering ranges.  A drain
+ * writes back every run of marked pages with one msync() each, so
+ * pages dirtied by several calls, or by several threads, are written
+ * back once.  Write-backs are serialized by sync_lock: a thread that
+ * finds its pages already unmarked once it holds sync_lock knows the
+ * write-back which took them has completed.  It can't tell whether that
+ * write-back failed though, so failures are counted like Linux does for
+ * fsync() with errseq_t: each observer samples the count when it starts
+ * marking pages, and a sync fails for it if the count moved since.  The
+ * observer then takes the new count, so every failure is reported once
+ * to everybody who could have had pages in it, and then forgotten.
+ */
+struct pmem_dirty {
+	uintptr_t base;			/* page aligned start of the pool */
+	size_t npages;
+	pthread_mutex_t lock;		/* protects bits, lo and hi */
+	pthread_mutex_t sync_lock;	/* held while writing back */
+	size_t lo;			/* marked pages are all in [lo, hi) */
+	size_t hi;
+	uint64_t *bits;			/* one bit per marked page */
+	uint64_t *snap;			/* bits being written back */
+	uint64_t errseq;		/* write-back failures so far */
+	int error;			/* the latest one */
+};
+
+/*
+ * libpmem_dirty_new -- create a dirty page tracker for a pool
+ */
+struct pmem_dirty *
+libpmem_dirty_new(void *addr, size_t len)
+{
+	LOG(3, "addr %p len %zu", addr, len);
+
+	struct pmem_dirty *dp;
+
+	if ((dp = Malloc(sizeof (*dp))) == NULL) {
+		LOG(1, "!Malloc");
+		return NULL;
+	}
+
+	dp->base = (uintptr_t)addr & ~(Pagesize - 1);
+	dp->npages = ((uintptr_t)addr + len - dp->base + Pagesize - 1) /
+			Pagesize;
+	dp->lo = dp->npages;
+	dp->hi = 0;
+	dp->errseq = 0;
+	dp->error = 0;
+
+	size_t nwords = (dp->npages + 63) / 64;
+
+	if ((dp->bits = Malloc(2 * nwords * sizeof (uint64_t))) == NULL) {
+		LOG(1, "!Malloc");
+		Free(dp);
+		return NULL;
+	}
+	memset(dp->bits, 0, nwords * sizeof (uint64_t));
+	dp->snap = dp->bits + nwords;
+
+	pthread_mutex_init(&dp->lock, NULL);
+	pthread_mutex_init(&dp->sync_lock, NULL);
+
+	return dp;
+}
+
+/*
+ * libpmem_dirty_delete -- free a dirty page tracker
+ */
+void
+libpmem_dirty_delete(struct pmem_dirty *dp)
+{
+	LOG(3, "dp %p", dp);
+
+	pthread_mutex_destroy(&dp->lock);
+	pthread_mutex_destroy(&dp->sync_lock);
+	Free(dp->bits);
+	Free(dp);
+}
+
+/*
+ * libpmem_dirty_mark -- remember the pages of a range need writing back
+ *
+ * Returns -1 if the range isn't inside the pool.
+ */
+int
+libpmem_dirty_mark(struct pmem_dirty *dp, void *addr, size_t len)
+{
+	uintptr_t uptr = (uintptr_t)addr;
+
+	if (uptr < dp->base || len == 0)
+		return -1;
+
+	size_t first = (uptr - dp->base) / Pagesize;
+	size_t last = (uptr + len - 1 - dp->base) / Pagesize;
+
+	if (last >= dp->npages)
+		return -1;
+
+	pthread_mutex_lock(&dp->lock);
+
+	for (size_t i = first; i <= last; i++)
+		dp->bits[i / 64] |= 1ULL << (i % 64);
+
+	if (first < dp->lo)
+		dp->lo = first;
+	if (last + 1 > dp->hi)
+		dp->hi = last + 1;
+
+	pthread_mutex_unlock(&dp->lock);
+
+	return 0;
+}
+
+/*
+ * libpmem_dirty_errseq -- sample the tracker's write-back failure count
+ */
+uint64_t
+libpmem_dirty_errseq(struct pmem_dirty *dp)
+{
+	pthread_mutex_lock(&dp->sync_lock);
+	uint64_t errseq = dp->errseq;
+	pthread_mutex_unlock(&dp->sync_lock);
+
+	return errseq;
+}
+
+/*
+ * dirty_failed -- (internal) count a failed write-back
+ *
+ * Called with sync_lock held.
+ */
+static void
+dirty_failed(struct pmem_dirty *dp, int error)
+{
+	dp->errseq++;
+	dp->error = error;
+}
+
+/*
+ * libpmem_dirty_sync -- write back all marked pages
+ *
+ * Each run of consecutive marked pages takes one msync().  Returns -1
+ * with errno set if this write-back, or any other one since the failure
+ * count *errseqp was sampled, failed.  *errseqp is updated to the count
+ * reported.
+ */
+int
+libpmem_dirty_sync(struct pmem_dirty *dp, uint64_t *errseqp)
+{
+	pthread_mutex_lock(&dp->sync_lock);
+	pthread_mutex_lock(&dp->lock);
+
+	size_t lo = dp->lo / 64;
+	size_t hi = (dp->hi + 63) / 64;
+
+	if (lo < hi) {
+		memcpy(&dp->snap[lo], &dp->bits[lo],
+				(hi - lo) * sizeof (uint64_t));
+		memset(&dp->bits[lo], 0, (hi - lo) * sizeof (uint64_t));
+	}
+	dp->lo = dp->npages;
+	dp->hi = 0;
+
+	pthread_mutex_unlock(&dp->lock);
+
+	size_t run = 0;		/* pages in the current run */
+	size_t start = 0;	/* first page of the current run */
+
+	for (size_t w = lo; w < hi; w++) {
+		uint64_t word = dp->snap[w];
+
+		if (run == 0 && word == 0)
+			continue;
+
+		for (unsigned b = 0; b < 64; b++) {
+			if (word & (1ULL << b)) {
+				if (run++ == 0)
+					start = w * 64 + b;
+			} else if (run) {
+				if (libpmem_msync((void *)(dp->base +
+						start * Pagesize),
+						run * Pagesize) < 0)
+					dirty_failed(dp, errno);
+				run = 0;
+			}
+		}
+	}
+
+	if (run && libpmem_msync((void *)(dp->base + start * Pagesize),
+			run * Pagesize) < 0)
+		dirty_failed(dp, errno);
+
+	int error = dp->errseq != *errseqp ? dp->error : 0;
+
+	*errseqp = dp->errseq;
+
+	pthread_mutex_unlock(&dp->sync_lock);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * libpmem_flushset_init -- prepare an empty flush set
+ *
+ * For pools that aren't pmem, the ranges are tracked by page and
+ * written back with one msync() per run of pages when drained.  If
+ * the pool has a dirty page tracker, the pages are marked there, so
+ * they're coalesced with pages marked through the pool's other flush
+ * sets too.
+ */
+void
+libpmem_flushset_init(PMEMflushset *fsp, int is_pmem, struct pmem_dirty *dp)
+{
+	fsp->is_pmem = is_pmem;
+	fsp->pending = 0;
+	fsp->error = 0;
+	fsp->dirty = is_pmem ? NULL : dp;
+	fsp->errseq = fsp->dirty ? libpmem_dirty_errseq(fsp->dirty) : 0;
+	fsp->nranges = 0;
+}
+
+/*
+ * pmem_flushset_new -- allocate an empty flush set for pmem ranges
+ */
+PMEMflushset *
+pmem_flushset_new(void)
+{
+	LOG(3, NULL);
+
+	PMEMflushset *fsp;
+
+	if ((fsp = Malloc(sizeof (*fsp))) == NULL) {
+		LOG(1, "!Malloc");
+		return NULL;
+	}
+
+	libpmem_flushset_init(fsp, 1, NULL);
+
+	return fsp;
+}
+
+/*
+ * pmem_flushset_delete -- free a flush set
+ *
+ * Ranges added since the last drain aren't made persistent.
+ */
+void
+pmem_flushset_delete(PMEMflushset *fsp)
+{
+	LOG(3, "fsp %p", fsp);
+
+	Free(fsp);
+}
+
+/*
+ * libpmem_flushset_memcpy -- copy a range, persisting it with a flush set
+ *
+ * On pmem the copy uses non-temporal stores, which only need the fence
+ * issued when the set is drained.  Otherwise the destination range is
+ * added to the set.
+ */
+void
+libpmem_flushset_memcpy(PMEMflushset *fsp, void *dest, const void *src,
+		size_t len)
+{
+	if (fsp->is_pmem && Persist == pmem_persist) {
+		pmem_memcpy_nodrain(dest, src, len);
+		fsp->pending = 1;
+		return;
+	}
+
+	memcpy(dest, src, len);
+	pmem_flushset_add(fsp, dest, len);
+}
+
+/*
+ * flushset_merge -- (internal) sort the ranges and merge touching ones
+ */
+static void
+flushset_merge(PMEMflushset *fsp)
+{
+	unsigned i, j;
+
+	/* insertion sort, there are never many ranges */
+	for (i = 1; i < fsp->nranges; i++) {
+		uintptr_t base = fsp->ranges[i].base;
+		uintptr_t end = fsp->ranges[i].end;
+
+		for (j = i; j > 0 && fsp->ranges[j - 1].base > base; j--)
+			fsp->ranges[j] = fsp->ranges[j - 1];
+
+		fsp->ranges[j].base = base;
+		fsp->ranges[j].end = end;
+	}
+
+	for (i = 0, j = 1; j < fsp->nranges; j++) {
+		if (fsp->ranges[j].base <= fsp->ranges[i].end) {
+			if (fsp->ranges[j].end > fsp->ranges[i].end)
+				fsp->ranges[i].end = fsp->ranges[j].end;
+		} else {
+			fsp->ranges[++i] = fsp->ranges[j];
+		}
+	}
+
+	if (fsp->nranges)
+		fsp->nranges = i + 1;
+}
+
+/*
+ * flushset_flush -- (internal) flush all the ranges in a set, no fence
+ */
+static void
+flushset_flush(PMEMflushset *fsp)
+{
+	flushset_merge(fsp);
+
+	for (unsigned i = 0; i < fsp->nranges; i++) {
+		void *addr = (void *)fsp->ranges[i].base;
+		size_t len = fsp->ranges[i].end - fsp->ranges[i].base;
+
+		if (!fsp->is_pmem) {
+			if (libpmem_msync(addr, len) < 0 && fsp->error == 0)
+				fsp->error = errno;
+		} else if (Persist == pmem_persist) {
+			pmem_flush(addr, len, 0);
+		} else {
+			Persist(addr, len, 0);
+		}
+	}
+
+	fsp->nranges = 0;
+}
+
+/*
+ * pmem_flushset_add -- add a range to a flush set
+ *
+ * The range is widened to whole cache lines (pages, for non-pmem sets)
+ * and merged with a range already in the set if they touch.  When the
+ * set fills up, the ranges collected so far are flushed right away;
+ * only the fence waits for pmem_flushset_drain().  Ranges which won't
+ * go through pmem_flush() are charged to pmem emulation as they're
+ * added, before widening.
+ */
+void
+pmem_flushset_add(PMEMflushset *fsp, void *addr, size_t len)
+{
+	LOG(15, "fsp %p addr %p len %zu", fsp, addr, len);
+
+	if (len == 0)
+		return;
+
+	fsp->pending = 1;
+
+	if (!fsp->is_pmem || Persist != pmem_persist)
+		libpmem_emul_write(addr, len);
+
+	if (!fsp->is_pmem) {
+		__sync_fetch_and_add(&Persist_stats.ranges, 1);
+
+		if (fsp->dirty &&
+			libpmem_dirty_mark(fsp->dirty, addr, len) == 0)
+			return;
+	}
+
+	uintptr_t align = fsp->is_pmem ? FLUSH_ALIGN : Pagesize;
+	uintptr_t base = (uintptr_t)addr & ~(align - 1);
+	uintptr_t end = ((uintptr_t)addr + len + align - 1) & ~(align - 1);
+
+	for (unsigned i = 0; i < fsp->nranges; i++) {
+		if (base <= fsp->ranges[i].end && end >= fsp->ranges[i].base) {
+			if (base < fsp->ranges[i].base)
+				fsp->ranges[i].base = base;
+			if (end > fsp->ranges[i].end)
+				fsp->ranges[i].end = end;
+			return;
+		}
+	}
+
+	if (fsp->nranges == PMEM_FLUSHSET_MAX) {
+		flushset_merge(fsp);
+		if (fsp->nranges == PMEM_FLUSHSET_MAX)
+			flushset_flush(fsp);
+	}
+
+	fsp->ranges[fsp->nranges].base = base;
+	fsp->ranges[fsp->nranges].end = end;
+	fsp->nranges++;
+}
+
+/*
+ * pmem_flushset_drain -- make everything in a flush set persistent
+ *
+ * The set is empty afterwards and can be used again.  Returns -1 with
+ * errno set if writing back any range added since the last drain failed,
+ * whether here or when the set filled up.
+ */
+int
+pmem_flushset_drain(PMEMflushset *fsp)
+{
+	LOG(15, "fsp %p nranges %u", fsp, fsp->nranges);
+
+	flushset_flush(fsp);
+
+	if (fsp->pending) {
+		if (fsp->is_pmem) {
+			pmem_fence();
+			pmem_drain();
+		} else {
+			if (fsp->dirty && libpmem_dirty_sync(fsp->dirty,
+					&fsp->errseq) < 0 && fsp->error == 0)
+				fsp->error = errno;
+			libpmem_emul_drain();
+		}
+		fsp->pending = 0;
+	}
+
+	int error = fsp->error;
+
+	fsp->error = 0;
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
 }
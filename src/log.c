@@ -56,6 +56,35 @@
 #include "out.h"
 #include "log.h"
 
+/*
+ * In async mode (see pmem_async_start()) appends to a log that isn't
+ * pmem don't wait for the device.  The data is queued for write-back
+ * and the write point on media is moved by a completion callback, only
+ * ever over data already persistent.  Appends completing out of order
+ * are held back until everything older is persistent too.  Callers
+ * needing a durability point use pmemlog_sync().
+ */
+struct log_pending {
+	struct log_pending *next;
+	struct pmemlog *plp;
+	uint64_t write_offset;	/* write point once the data is persistent */
+	int done;
+};
+
+struct log_async {
+	pthread_mutex_t lock;
+	struct log_pending *head;	/* appends in flight, oldest first */
+	struct log_pending *tail;
+	uint64_t write_offset;	/* write point, appends in flight included */
+	uint64_t data_ticket;	/* newest data write-back queued */
+	uint64_t meta_ticket;	/* newest write point write-back queued */
+	int error;		/* a write-back failed, sticks */
+#ifdef DEBUG
+	uint64_t tail_offset;	/* log space from here on is writable */
+	char desc[LOG_FORMAT_DATA_ALIGN];	/* shadow of the descriptor */
+#endif
+};
+
 /*
  * log_init -- load-time initialization for log
  *
@@ -70,6 +99,95 @@ log_init(void)
 	util_init();
 }
 
+#ifdef DEBUG
+/*
+ * log_desc_open -- (internal) leave the pool descriptor writable
+ *
+ * The write point is stored on every append, so instead of unprotecting
+ * the descriptor around each store, it stays writable and is compared
+ * against a shadow copy before each store.  A stray store to it is then
+ * caught at the next append rather than at the time it is made.
+ */
+static void
+log_desc_open(PMEMlog *plp)
+{
+	char *desc = (char *)plp->addr + sizeof (struct pool_hdr);
+
+	memcpy(plp->asyncp->desc, desc, LOG_FORMAT_DATA_ALIGN);
+	RANGE_RW(desc, LOG_FORMAT_DATA_ALIGN);
+}
+
+/*
+ * log_desc_check -- (internal) verify nothing else changed the descriptor
+ */
+static void
+log_desc_check(PMEMlog *plp)
+{
+	char *desc = (char *)plp->addr + sizeof (struct pool_hdr);
+
+	ASSERTeq(memcmp(plp->asyncp->desc, desc, LOG_FORMAT_DATA_ALIGN), 0);
+}
+
+/*
+ * log_desc_update -- (internal) take a store to the descriptor as valid
+ */
+static void
+log_desc_update(PMEMlog *plp)
+{
+	char *desc = (char *)plp->addr + sizeof (struct pool_hdr);
+
+	memcpy(plp->asyncp->desc, desc, LOG_FORMAT_DATA_ALIGN);
+}
+
+/*
+ * log_tail_open -- (internal) unprotect the log space past the write point
+ *
+ * Appends go to the unwritten tail of the log space, so instead of
+ * unprotecting each appended range and protecting it again, the tail is
+ * made writable once and each page is protected when the write point
+ * moves past it.  The page holding the descriptor stays writable.
+ */
+static void
+log_tail_open(PMEMlog *plp)
+{
+	struct log_async *ap = plp->asyncp;
+	uint64_t start = roundup(le64toh(plp->start_offset), Pagesize);
+	uint64_t end = le64toh(plp->end_offset);
+
+	ap->tail_offset = MAX(ap->write_offset & ~(Pagesize - 1), start);
+	if (ap->tail_offset < end)
+		RANGE_RW(plp->addr + ap->tail_offset, end - ap->tail_offset);
+}
+
+/*
+ * log_tail_close -- (internal) protect the pages the write point passed
+ */
+static void
+log_tail_close(PMEMlog *plp, uint64_t write_offset)
+{
+	struct log_async *ap = plp->asyncp;
+	uint64_t passed = write_offset & ~(Pagesize - 1);
+
+	if (passed > ap->tail_offset) {
+		RANGE_RO(plp->addr + ap->tail_offset,
+				passed - ap->tail_offset);
+		ap->tail_offset = passed;
+	}
+}
+
+#define	LOG_DESC_OPEN(plp) log_desc_open(plp)
+#define	LOG_DESC_CHECK(plp) log_desc_check(plp)
+#define	LOG_DESC_UPDATE(plp) log_desc_update(plp)
+#define	LOG_TAIL_OPEN(plp) log_tail_open(plp)
+#define	LOG_TAIL_CLOSE(plp, write_offset) log_tail_close(plp, write_offset)
+#else
+#define	LOG_DESC_OPEN(plp)
+#define	LOG_DESC_CHECK(plp)
+#define	LOG_DESC_UPDATE(plp)
+#define	LOG_TAIL_OPEN(plp)
+#define	LOG_TAIL_CLOSE(plp, write_offset)
+#endif
+
 /*
  * pmemlog_map_common -- (internal) map a log memory pool
  *
@@ -177,7 +295,7 @@ pmemlog_map_common(int fd, int rdonly)
 		hdrp->ro_compat_features = htole32(LOG_FORMAT_RO_COMPAT);
 		uuid_generate(hdrp->uuid);
 		hdrp->crtime = htole64((uint64_t)time(NULL));
-		util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 1);
+		util_checksum_hdr(hdrp, LOG_FORMAT_INCOMPAT, 1);
 		hdrp->checksum = htole64(hdrp->checksum);
 
 		/* store pool's header */
@@ -214,6 +332,19 @@ pmemlog_map_common(int fd, int rdonly)
 		goto err_free;
 	}
 
+	if ((plp->asyncp = Malloc(sizeof (*plp->asyncp))) == NULL) {
+		LOG(1, "!Malloc for the async state");
+		goto err_lock;
+	}
+
+	memset(plp->asyncp, 0, sizeof (*plp->asyncp));
+	plp->asyncp->write_offset = le64toh(plp->write_offset);
+
+	if ((errno = pthread_mutex_init(&plp->asyncp->lock, NULL))) {
+		LOG(1, "!pthread_mutex_init");
+		goto err_async;
+	}
+
 	/*
 	 * If possible, turn off all permissions on the pool header page.
 	 *
@@ -226,9 +357,22 @@ pmemlog_map_common(int fd, int rdonly)
 	RANGE_RO(addr + sizeof (struct pool_hdr),
 			stbuf.st_size - sizeof (struct pool_hdr));
 
+	/*
+	 * except for the descriptor and the space appends go to,
+	 * which are checked differently (debug version only)
+	 */
+	if (!rdonly) {
+		LOG_DESC_OPEN(plp);
+		LOG_TAIL_OPEN(plp);
+	}
+
 	LOG(3, "plp %p", plp);
 	return plp;
 
+err_async:
+	Free(plp->asyncp);
+err_lock:
+	pthread_rwlock_destroy(plp->rwlockp);
 err_free:
 	Free((void *)plp->rwlockp);
 err:
@@ -250,6 +394,110 @@ pmemlog_map(int fd)
 	return pmemlog_map_common(fd, 0);
 }
 
+/*
+ * log_data_done -- (internal) an append's data is persistent
+ *
+ * Called from a flusher thread.  Moves the write point over the oldest
+ * appends whose data is persistent and queues its write-back.
+ */
+static void
+log_data_done(void *arg, int error)
+{
+	struct log_pending *pp = arg;
+	struct pmemlog *plp = pp->plp;
+	struct log_async *ap = plp->asyncp;
+	uint64_t write_offset = 0;
+
+	pthread_mutex_lock(&ap->lock);
+
+	pp->done = 1;
+	if (error && ap->error == 0) {
+		LOG(1, "append write-back failed: %s", strerror(error));
+		ap->error = error;
+	}
+
+	while (ap->error == 0 && ap->head != NULL && ap->head->done) {
+		pp = ap->head;
+		ap->head = pp->next;
+		write_offset = pp->write_offset;
+		Free(pp);
+	}
+	if (ap->head == NULL)
+		ap->tail = NULL;
+
+	if (write_offset) {
+		/* check the pool descriptor (debug version only) */
+		LOG_DESC_CHECK(plp);
+
+		plp->write_offset = htole64(write_offset);
+
+		/* update its shadow copy (debug version only) */
+		LOG_DESC_UPDATE(plp);
+
+		uint64_t ticket = pmem_persist_async(&plp->write_offset,
+				sizeof (plp->write_offset), NULL, NULL);
+		if (ticket != 0)
+			ap->meta_ticket = ticket;
+		else if (libpmem_persist(0, &plp->write_offset,
+				sizeof (plp->write_offset)) < 0 &&
+				ap->error == 0)
+			ap->error = errno;
+	}
+
+	pthread_mutex_unlock(&ap->lock);
+}
+
+/*
+ * log_async_wait -- (internal) wait for the appends in flight
+ *
+ * On return the write point on media covers every append made so far.
+ * Returns -1 with errno set if any of them failed to reach the media.
+ */
+static int
+log_async_wait(PMEMlog *plp)
+{
+	struct log_async *ap = plp->asyncp;
+
+	pthread_mutex_lock(&ap->lock);
+	uint64_t ticket = ap->data_ticket;
+	pthread_mutex_unlock(&ap->lock);
+
+	/* callbacks run before waiters wake, the write point is queued */
+	if (ticket && pmem_async_wait(ticket) < 0)
+		return -1;
+
+	pthread_mutex_lock(&ap->lock);
+	ticket = ap->meta_ticket;
+	int error = ap->error;
+	pthread_mutex_unlock(&ap->lock);
+
+	if (ticket && pmem_async_wait(ticket) < 0)
+		return -1;
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * pmemlog_sync -- wait until every append made so far is persistent
+ *
+ * In async mode appends return once their data is queued, this is
+ * their durability point.  Returns -1 with errno set if any of them
+ * failed to reach the media; the error sticks until the pool is
+ * unmapped.
+ */
+int
+pmemlog_sync(PMEMlog *plp)
+{
+	LOG(3, "plp %p", plp);
+
+	return log_async_wait(plp);
+}
+
 /*
  * pmemlog_unmap -- unmap a log memory pool
  */
@@ -258,12 +506,45 @@ pmemlog_unmap(PMEMlog *plp)
 {
 	LOG(3, "plp %p", plp);
 
+	/* the completion callbacks use the mapping */
+	if (log_async_wait(plp) < 0)
+		LOG(1, "!log_async_wait");
+
+	while (plp->asyncp->head != NULL) {
+		/* held back by a failed write-back */
+		struct log_pending *pp = plp->asyncp->head;
+
+		plp->asyncp->head = pp->next;
+		Free(pp);
+	}
+
+	if ((errno = pthread_mutex_destroy(&plp->asyncp->lock)))
+		LOG(1, "!pthread_mutex_destroy");
+	Free(plp->asyncp);
+
 	if (pthread_rwlock_destroy(plp->rwlockp))
 		LOG(1, "!pthread_rwlock_destroy");
 	Free((void *)plp->rwlockp);
 	util_unmap(plp->addr, plp->size);
 }
 
+/*
+ * pmemlog_prefault -- fault in the whole pool using nthreads
+ *
+ * Meant to be called right after mapping the pool, so the first
+ * appends don't pay for the page faults.
+ */
+void
+pmemlog_prefault(PMEMlog *plp, unsigned nthreads)
+{
+	LOG(3, "plp %p nthreads %u", plp, nthreads);
+
+	/* the header is kept inaccessible, there's nothing to fault in */
+	util_prefault((char *)plp->addr + sizeof (struct pool_hdr),
+			plp->size - sizeof (struct pool_hdr), nthreads,
+			plp->is_pmem);
+}
+
 /*
  * pmemlog_nbyte -- return usable size of a log memory pool
  */
@@ -289,25 +570,70 @@ pmemlog_nbyte(PMEMlog *plp)
 /*
  * pmemlog_persist -- (internal) persist data, then metadata
  *
+ * In async mode the data is only queued, see log_data_done().
  * On entry, the write lock should be held.
  */
-static void
+static int
 pmemlog_persist(PMEMlog *plp, uint64_t new_write_offset)
 {
-	uint64_t old_write_offset = le64toh(plp->write_offset);
+	struct log_async *ap = plp->asyncp;
+	uint64_t old_write_offset = ap->write_offset;
 	size_t length = new_write_offset - old_write_offset;
+	struct log_pending *pp = NULL;
+
+	if (!plp->is_pmem && libpmem_async_running() &&
+			(pp = Malloc(sizeof (*pp))) != NULL) {
+		pp->next = NULL;
+		pp->plp = plp;
+		pp->write_offset = new_write_offset;
+		pp->done = 0;
+
+		pthread_mutex_lock(&ap->lock);
+		int error = ap->error;
+		if (error == 0) {
+			if (ap->tail)
+				ap->tail->next = pp;
+			else
+				ap->head = pp;
+			ap->tail = pp;
+		}
+		pthread_mutex_unlock(&ap->lock);
 
-	/* unprotect the log space range (debug version only) */
-	RANGE_RW(plp->addr + old_write_offset, length);
+		if (error) {
+			Free(pp);
+			errno = error;
+			return -1;
+		}
+
+		ap->write_offset = new_write_offset;
+
+		/* pp may be freed as soon as the request is queued */
+		uint64_t ticket = pmem_persist_async(plp->addr +
+				old_write_offset, length, log_data_done, pp);
+		if (ticket == 0) {
+			int error = 0;
+			if (libpmem_persist(0, plp->addr + old_write_offset,
+					length) < 0)
+				error = errno;
+			log_data_done(pp, error);
+		} else {
+			pthread_mutex_lock(&ap->lock);
+			ap->data_ticket = ticket;
+			pthread_mutex_unlock(&ap->lock);
+		}
 
-	/* persist the data */
-	libpmem_persist(plp->is_pmem, plp->addr + old_write_offset, length);
+		return 0;
+	}
+
+	/* appends still in flight reach the media first */
+	if (log_async_wait(plp) < 0)
+		return -1;
 
-	/* protect the log space range (debug version only) */
-	RANGE_RO(plp->addr + old_write_offset, length);
+	/* persist the data, flushing doesn't need the range writable */
+	libpmem_drain(plp->is_pmem, plp->addr + old_write_offset, length);
 
-	/* unprotect the pool descriptor (debug version only) */
-	RANGE_RW(plp->addr + sizeof (struct pool_hdr), LOG_FORMAT_DATA_ALIGN);
+	/* check the pool descriptor (debug version only) */
+	LOG_DESC_CHECK(plp);
 
 	/* write the metadata */
 	plp->write_offset = htole64(new_write_offset);
@@ -316,8 +642,12 @@ pmemlog_persist(PMEMlog *plp, uint64_t new_write_offset)
 	libpmem_persist(plp->is_pmem, &plp->write_offset,
 			sizeof (plp->write_offset));
 
-	/* set the write-protection again (debug version only) */
-	RANGE_RO(plp->addr + sizeof (struct pool_hdr), LOG_FORMAT_DATA_ALIGN);
+	/* update its shadow copy (debug version only) */
+	LOG_DESC_UPDATE(plp);
+
+	ap->write_offset = new_write_offset;
+
+	return 0;
 }
 
 /*
@@ -343,7 +673,7 @@ pmemlog_append(PMEMlog *plp, const void *buf, size_t count)
 
 	/* get the current values */
 	uint64_t end_offset = le64toh(plp->end_offset);
-	uint64_t write_offset = le64toh(plp->write_offset);
+	uint64_t write_offset = plp->asyncp->write_offset;
 
 	if (write_offset >= end_offset) {
 		/* no space left */
@@ -357,25 +687,22 @@ pmemlog_append(PMEMlog *plp, const void *buf, size_t count)
 		} else {
 			char *data = plp->addr;
 
-			/*
-			 * unprotect the log space range,
-			 * where the new data will be stored
-			 * (debug version only)
-			 */
-			RANGE_RW(&data[write_offset], count);
-
-			memcpy(&data[write_offset], buf, count);
-
-			/* protect the log space range (debug version only) */
-			RANGE_RO(&data[write_offset], count);
+			libpmem_memcpy_nodrain(plp->is_pmem,
+					&data[write_offset], buf, count);
 
 			write_offset += count;
+
+			/*
+			 * protect the log space the write point
+			 * has moved past (debug version only)
+			 */
+			LOG_TAIL_CLOSE(plp, write_offset);
 		}
 	}
 
 	/* persist the data and the metadata only if there was no error */
 	if (ret == 0)
-		pmemlog_persist(plp, write_offset);
+		ret = pmemlog_persist(plp, write_offset);
 
 	int oerrno = errno;
 	if (pthread_rwlock_unlock(plp->rwlockp))
@@ -409,7 +736,7 @@ pmemlog_appendv(PMEMlog *plp, const struct iovec *iov, int iovcnt)
 
 	/* get the current values */
 	uint64_t end_offset = le64toh(plp->end_offset);
-	uint64_t write_offset = le64toh(plp->write_offset);
+	uint64_t write_offset = plp->asyncp->write_offset;
 
 	if (write_offset >= end_offset) {
 		/* no space left */
@@ -432,31 +759,25 @@ pmemlog_appendv(PMEMlog *plp, const struct iovec *iov, int iovcnt)
 			/* append the data */
 			for (i = 0; i < iovcnt; ++i) {
 				buf = iov[i].iov_base;
-				count = iov[i].iov_len;
 
-				/*
-				 * unprotect the log space range,
-				 * where the new data will be stored
-				 * (debug version only)
-				 */
-				RANGE_RW(&data[write_offset], count);
+				libpmem_memcpy_nodrain(plp->is_pmem,
+					&data[write_offset], buf,
+					iov[i].iov_len);
 
-				memcpy(&data[write_offset], buf, count);
-
-				/*
-				 * protect the log space range
-				 * (debug version only)
-				 */
-				RANGE_RO(&data[write_offset], count);
-
-				write_offset += count;
+				write_offset += iov[i].iov_len;
 			}
+
+			/*
+			 * protect the log space the write point
+			 * has moved past (debug version only)
+			 */
+			LOG_TAIL_CLOSE(plp, write_offset);
 		}
 	}
 
 	/* persist the data and the metadata only if there was no error */
 	if (ret == 0)
-		pmemlog_persist(plp, write_offset);
+		ret = pmemlog_persist(plp, write_offset);
 
 	int oerrno = errno;
 	if (pthread_rwlock_unlock(plp->rwlockp))
@@ -479,7 +800,7 @@ pmemlog_tell(PMEMlog *plp)
 		return (off_t)-1;
 	}
 
-	off_t wp = le64toh(plp->write_offset) - le64toh(plp->start_offset);
+	off_t wp = plp->asyncp->write_offset - le64toh(plp->start_offset);
 	LOG(4, "write offset %zu", wp);
 
 	if (pthread_rwlock_unlock(plp->rwlockp))
@@ -507,14 +828,23 @@ pmemlog_rewind(PMEMlog *plp)
 		return;
 	}
 
-	/* unprotect the pool descriptor (debug version only) */
-	RANGE_RW(plp->addr + sizeof (struct pool_hdr), LOG_FORMAT_DATA_ALIGN);
+	/* a late callback mustn't move the write point again */
+	if (log_async_wait(plp) < 0)
+		LOG(1, "!log_async_wait");
+
+	/* check the pool descriptor (debug version only) */
+	LOG_DESC_CHECK(plp);
 
 	plp->write_offset = plp->start_offset;
 	libpmem_persist(plp->is_pmem, &plp->write_offset, sizeof (uint64_t));
 
-	/* set the write-protection again (debug version only) */
-	RANGE_RO(plp->addr + sizeof (struct pool_hdr), LOG_FORMAT_DATA_ALIGN);
+	/* update its shadow copy (debug version only) */
+	LOG_DESC_UPDATE(plp);
+
+	plp->asyncp->write_offset = le64toh(plp->start_offset);
+
+	/* the space behind the write point is unwritten again (debug only) */
+	LOG_TAIL_OPEN(plp);
 
 	if (pthread_rwlock_unlock(plp->rwlockp))
 		LOG(1, "!pthread_rwlock_unlock");
@@ -543,7 +873,7 @@ pmemlog_walk(PMEMlog *plp, size_t chunksize,
 	}
 
 	char *data = plp->addr;
-	uint64_t write_offset = le64toh(plp->write_offset);
+	uint64_t write_offset = plp->asyncp->write_offset;
 	uint64_t data_offset = le64toh(plp->start_offset);
 	size_t len;
 
@@ -55,6 +55,7 @@ struct pmemlog {
 	int is_pmem;			/* true if pool is PMEM */
 	int rdonly;			/* true if pool is opened read-only */
 	pthread_rwlock_t *rwlockp;	/* pointer to RW lock */
+	struct log_async *asyncp;	/* appends being written back */
 };
 
 /* data area starts at this alignement after the struct pmemlog above */
@@ -64,6 +64,7 @@ typedef enum {
 	TXOP_ALLOC,
 	TXOP_FREE,
 	TXOP_SET,
+	TXOP_EXTEND,
 } op_t;
 
 struct tx {
@@ -74,6 +75,7 @@ struct tx {
 	PMEMobjpool *pool;
 
 	struct tx *next;	/* outer transaction when nested */
+	PMEMflushset flushset;	/* ranges to persist before tx ends */
 	/* one of these is pushed for each operation in a transaction */
 	struct txop *head;
 	struct txop *tail;
@@ -93,6 +95,10 @@ struct tx {
 				uint64_t data;
 				size_t len;
 			} set;
+			struct {
+				uint64_t addr;
+				size_t size;	/* usable size before */
+			} extend;
 		} args;
 	} *txops;
 };
@@ -212,7 +218,7 @@ pmemobj_pool_open(const char *path)
 		hdrp->ro_compat_features = htole32(OBJ_FORMAT_RO_COMPAT);
 		uuid_generate(hdrp->uuid);
 		hdrp->crtime = htole64((uint64_t)time(NULL));
-		util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 1);
+		util_checksum_hdr(hdrp, OBJ_FORMAT_INCOMPAT, 1);
 		hdrp->checksum = htole64(hdrp->checksum);
 
 		/* store pool's header */
@@ -221,13 +227,30 @@ pmemobj_pool_open(const char *path)
 		/* initialize pool metadata */
 		memset(&pop->rootlock, '\0', sizeof (pop->rootlock));
 		pop->root.off = 0;
+		memset(&pop->heap_hdr, '\0', sizeof (pop->heap_hdr));
+		libpmem_persist(is_pmem, &pop->rootlock,
+				(uintptr_t)(&pop->heap_hdr + 1) -
+				(uintptr_t)&pop->rootlock);
 	}
 
 	/* use some of the memory pool area for run-time info */
 	pop->addr = addr;
 	pop->size = stbuf.st_size;
+	pop->is_pmem = is_pmem;
+
+	/* not fatal, flush sets just won't share their pages */
+	pop->dirty = is_pmem ? NULL : libpmem_dirty_new(addr, stbuf.st_size);
 
-	allocator_init(&pop->allocator, sizeof (struct pmemobjpool), is_pmem);
+	pop->home_node = util_addr_node(addr);
+	LOG(3, "home node %d", pop->home_node);
+
+	pop->heap = allocator_new(&pop->heap_hdr, addr, stbuf.st_size,
+			sizeof (struct pmemobjpool), is_pmem);
+	if (pop->heap == NULL) {
+		if (pop->dirty)
+			libpmem_dirty_delete(pop->dirty);
+		goto err;	/* allocator_new() set errno */
+	}
 
 	/*
 	 * If possible, turn off all permissions on the pool header page.
@@ -269,9 +292,29 @@ pmemobj_pool_close(PMEMobjpool *pop)
 {
 	LOG(3, "pop %p", pop);
 
+	allocator_delete(pop->heap);
+	if (pop->dirty)
+		libpmem_dirty_delete(pop->dirty);
 	util_unmap(pop->addr, pop->size);
 }
 
+/*
+ * pmemobj_pool_prefault -- fault in the whole pool using nthreads
+ *
+ * Meant to be called right after opening the pool, so the first
+ * requests don't pay for the page faults.
+ */
+void
+pmemobj_pool_prefault(PMEMobjpool *pop, unsigned nthreads)
+{
+	LOG(3, "pop %p nthreads %u", pop, nthreads);
+
+	/* the header is kept inaccessible, there's nothing to fault in */
+	util_prefault((char *)pop->addr + sizeof (struct pool_hdr),
+			pop->size - sizeof (struct pool_hdr), nthreads,
+			pop->is_pmem);
+}
+
 /*
  * pmemobj_pool_check -- transactional memory pool consistency check
  */
@@ -650,6 +693,438 @@ zalloc(size_t size)
 	return (void *)ptr;
 }
 
+/*
+ * An object reached while compacting: where it was and where it went.
+ */
+struct visit_obj {
+	uint64_t off;		/* offset in the old pool */
+	uint64_t noff;		/* offset in the new one */
+};
+
+/*
+ * A PMEMoid field found in an object, patched once every object reached
+ * has been copied.
+ */
+struct visit_field {
+	size_t owner;		/* index of the object holding it */
+	uint64_t where;		/* offset of the field in the object */
+	uint64_t target;	/* old offset it refers to */
+};
+
+struct pmemobj_visit {
+	PMEMobjpool *pop;	/* the pool being compacted */
+	uint64_t off;		/* object being visited */
+	size_t cur;		/* and its index */
+	size_t size;		/* and its usable size */
+
+	struct visit_obj *objs;	/* objects in the order reached */
+	size_t nobjs;
+	size_t maxobjs;
+
+	struct visit_field *fields;
+	size_t nfields;
+	size_t maxfields;
+
+	uint64_t *seen;		/* open hash of old offsets, 0 is empty */
+	size_t *seen_idx;	/* and their index in objs */
+	size_t seen_size;	/* a power of two */
+
+	int error;		/* errno of the first failure */
+};
+
+/*
+ * visit_lookup -- (internal) find the slot of old offset off
+ */
+static size_t
+visit_lookup(struct pmemobj_visit *vp, uint64_t off)
+{
+	size_t mask = vp->seen_size - 1;
+	size_t i = (size_t)((off >> 3) * 0x9e3779b97f4a7c15ULL) & mask;
+
+	while (vp->seen[i] != 0 && vp->seen[i] != off)
+		i = (i + 1) & mask;
+
+	return i;
+}
+
+/*
+ * visit_grow -- (internal) double the hash of offsets seen
+ */
+static int
+visit_grow(struct pmemobj_visit *vp)
+{
+	size_t osize = vp->seen_size;
+	uint64_t *oseen = vp->seen;
+	size_t *oidx = vp->seen_idx;
+	size_t nsize = osize ? 2 * osize : 1024;
+
+	if ((vp->seen = zalloc(nsize * sizeof (*vp->seen))) == NULL ||
+	    (vp->seen_idx = Malloc(nsize * sizeof (*vp->seen_idx))) == NULL) {
+		Free(vp->seen);
+		vp->seen = oseen;
+		vp->seen_idx = oidx;
+		return -1;
+	}
+	vp->seen_size = nsize;
+
+	for (size_t i = 0; i < osize; i++)
+		if (oseen[i] != 0) {
+			size_t j = visit_lookup(vp, oseen[i]);
+			vp->seen[j] = oseen[i];
+			vp->seen_idx[j] = oidx[i];
+		}
+
+	Free(oseen);
+	Free(oidx);
+	return 0;
+}
+
+/*
+ * visit_valid -- (internal) check off can be an object of the old pool
+ */
+static int
+visit_valid(struct pmemobj_visit *vp, uint64_t off)
+{
+	PMEMobjpool *pop = vp->pop;
+
+	if (off < sizeof (struct pmemobjpool) || off >= pop->size ||
+			off % PMEMOID_INTERNAL_ALIGN)
+		return 0;
+
+	size_t size = psize(pop->heap, off);
+
+	return size != 0 && size <= pop->size - off;
+}
+
+/*
+ * visit_enqueue -- (internal) queue the object at off, unless seen before
+ */
+static int
+visit_enqueue(struct pmemobj_visit *vp, uint64_t off)
+{
+	if (2 * (vp->nobjs + 1) > vp->seen_size && visit_grow(vp) < 0)
+		return -1;
+
+	size_t i = visit_lookup(vp, off);
+	if (vp->seen[i] != 0)
+		return 0;
+
+	if (vp->nobjs == vp->maxobjs) {
+		size_t max = vp->maxobjs ? 2 * vp->maxobjs : 1024;
+		struct visit_obj *objs = Realloc(vp->objs,
+				max * sizeof (*objs));
+
+		if (objs == NULL)
+			return -1;
+		vp->objs = objs;
+		vp->maxobjs = max;
+	}
+
+	vp->seen[i] = off;
+	vp->seen_idx[i] = vp->nobjs;
+	vp->objs[vp->nobjs].off = off;
+	vp->objs[vp->nobjs].noff = 0;
+	vp->nobjs++;
+	return 0;
+}
+
+/*
+ * pmemobj_visit_field -- report a PMEMoid stored in the object visited
+ *
+ * fieldp must point into the object passed to the visit function.  A
+ * null PMEMoid is left alone.  Errors are kept and returned by
+ * pmemobj_pool_compact().
+ */
+void
+pmemobj_visit_field(struct pmemobj_visit *vp, PMEMoid *fieldp)
+{
+	LOG(15, "vp %p fieldp %p", vp, fieldp);
+
+	if (vp->error)
+		return;
+
+	uintptr_t obj = (uintptr_t)vp->pop->addr + vp->off;
+	uintptr_t field = (uintptr_t)fieldp;
+
+	if (field < obj || field + sizeof (*fieldp) > obj + vp->size) {
+		LOG(1, "field %p outside of object %p", fieldp, (void *)obj);
+		vp->error = EINVAL;
+		return;
+	}
+
+	uint64_t target = fieldp->off;
+	if (target == 0)
+		return;
+
+	if (!visit_valid(vp, target)) {
+		LOG(1, "field %p refers to bad offset 0x%jx",
+				fieldp, (uintmax_t)target);
+		vp->error = EINVAL;
+		return;
+	}
+
+	if (vp->nfields == vp->maxfields) {
+		size_t max = vp->maxfields ? 2 * vp->maxfields : 1024;
+		struct visit_field *fields = Realloc(vp->fields,
+				max * sizeof (*fields));
+
+		if (fields == NULL) {
+			vp->error = ENOMEM;
+			return;
+		}
+		vp->fields = fields;
+		vp->maxfields = max;
+	}
+
+	struct visit_field *fp = &vp->fields[vp->nfields++];
+	fp->owner = vp->cur;
+	fp->where = field - obj;
+	fp->target = target;
+
+	if (visit_enqueue(vp, target) < 0)
+		vp->error = ENOMEM;
+}
+
+/*
+ * compact_count -- (internal) count the objects allocated in a pool
+ */
+static uint64_t
+compact_count(PMEMobjpool *pop, struct pmemobj_heap_stats *hsp)
+{
+	uint64_t count = hsp->huge_objects;
+	struct pmemobj_class_stats cs;
+
+	for (unsigned c = 0; c < hsp->nclasses; c++)
+		if (allocator_class_stats(pop->heap, c, &cs) == 0)
+			count += cs.used;
+
+	return count;
+}
+
+/*
+ * compact_copy -- (internal) copy what's reached from old's root to new
+ *
+ * Objects are allocated in new in the order they're reached, breadth
+ * first, so they end up next to each other, then the PMEMoid fields the
+ * visit function reported are pointed at the copies.
+ */
+static int
+compact_copy(PMEMobjpool *old, PMEMobjpool *new, struct pmemobj_visit *vp,
+	pmemobj_visit_func visit, void *arg, struct pmemobj_compact_stats *sp)
+{
+	PMEMflushset fs;
+
+	libpmem_flushset_init(&fs, new->is_pmem, new->dirty);
+
+	if (!visit_valid(vp, old->root.off)) {
+		LOG(1, "bad root offset 0x%jx", (uintmax_t)old->root.off);
+		errno = EINVAL;
+		return -1;
+	}
+	if (visit_enqueue(vp, old->root.off) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (vp->cur = 0; vp->cur < vp->nobjs; vp->cur++) {
+		struct visit_obj *op = &vp->objs[vp->cur];
+		PMEMoid oid = { (uint64_t)old->addr, op->off };
+
+		vp->off = op->off;
+		vp->size = psize(old->heap, op->off);
+
+		size_t align = (*visit)(arg, oid, vp);
+		if (vp->error) {
+			errno = vp->error;
+			return -1;
+		}
+
+		/* the visit may have grown objs */
+		op = &vp->objs[vp->cur];
+
+		int ret = align > PMEMOID_INTERNAL_ALIGN ?
+			pmalloc_aligned(new->heap, &op->noff, align,
+					vp->size, &fs) :
+			pmalloc(new->heap, &op->noff, vp->size, &fs);
+		if (ret < 0)
+			return -1;	/* pmalloc() set errno */
+
+		libpmem_flushset_memcpy(&fs, (char *)new->addr + op->noff,
+				(char *)old->addr + op->off, vp->size);
+
+		sp->objects++;
+		sp->bytes += vp->size;
+	}
+
+	for (size_t f = 0; f < vp->nfields; f++) {
+		struct visit_field *fp = &vp->fields[f];
+		size_t i = visit_lookup(vp, fp->target);
+		PMEMoid *fieldp = (PMEMoid *)((char *)new->addr +
+				vp->objs[fp->owner].noff + fp->where);
+
+		fieldp->off = vp->objs[vp->seen_idx[i]].noff;
+		pmem_flushset_add(&fs, &fieldp->off, sizeof (fieldp->off));
+	}
+
+	new->root.pool = (uint64_t)new->addr;
+	new->root.off = vp->objs[0].noff;
+	pmem_flushset_add(&fs, &new->root, sizeof (new->root));
+
+	return pmem_flushset_drain(&fs);
+}
+
+/*
+ * compact_create -- (internal) make an empty pool file like the one at path
+ *
+ * The file is as big as the old one, but sparse, and has its header, so
+ * opening it lays out an empty heap for the same pool.  A file left at
+ * tmp by a compaction that crashed is removed first; the pool isn't
+ * open, so no other compaction can be using it.
+ */
+static int
+compact_create(const char *path, const char *tmp, size_t size)
+{
+	struct pool_hdr hdr;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		LOG(1, "!%s", path);
+		return -1;
+	}
+	if (pread(fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)) {
+		LOG(1, "!%s", path);
+		if (errno == 0)
+			errno = EINVAL;
+		(void) close(fd);
+		return -1;
+	}
+	(void) close(fd);
+
+	if (unlink(tmp) < 0 && errno != ENOENT) {
+		LOG(1, "!%s", tmp);
+		return -1;
+	}
+	if ((fd = open(tmp, O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR)) < 0) {
+		LOG(1, "!%s", tmp);
+		return -1;
+	}
+	if (ftruncate(fd, (off_t)size) < 0 ||
+	    pwrite(fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+	    fsync(fd) < 0) {
+		LOG(1, "!%s", tmp);
+		int oerrno = errno;
+		(void) close(fd);
+		(void) unlink(tmp);
+		errno = oerrno;
+		return -1;
+	}
+	(void) close(fd);
+
+	return 0;
+}
+
+/*
+ * pmemobj_pool_compact -- move the live objects of a pool together, offline
+ *
+ * The objects reached from the root through the PMEMoid fields visit
+ * reports are copied, in that order, into a new sparse file holding an
+ * empty heap, which then replaces the pool.  Everything else is left
+ * behind, so the lines it took up aren't in the new file at all.
+ * statsp, if not NULL, is filled in with what was done.
+ */
+int
+pmemobj_pool_compact(const char *path, pmemobj_visit_func visit, void *arg,
+	struct pmemobj_compact_stats *statsp)
+{
+	LOG(3, "path \"%s\"", path);
+
+	struct pmemobj_compact_stats stats;
+	struct pmemobj_heap_stats hs;
+	struct pmemobj_visit v;
+	PMEMobjpool *old, *new = NULL;
+	char *tmp = NULL;
+	int ret = -1;
+	int oerrno;
+
+	memset(&stats, '\0', sizeof (stats));
+	memset(&v, '\0', sizeof (v));
+
+	if (visit == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((old = pmemobj_pool_open(path)) == NULL)
+		return -1;	/* pmemobj_pool_open() set errno */
+
+	if (old->root.off == 0) {
+		LOG(3, "no root object, nothing to compact");
+		pmemobj_pool_close(old);
+		if (statsp)
+			*statsp = stats;
+		return 0;
+	}
+
+	allocator_stats(old->heap, &hs);
+	stats.lines_before = hs.lines_used;
+	uint64_t count = compact_count(old, &hs);
+
+	size_t len = strlen(path);
+	if ((tmp = Malloc(len + sizeof (".compact"))) == NULL) {
+		LOG(1, "!Malloc");
+		goto out;
+	}
+	memcpy(tmp, path, len);
+	strcpy(tmp + len, ".compact");
+
+	if (compact_create(path, tmp, old->size) < 0)
+		goto out;
+
+	if ((new = pmemobj_pool_open(tmp)) == NULL)
+		goto err;	/* pmemobj_pool_open() set errno */
+
+	v.pop = old;
+	if (compact_copy(old, new, &v, visit, arg, &stats) < 0)
+		goto err;
+
+	allocator_stats(new->heap, &hs);
+	stats.lines_after = hs.lines_used;
+	stats.dropped = count - stats.objects;
+
+	pmemobj_pool_close(new);
+	new = NULL;
+	pmemobj_pool_close(old);
+	old = NULL;
+
+	if (rename(tmp, path) < 0) {
+		LOG(1, "!rename %s", tmp);
+		goto err;
+	}
+
+	if (statsp)
+		*statsp = stats;
+	ret = 0;
+	goto out;
+
+err:
+	oerrno = errno;
+	if (new)
+		pmemobj_pool_close(new);
+	(void) unlink(tmp);
+	errno = oerrno;
+out:
+	oerrno = errno;
+	if (old)
+		pmemobj_pool_close(old);
+	Free(tmp);
+	Free(v.objs);
+	Free(v.fields);
+	Free(v.seen);
+	Free(v.seen_idx);
+	errno = oerrno;
+	return ret;
+}
+
 /*
  * pmemobj_root_direct -- return direct access to root object
  *
@@ -671,11 +1146,35 @@ pmemobj_root_direct(PMEMobjpool *pop, size_t size)
 {
 	pmemobj_mutex_lock(&pop->rootlock);
 	if (pop->root.off == 0) {
+		PMEMflushset fs;
+
+		libpmem_flushset_init(&fs, pop->is_pmem, pop->dirty);
 		pop->root.pool = (uint64_t)pop->addr;
-		pmalloc(&(pop->allocator), &(pop->root.off), size);
+		if (pmalloc(pop->heap, &(pop->root.off), size, &fs) == 0) {
+			/* a reused block still holds its old contents */
+			void *rootp = (char *)pop->addr + pop->root.off;
+
+			memset(rootp, 0, size);
+			pmem_flushset_add(&fs, rootp, size);
+			pmem_flushset_add(&fs, &pop->root,
+					sizeof (pop->root));
+		}
+		if (pmem_flushset_drain(&fs) < 0) {
+			int oerrno = errno;
+			pmemobj_mutex_unlock(&pop->rootlock);
+			errno = oerrno;
+			return NULL;
+		}
 	}
 	pmemobj_mutex_unlock(&pop->rootlock);
-	return pmemobj_direct(pop->root);
+
+	if (pop->root.off == 0)
+		return NULL;	/* pmalloc() set errno */
+
+	/* the pool may be mapped elsewhere than when the root was made */
+	PMEMoid root = { (uint64_t)pop->addr, pop->root.off };
+
+	return pmemobj_direct(root);
 }
 
 /*
@@ -701,6 +1200,7 @@ pmemobj_tx_begin(PMEMobjpool *pop, jmp_buf env)
 {
 	struct tx *txp = zalloc(sizeof (*txp));
 	txp->pool = pop;
+	libpmem_flushset_init(&txp->flushset, pop->is_pmem, pop->dirty);
 
 	if (env) {
 		txp->valid_env = 1;
@@ -761,34 +1261,47 @@ pmemobj_txop_oncommit_alloc(struct tx *txp, union txop_args args)
 void
 pmemobj_txop_oncommit_free(struct tx *txp, union txop_args args)
 {
-	pfree(&(txp->pool->allocator), args.free.addr);
+	pfree(txp->pool->heap, args.free.addr, &txp->flushset);
 }
 
 void
 pmemobj_txop_oncommit_set(struct tx *txp, union txop_args args)
 {
-	pfree(&(txp->pool->allocator), args.set.data);
+	pfree(txp->pool->heap, args.set.data, &txp->flushset);
+}
+
+void
+pmemobj_txop_oncommit_extend(struct tx *txp, union txop_args args)
+{
 }
 
 pmemobj_txop_onaction_t oncommit_funcs[] = {
 	pmemobj_txop_oncommit_alloc,
 	pmemobj_txop_oncommit_free,
-	pmemobj_txop_oncommit_set
+	pmemobj_txop_oncommit_set,
+	pmemobj_txop_oncommit_extend
 };
 
 int
 pmemobj_tx_action_tid(PMEMtid tid, pmemobj_txop_onaction_t *actions)
 {
 	struct tx *tx = (struct tx *)tid;
+	int error = 0;
+
 	if (tx->next == NULL) {
 		struct txop *op = tx->tail;
 		for (; op != NULL; op = op->prev) {
 			actions[op->op](tx, op->args);
 		}
+		if (pmem_flushset_drain(&tx->flushset) < 0)
+			error = errno;
 		free(tx);
 		free(Curthread_txinfop);
 		Curthread_txinfop = NULL;
 	} else {
+		/* the outer flush set doesn't know about these ranges */
+		if (pmem_flushset_drain(&tx->flushset) < 0)
+			error = errno;
 		tx->head->prev = tx->next->tail;
 		tx->next->tail->next = tx->head;
 		tx->next->tail = tx->tail;
@@ -796,7 +1309,7 @@ pmemobj_tx_action_tid(PMEMtid tid, pmemobj_txop_onaction_t *actions)
 		free(tx);
 	}
 
-	return 0;
+	return error ? tx_error(0, error) : 0;
 }
 
 /*
@@ -822,6 +1335,28 @@ pmemobj_unlock_locks_tid(PMEMtid tid)
 int
 pmemobj_tx_commit_tid(PMEMtid tid)
 {
+	struct tx *tx = (struct tx *)tid;
+
+	/*
+	 * Everything changed by the outermost transaction becomes
+	 * persistent, with a single drain, before any undo data
+	 * gets released by the commit actions.  If that fails, the
+	 * changes are rolled back instead.
+	 */
+	if (tx->next == NULL) {
+		struct txop *op;
+		for (op = tx->head; op != NULL; op = op->next)
+			if (op->op == TXOP_SET)
+				pmem_flushset_add(&tx->flushset,
+						op->args.set.addr,
+						op->args.set.len);
+		if (pmem_flushset_drain(&tx->flushset) < 0) {
+			int oerrno = errno;
+			pmemobj_tx_abort_tid(tid, oerrno);
+			return tx_error(0, oerrno);
+		}
+	}
+
 	pmemobj_unlock_locks_tid(tid);
 	return pmemobj_tx_action_tid(tid, oncommit_funcs);
 }
@@ -851,7 +1386,7 @@ pmemobj_tx_commit_multiv(PMEMtid tids[])
 void
 pmemobj_txop_onabort_alloc(struct tx *txp, union txop_args args)
 {
-	pfree(&(txp->pool->allocator), args.alloc.addr);
+	pfree(txp->pool->heap, args.alloc.addr, &txp->flushset);
 }
 
 void
@@ -863,13 +1398,22 @@ void
 pmemobj_txop_onabort_set(struct tx *txp, union txop_args args)
 {
 	uint64_t base = (uint64_t)txp->pool->addr;
-	memcpy(args.set.addr, (void *)(base + args.set.data), args.set.len);
+	libpmem_flushset_memcpy(&txp->flushset, args.set.addr,
+			(void *)(base + args.set.data), args.set.len);
+}
+
+void
+pmemobj_txop_onabort_extend(struct tx *txp, union txop_args args)
+{
+	pshrink(txp->pool->heap, args.extend.addr, args.extend.size,
+			&txp->flushset);
 }
 
 pmemobj_txop_onaction_t onabort_funcs[] = {
 	pmemobj_txop_onabort_alloc,
 	pmemobj_txop_onabort_free,
-	pmemobj_txop_onabort_set
+	pmemobj_txop_onabort_set,
+	pmemobj_txop_onabort_extend
 };
 
 /*
@@ -927,6 +1471,16 @@ pmemobj_log_prepare_set(void *addr, uint64_t data, size_t len)
 	return txop;
 }
 
+static struct txop *
+pmemobj_log_prepare_extend(uint64_t addr, size_t size)
+{
+	struct txop *txop = zalloc(sizeof (struct txop));
+	txop->args.extend.addr = addr;
+	txop->args.extend.size = size;
+	txop->op = TXOP_EXTEND;
+	return txop;
+}
+
 static void
 pmemobj_log_add(PMEMtid tid, struct txop *txop)
 {
@@ -967,6 +1521,15 @@ pmemobj_log_add_set(PMEMtid tid, void *addr, uint64_t data, size_t len)
 	}
 }
 
+static void
+pmemobj_log_add_extend(PMEMtid tid, uint64_t addr, size_t size)
+{
+	struct txop *txop = pmemobj_log_prepare_extend(addr, size);
+	if (txop) {
+		pmemobj_log_add(tid, txop);
+	}
+}
+
 /*
  * pmemobj_alloc -- transactional allocate, implicit tid
  */
@@ -1025,14 +1588,96 @@ pmemobj_free(PMEMoid oid)
 /*
  * pmemobj_size -- return the current size of an object
  *
- * No lock or transaction is required for this call, but of course
- * if the object is not protected by some sort of locking, another
- * thread may change the size before the caller uses the return value.
+ * That's the size the object can be used up to, which can be more than
+ * was asked for when it was allocated.  No lock or transaction is
+ * required for this call, but of course if the object is not protected
+ * by some sort of locking, another thread may change the size before the
+ * caller uses the return value.
  */
 size_t
 pmemobj_size(PMEMoid oid)
 {
-	return 0;
+	if (oid.off == 0)
+		return 0;
+
+	/* the pool, and with it the allocator, is mapped at oid.pool */
+	PMEMobjpool *pop = (PMEMobjpool *)oid.pool;
+
+	return psize(pop->heap, oid.off);
+}
+
+/*
+ * pmemobj_heap_stats -- return statistics of the pool's heap
+ */
+void
+pmemobj_heap_stats(PMEMobjpool *pop, struct pmemobj_heap_stats *statsp)
+{
+	LOG(3, "pop %p", pop);
+
+	allocator_stats(pop->heap, statsp);
+}
+
+/*
+ * pmemobj_class_stats -- return statistics of a size class
+ *
+ * Classes are numbered from 0 to nclasses - 1, see pmemobj_heap_stats().
+ */
+int
+pmemobj_class_stats(PMEMobjpool *pop, unsigned c,
+		struct pmemobj_class_stats *statsp)
+{
+	LOG(3, "pop %p class %u", pop, c);
+
+	return allocator_class_stats(pop->heap, c, statsp);
+}
+
+/*
+ * pmemobj_tcache_flush -- give the objects cached by the thread back
+ *
+ * Returns -1 with errno set if the free lists they went back on
+ * couldn't be made persistent.
+ */
+int
+pmemobj_tcache_flush(PMEMobjpool *pop)
+{
+	LOG(3, "pop %p", pop);
+
+	PMEMflushset fs;
+
+	libpmem_flushset_init(&fs, pop->is_pmem, pop->dirty);
+	allocator_tcache_flush(pop->heap, &fs);
+
+	return pmem_flushset_drain(&fs);
+}
+
+/*
+ * pmemobj_tcache_limit -- set the objects of a size each thread caches
+ *
+ * Zero turns caching off.  Returns -1 with errno set if the objects
+ * trimmed from the thread's cache couldn't be made persistently free.
+ */
+int
+pmemobj_tcache_limit(PMEMobjpool *pop, unsigned max)
+{
+	LOG(3, "pop %p max %u", pop, max);
+
+	PMEMflushset fs;
+
+	libpmem_flushset_init(&fs, pop->is_pmem, pop->dirty);
+	allocator_tcache_limit(pop->heap, max, &fs);
+
+	return pmem_flushset_drain(&fs);
+}
+
+/*
+ * pmemobj_tcache_stats -- return the counters of the pool's thread caches
+ */
+void
+pmemobj_tcache_stats(PMEMobjpool *pop, struct pmemobj_tcache_stats *statsp)
+{
+	LOG(3, "pop %p", pop);
+
+	allocator_tcache_stats(pop->heap, statsp);
 }
 
 /*
@@ -1047,7 +1692,7 @@ pmemobj_alloc_tid(PMEMtid tid, size_t size)
 
 	n.pool = (uint64_t)tx->pool->addr;
 	pmemobj_log_add_alloc(tid, &ptrp);
-	pmalloc(&(tx->pool->allocator), ptrp, size);
+	pmalloc(tx->pool->heap, ptrp, size, &tx->flushset);
 	n.off = *ptrp;
 	return n;
 }
@@ -1064,9 +1709,11 @@ pmemobj_zalloc_tid(PMEMtid tid, size_t size)
 
 	n.pool = (uint64_t)tx->pool->addr;
 	pmemobj_log_add_alloc(tid, &ptrp);
-	pmalloc(&(tx->pool->allocator), ptrp, size);
+	if (pmalloc(tx->pool->heap, ptrp, size, &tx->flushset) < 0)
+		return n;
 	n.off = *ptrp;
 	memset((void *)(n.pool + n.off), 0, size);
+	pmem_flushset_add(&tx->flushset, (void *)(n.pool + n.off), size);
 	return n;
 }
 
@@ -1076,8 +1723,38 @@ pmemobj_zalloc_tid(PMEMtid tid, size_t size)
 PMEMoid
 pmemobj_realloc_tid(PMEMtid tid, PMEMoid oid, size_t size)
 {
+	struct tx *tx = (struct tx *)tid;
 	PMEMoid n = { 0 };
 
+	if (oid.off == 0)
+		return pmemobj_alloc_tid(tid, size);
+
+	if (size == 0) {
+		pmemobj_free_tid(tid, oid);
+		return n;
+	}
+
+	/*
+	 * Grown in place, only the old size is logged, an abort cuts the
+	 * object back to it.  The data it had is never touched.
+	 */
+	size_t len = pmemobj_size(oid);
+	if (pextend(tx->pool->heap, oid.off, size,
+			&tx->flushset) == 0) {
+		if (pmemobj_size(oid) > len)
+			pmemobj_log_add_extend(tid, oid.off, len);
+		return oid;
+	}
+
+	n = pmemobj_alloc_tid(tid, size);
+	if (n.off == 0)
+		return n;
+
+	/* the old object stays as it is until commit, no undo data needed */
+	libpmem_flushset_memcpy(&tx->flushset, pmemobj_direct(n),
+			pmemobj_direct(oid), len < size ? len : size);
+	pmemobj_free_tid(tid, oid);
+
 	return n;
 }
 
@@ -1087,8 +1764,16 @@ pmemobj_realloc_tid(PMEMtid tid, PMEMoid oid, size_t size)
 PMEMoid
 pmemobj_aligned_alloc_tid(PMEMtid tid, size_t alignment, size_t size)
 {
+	struct tx *tx = (struct tx *)tid;
 	PMEMoid n = { 0 };
+	uint64_t *ptrp;
 
+	n.pool = (uint64_t)tx->pool->addr;
+	pmemobj_log_add_alloc(tid, &ptrp);
+	if (pmalloc_aligned(tx->pool->heap, ptrp, alignment, size,
+			&tx->flushset) < 0)
+		return n;	/* pmalloc_aligned() set errno */
+	n.off = *ptrp;
 	return n;
 }
 
@@ -1105,9 +1790,11 @@ pmemobj_strdup_tid(PMEMtid tid, const char *s)
 
 	n.pool = (uint64_t)tx->pool->addr;
 	pmemobj_log_add_alloc(tid, &ptrp);
-	pmalloc(&(tx->pool->allocator), ptrp, size);
+	if (pmalloc(tx->pool->heap, ptrp, size, &tx->flushset) < 0)
+		return n;
 	n.off = *ptrp;
 	strncpy((char *)(n.pool + n.off), s, size);
+	pmem_flushset_add(&tx->flushset, (void *)(n.pool + n.off), size);
 	return n;
 }
 
@@ -1173,10 +1860,15 @@ pmemobj_memcpy_tid(PMEMtid tid, void *dstp, void *srcp, size_t size)
 	uint64_t base, *oldp;
 
 	pmemobj_log_add_alloc(tid, &oldp);
-	pmalloc(&(tx->pool->allocator), oldp, size);
+	if (pmalloc(tx->pool->heap, oldp, size, &tx->flushset) < 0)
+		return tx_error(0, ENOMEM);
 
+	/* the snapshot must be persistent before dstp is changed */
 	base = (uint64_t)tx->pool->addr;
-	memcpy((void *)(base + *oldp), dstp, size);
+	libpmem_flushset_memcpy(&tx->flushset, (void *)(base + *oldp),
+			dstp, size);
+	if (pmem_flushset_drain(&tx->flushset) < 0)
+		return tx_error(0, errno);
 	pmemobj_log_add_set(tid, dstp, *oldp, size);
 	memcpy(dstp, srcp, size);
 	return 0;
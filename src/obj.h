@@ -36,7 +36,7 @@
 
 /* attributes of the obj memory pool format for the pool header */
 #define	OBJ_HDR_SIG "OBJPOOL"	/* must be 8 bytes including '\0' */
-#define	OBJ_FORMAT_MAJOR 1
+#define	OBJ_FORMAT_MAJOR 2	/* 2: allocator state kept in the pool */
 #define	OBJ_FORMAT_COMPAT 0x0000
 #define	OBJ_FORMAT_INCOMPAT 0x0000
 #define	OBJ_FORMAT_RO_COMPAT 0x0000
@@ -49,21 +49,17 @@ struct pmemobjpool {
 	/* some run-time state, allocated out of memory pool... */
 	void *addr;		/* mapped region */
 	size_t size;		/* size of mapped region */
+	int is_pmem;		/* true if pool is PMEM */
+	struct pmem_dirty *dirty;	/* dirty pages, if not pmem */
+	int home_node;		/* NUMA node backing the pool */
+	struct allocator *heap;	/* run-time state of the allocator */
 
 	/* for the fake implementation... */
 	PMEMmutex rootlock;
 	PMEMoid root;
 
-	struct allocator_hdr allocator;
+	struct allocator_hdr heap_hdr;	/* the allocator's state */
 };
 
-/* alignment of every object */
-#define	PMEMOID_INTERNAL_ALIGN 256
-
-/* info kept by the library for each allocated object */
-struct objheader {
-	uint64_t size;		/* requested object size */
-	uint64_t actual_size;	/* actual object size */
-	uint64_t flags;
-	uint64_t unused[5];
-};
+/* alignment every object gets, pmemobj_aligned_alloc() for more */
+#define	PMEMOID_INTERNAL_ALIGN 8
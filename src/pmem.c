@@ -41,13 +41,21 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <immintrin.h>
 
 #include "libpmem.h"
 #include "pmem.h"
 #include "util.h"
 #include "out.h"
+#include "cpu.h"
 
-#define	FLUSH_ALIGN 64
+/*
+ * Copies shorter than this are done with a regular memmove() followed
+ * by a flush -- the non-temporal setup cost isn't worth it for them.
+ */
+#define	MOVNT_THRESHOLD 256
 
 #define	PROCMAXLEN 2048 /* maximum expected line length in /proc files */
 
@@ -65,6 +73,111 @@ pmem_set_persist_func(void (*persist_func)(void *addr, size_t len, int flags))
 	Persist = (persist_func == NULL) ? pmem_persist : persist_func;
 }
 
+/*
+ * pmem emulation, for benchmarking on machines without pmem
+ *
+ * When enabled by the PMEM_EMUL_* environment variables (see pmem_init()),
+ * every cache line written back by pmem_flush() or streamed by the
+ * non-temporal copy routines is counted, and the next pmem_drain() by
+ * the same thread spins for the configured write latency of those lines
+ * plus the cost of the fence.  The optional bandwidth cap is shared by
+ * all threads: each drain books time on a global timeline and waits
+ * until its lines would have been written at that rate.
+ *
+ * Ranges made persistent without pmem_flush(), by msync() on pools that
+ * aren't pmem or by a persist function the application supplied, are
+ * charged the same way through libpmem_emul_write() and
+ * libpmem_emul_drain(), on top of what the write-back itself costs.
+ */
+static struct {
+	int enabled;
+	uint64_t line_ns;	/* write latency per cache line */
+	uint64_t fence_ns;	/* cost of each drain */
+	uint64_t bw_mbs;	/* write bandwidth in MB/s, 0 for no cap */
+	uint64_t busy_until;	/* bandwidth booked until this time, in ns */
+} Emul;
+
+static __thread uint64_t Emul_lines;	/* written since the last drain */
+
+/*
+ * emul_now -- (internal) monotonic time in nanoseconds
+ */
+static uint64_t
+emul_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * emul_write -- (internal) account for a range written to emulated pmem
+ */
+static inline void
+emul_write(const void *addr, size_t len)
+{
+	if (!Emul.enabled || len == 0)
+		return;
+
+	uintptr_t start = (uintptr_t)addr & ~(FLUSH_ALIGN - 1);
+	uintptr_t end = (uintptr_t)addr + len;
+
+	Emul_lines += (end - start + FLUSH_ALIGN - 1) / FLUSH_ALIGN;
+}
+
+/*
+ * emul_drain -- (internal) wait as long as a drain on pmem would take
+ */
+static void
+emul_drain(void)
+{
+	uint64_t lines = Emul_lines;
+	uint64_t now = emul_now();
+	uint64_t until = now + Emul.fence_ns + lines * Emul.line_ns;
+
+	Emul_lines = 0;
+
+	if (Emul.bw_mbs && lines) {
+		/* bytes / (MB/s) is microseconds, times 1000 for ns */
+		uint64_t dur = lines * FLUSH_ALIGN * 1000 / Emul.bw_mbs;
+		uint64_t busy = __atomic_load_n(&Emul.busy_until,
+				__ATOMIC_RELAXED);
+		uint64_t end;
+
+		do {
+			end = (busy > now ? busy : now) + dur;
+		} while (!__atomic_compare_exchange_n(&Emul.busy_until,
+				&busy, end, 0, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED));
+
+		if (end > until)
+			until = end;
+	}
+
+	while (emul_now() < until)
+		_mm_pause();
+}
+
+/*
+ * libpmem_emul_write -- charge a range written back without pmem_flush()
+ */
+void
+libpmem_emul_write(const void *addr, size_t len)
+{
+	emul_write(addr, len);
+}
+
+/*
+ * libpmem_emul_drain -- charge a drain done without pmem_drain()
+ */
+void
+libpmem_emul_drain(void)
+{
+	if (Emul.enabled)
+		emul_drain();
+}
+
 /*
  * pmem_drain -- wait for any PM stores to drain from HW buffers
  */
@@ -76,6 +189,9 @@ pmem_drain(void)
 	 *
 	 * XXX handle drain for other platforms
 	 */
+
+	if (Emul.enabled)
+		emul_drain();
 }
 
 /*
@@ -117,16 +233,45 @@ flush_clflushopt(void *addr, size_t len, int flags)
 		 * so insert the clflushopt instruction by adding the 0x66
 		 * prefix byte to clflush.
 		 */
-		__asm__ volatile(".byte 0x66; clflush %P0" : "+m" (uptr));
+		__asm__ volatile(".byte 0x66; clflush %0"
+				: "+m" (*(volatile char *)uptr));
+	}
+}
+
+/*
+ * flush_clwb -- (internal) flush the CPU cache, using clwb
+ *
+ * Unlike clflush and clflushopt, clwb may leave the written-back line
+ * in the cache, so metadata that was just persisted stays cheap to read.
+ */
+static void
+flush_clwb(void *addr, size_t len, int flags)
+{
+	uintptr_t uptr;
+
+	/*
+	 * Loop through cache-line-size (typically 64B) aligned chunks
+	 * covering the given range.
+	 */
+	__builtin_ia32_sfence();
+	for (uptr = (uintptr_t)addr & ~(FLUSH_ALIGN - 1);
+		uptr < (uintptr_t)addr + len; uptr += FLUSH_ALIGN) {
+		/*
+		 * __builtin_ia32_clwb((char *)uptr);
+		 *
+		 * ...same story as clflushopt above, clwb is xsaveopt
+		 * with the 0x66 prefix byte.
+		 */
+		__asm__ volatile(".byte 0x66; xsaveopt %0"
+				: "+m" (*(volatile char *)uptr));
 	}
 }
 
 /*
  * pmem_flush() calls through Func_flush to do the work.  Although
- * initialized to flush_clflush(), once the existence of the clflushopt
- * feature is confirmed by pmem_init() at library initialization time,
- * Func_flush is set to flush_clflushopt().  That's the most common case
- * on modern hardware that supports persistent memory.
+ * initialized to flush_clflush(), pmem_init() switches it at library
+ * initialization time to flush_clwb() or flush_clflushopt(), whichever
+ * is the best the CPU supports.
  */
 static void (*Func_flush)(void *, size_t, int) = flush_clflush;
 
@@ -137,6 +282,7 @@ void
 pmem_flush(void *addr, size_t len, int flags)
 {
 	(*Func_flush)(addr, len, flags);
+	emul_write(addr, len);
 }
 
 /*
@@ -159,6 +305,260 @@ pmem_persist(void *addr, size_t len, int flags)
 	pmem_drain();
 }
 
+/*
+ * movnt_sse2 -- (internal) copy whole cache lines using SSE2 streaming stores
+ *
+ * dest must be FLUSH_ALIGN aligned and len a multiple of FLUSH_ALIGN.
+ */
+__attribute__((target("sse2")))
+static void
+movnt_sse2(char *dest, const char *src, size_t len)
+{
+	__m128i *d = (__m128i *)dest;
+	const __m128i *s = (const __m128i *)src;
+
+	for (; len; len -= FLUSH_ALIGN, d += 4, s += 4) {
+		__m128i x0 = _mm_loadu_si128(s + 0);
+		__m128i x1 = _mm_loadu_si128(s + 1);
+		__m128i x2 = _mm_loadu_si128(s + 2);
+		__m128i x3 = _mm_loadu_si128(s + 3);
+		_mm_stream_si128(d + 0, x0);
+		_mm_stream_si128(d + 1, x1);
+		_mm_stream_si128(d + 2, x2);
+		_mm_stream_si128(d + 3, x3);
+	}
+}
+
+/*
+ * movnt_avx -- (internal) copy whole cache lines using AVX streaming stores
+ */
+__attribute__((target("avx")))
+static void
+movnt_avx(char *dest, const char *src, size_t len)
+{
+	__m256i *d = (__m256i *)dest;
+	const __m256i *s = (const __m256i *)src;
+
+	for (; len; len -= FLUSH_ALIGN, d += 2, s += 2) {
+		__m256i y0 = _mm256_loadu_si256(s + 0);
+		__m256i y1 = _mm256_loadu_si256(s + 1);
+		_mm256_stream_si256(d + 0, y0);
+		_mm256_stream_si256(d + 1, y1);
+	}
+}
+
+/*
+ * movnt_avx512f -- (internal) copy whole cache lines using AVX-512 stores
+ */
+__attribute__((target("avx512f")))
+static void
+movnt_avx512f(char *dest, const char *src, size_t len)
+{
+	__m512i *d = (__m512i *)dest;
+	const __m512i *s = (const __m512i *)src;
+
+	for (; len; len -= FLUSH_ALIGN, d++, s++)
+		_mm512_stream_si512(d, _mm512_loadu_si512(s));
+}
+
+/*
+ * setnt_sse2 -- (internal) fill whole cache lines using SSE2 streaming stores
+ */
+__attribute__((target("sse2")))
+static void
+setnt_sse2(char *dest, int c, size_t len)
+{
+	__m128i *d = (__m128i *)dest;
+	__m128i x = _mm_set1_epi8((char)c);
+
+	for (; len; len -= FLUSH_ALIGN, d += 4) {
+		_mm_stream_si128(d + 0, x);
+		_mm_stream_si128(d + 1, x);
+		_mm_stream_si128(d + 2, x);
+		_mm_stream_si128(d + 3, x);
+	}
+}
+
+/*
+ * setnt_avx -- (internal) fill whole cache lines using AVX streaming stores
+ */
+__attribute__((target("avx")))
+static void
+setnt_avx(char *dest, int c, size_t len)
+{
+	__m256i *d = (__m256i *)dest;
+	__m256i y = _mm256_set1_epi8((char)c);
+
+	for (; len; len -= FLUSH_ALIGN, d += 2) {
+		_mm256_stream_si256(d + 0, y);
+		_mm256_stream_si256(d + 1, y);
+	}
+}
+
+/*
+ * setnt_avx512f -- (internal) fill whole cache lines using AVX-512 stores
+ */
+__attribute__((target("avx512f")))
+static void
+setnt_avx512f(char *dest, int c, size_t len)
+{
+	__m512i *d = (__m512i *)dest;
+	__m512i z = _mm512_set1_epi8((char)c);
+
+	for (; len; len -= FLUSH_ALIGN, d++)
+		_mm512_stream_si512(d, z);
+}
+
+/*
+ * The cache line copy and fill loops used by the non-temporal routines
+ * below.  pmem_init() picks the widest variant the CPU supports.  They
+ * stay NULL if there are no streaming stores at all, in which case
+ * everything goes through the cache and gets flushed.
+ */
+static void (*Func_movnt)(char *, const char *, size_t);
+static void (*Func_setnt)(char *, int, size_t);
+
+/*
+ * pmem_memmove_nodrain -- memmove to pmem without hw drain
+ *
+ * The bulk of the range is written with non-temporal stores, so it
+ * bypasses the CPU cache and needs no flush afterwards.  The unaligned
+ * head and tail of the range, short ranges and overlapping ranges which
+ * must be copied backwards go through the cache and are flushed.
+ * The caller is expected to call pmem_drain() (or use
+ * pmem_memmove_persist()) before relying on the range being durable.
+ */
+void *
+pmem_memmove_nodrain(void *pmemdest, const void *src, size_t len)
+{
+	LOG(15, "pmemdest %p src %p len %zu", pmemdest, src, len);
+
+	char *dest1 = pmemdest;
+	const char *src1 = src;
+
+	if (len < MOVNT_THRESHOLD || Func_movnt == NULL ||
+			(uintptr_t)dest1 - (uintptr_t)src1 < len) {
+		/* short, or must be copied backwards */
+		memmove(pmemdest, src, len);
+		pmem_flush(pmemdest, len, 0);
+		return pmemdest;
+	}
+
+	/* copy up to the first cache line boundary the regular way */
+	size_t cnt = (uintptr_t)dest1 & (FLUSH_ALIGN - 1);
+	if (cnt) {
+		cnt = FLUSH_ALIGN - cnt;
+		memmove(dest1, src1, cnt);
+		pmem_flush(dest1, cnt, 0);
+		dest1 += cnt;
+		src1 += cnt;
+		len -= cnt;
+	}
+
+	/* stream all the whole cache lines */
+	cnt = len & ~(FLUSH_ALIGN - 1);
+	(*Func_movnt)(dest1, src1, cnt);
+	emul_write(dest1, cnt);
+	dest1 += cnt;
+	src1 += cnt;
+	len -= cnt;
+
+	/* and the leftover tail */
+	if (len) {
+		memmove(dest1, src1, len);
+		pmem_flush(dest1, len, 0);
+	}
+
+	return pmemdest;
+}
+
+/*
+ * pmem_memcpy_nodrain -- memcpy to pmem without hw drain
+ */
+void *
+pmem_memcpy_nodrain(void *pmemdest, const void *src, size_t len)
+{
+	return pmem_memmove_nodrain(pmemdest, src, len);
+}
+
+/*
+ * pmem_memset_nodrain -- memset to pmem without hw drain
+ */
+void *
+pmem_memset_nodrain(void *pmemdest, int c, size_t len)
+{
+	LOG(15, "pmemdest %p c 0x%x len %zu", pmemdest, c, len);
+
+	char *dest1 = pmemdest;
+
+	if (len < MOVNT_THRESHOLD || Func_setnt == NULL) {
+		memset(pmemdest, c, len);
+		pmem_flush(pmemdest, len, 0);
+		return pmemdest;
+	}
+
+	size_t cnt = (uintptr_t)dest1 & (FLUSH_ALIGN - 1);
+	if (cnt) {
+		cnt = FLUSH_ALIGN - cnt;
+		memset(dest1, c, cnt);
+		pmem_flush(dest1, cnt, 0);
+		dest1 += cnt;
+		len -= cnt;
+	}
+
+	cnt = len & ~(FLUSH_ALIGN - 1);
+	(*Func_setnt)(dest1, c, cnt);
+	emul_write(dest1, cnt);
+	dest1 += cnt;
+	len -= cnt;
+
+	if (len) {
+		memset(dest1, c, len);
+		pmem_flush(dest1, len, 0);
+	}
+
+	return pmemdest;
+}
+
+/*
+ * pmem_memmove_persist -- memmove to pmem, then make it durable
+ *
+ * A single fence at the end orders both the streaming stores and
+ * any flushes issued for the unaligned parts of the range.
+ */
+void *
+pmem_memmove_persist(void *pmemdest, const void *src, size_t len)
+{
+	pmem_memmove_nodrain(pmemdest, src, len);
+	__builtin_ia32_sfence();
+	pmem_drain();
+	return pmemdest;
+}
+
+/*
+ * pmem_memcpy_persist -- memcpy to pmem, then make it durable
+ */
+void *
+pmem_memcpy_persist(void *pmemdest, const void *src, size_t len)
+{
+	pmem_memcpy_nodrain(pmemdest, src, len);
+	__builtin_ia32_sfence();
+	pmem_drain();
+	return pmemdest;
+}
+
+/*
+ * pmem_memset_persist -- memset to pmem, then make it durable
+ */
+void *
+pmem_memset_persist(void *pmemdest, int c, size_t len)
+{
+	pmem_memset_nodrain(pmemdest, c, len);
+	__builtin_ia32_sfence();
+	pmem_drain();
+	return pmemdest;
+}
+
 /*
  * is_pmem_always -- (internal) always true version of pmem_is_pmem()
  */
@@ -273,11 +673,31 @@ is_pmem_proc(void *addr, size_t len)
 	return retval;
 }
 
+/*
+ * is_pmem_cached -- (internal) use the mapping registry for pmem_is_pmem()
+ *
+ * For ranges mapped by libpmem the answer comes from the registry kept
+ * by util_map(), which knows whether it got a MAP_SYNC mapping.  Ranges
+ * libpmem knows nothing about are still looked up in /proc every time,
+ * unless the application registered them using pmem_is_pmem_refresh().
+ */
+static int
+is_pmem_cached(void *addr, size_t len)
+{
+	int retval = util_range_is_pmem(addr, len, is_pmem_proc);
+
+	if (retval < 0)
+		retval = is_pmem_proc(addr, len);
+
+	LOG(3, "returning %d", retval);
+	return retval;
+}
+
 /*
  * pmem_is_pmem() calls through Func_is_pmem to do the work.  Although
  * initialized to is_pmem_never(), once the existence of the clflush
  * feature is confirmed by pmem_init() at library initialization time,
- * Func_is_pmem is set to is_pmem_proc().  That's the most common case
+ * Func_is_pmem is set to is_pmem_cached().  That's the most common case
  * on modern hardware.
  */
 static int (*Func_is_pmem)(void *addr, size_t len) = is_pmem_never;
@@ -296,41 +716,32 @@ pmem_init(void)
 	util_init();
 
 	/* detect supported cache flush features */
-	FILE *fp;
-	if ((fp = fopen("/proc/cpuinfo", "r")) == NULL) {
-		LOG(1, "!/proc/cpuinfo");
-	} else {
-		char line[PROCMAXLEN];	/* for fgets() */
-
-		while (fgets(line, PROCMAXLEN, fp) != NULL) {
-			static const char flags[] = "flags\t\t: ";
-			static const char clflush[] = " clflush ";
-			static const char clflushopt[] = " clflushopt ";
-
-			if (strncmp(flags, line, sizeof (flags) - 1) == 0) {
-
-				/* change ending newline to space delimiter */
-				char *nl = strrchr(line, '\n');
-				if (nl)
-					*nl = ' ';
-
-				if (strstr(&line[sizeof (flags) - 1],
-							clflush) != NULL) {
-					Func_is_pmem = is_pmem_proc;
-					LOG(3, "clflush supported");
-				}
-
-				if (strstr(&line[sizeof (flags) - 1],
-							clflushopt) != NULL) {
-					Func_flush = flush_clflushopt;
-					LOG(3, "clflushopt supported");
-				}
+	if (is_cpu_clflush_present()) {
+		Func_is_pmem = is_pmem_cached;
+		LOG(3, "clflush supported");
+	}
 
-				break;
-			}
-		}
+	if (is_cpu_clwb_present()) {
+		Func_flush = flush_clwb;
+		LOG(3, "clwb supported");
+	} else if (is_cpu_clflushopt_present()) {
+		Func_flush = flush_clflushopt;
+		LOG(3, "clflushopt supported");
+	}
 
-		fclose(fp);
+	/* pick the widest streaming stores available */
+	if (is_cpu_avx512f_present()) {
+		Func_movnt = movnt_avx512f;
+		Func_setnt = setnt_avx512f;
+		LOG(3, "using avx512f for non-temporal stores");
+	} else if (is_cpu_avx_present()) {
+		Func_movnt = movnt_avx;
+		Func_setnt = setnt_avx;
+		LOG(3, "using avx for non-temporal stores");
+	} else if (is_cpu_sse2_present()) {
+		Func_movnt = movnt_sse2;
+		Func_setnt = setnt_sse2;
+		LOG(3, "using sse2 for non-temporal stores");
 	}
 
 	/*
@@ -352,6 +763,27 @@ pmem_init(void)
 		else if (val == 1)
 			Func_is_pmem = is_pmem_always;
 	}
+
+	/*
+	 * Emulate pmem write costs, for benchmarking on machines without
+	 * pmem.  PMEM_EMUL_LINE_NS is the latency of writing one cache
+	 * line, PMEM_EMUL_FENCE_NS the cost of each drain and PMEM_EMUL_BW
+	 * caps the write bandwidth, in MB/s.
+	 */
+	if ((ptr = getenv("PMEM_EMUL_LINE_NS")) != NULL)
+		Emul.line_ns = strtoull(ptr, NULL, 0);
+	if ((ptr = getenv("PMEM_EMUL_FENCE_NS")) != NULL)
+		Emul.fence_ns = strtoull(ptr, NULL, 0);
+	if ((ptr = getenv("PMEM_EMUL_BW")) != NULL)
+		Emul.bw_mbs = strtoull(ptr, NULL, 0);
+
+	if (Emul.line_ns || Emul.fence_ns || Emul.bw_mbs) {
+		Emul.enabled = 1;
+		LOG(3, "emulating pmem: line %ju ns fence %ju ns bw %ju MB/s",
+				(uintmax_t)Emul.line_ns,
+				(uintmax_t)Emul.fence_ns,
+				(uintmax_t)Emul.bw_mbs);
+	}
 }
 
 /*
@@ -365,6 +797,34 @@ pmem_is_pmem(void *addr, size_t len)
 	return (*Func_is_pmem)(addr, len);
 }
 
+/*
+ * pmem_is_pmem_refresh -- look up a range again and remember the answer
+ *
+ * This is for ranges mapped without libpmem's help, and for ranges
+ * whose mapping changed behind libpmem's back.  Later pmem_is_pmem()
+ * calls for the range use the cached result.  Ranges still mapped
+ * by libpmem keep the status they got from their mmap() flags.
+ */
+int
+pmem_is_pmem_refresh(void *addr, size_t len)
+{
+	LOG(3, "addr %p len %zu", addr, len);
+
+	if (Func_is_pmem != is_pmem_cached)
+		return (*Func_is_pmem)(addr, len);
+
+	/* the mmap() flags are more reliable than anything in /proc */
+	int retval = util_range_is_pmem_sync(addr, len);
+	if (retval >= 0)
+		return retval;
+
+	retval = is_pmem_proc(addr, len);
+
+	util_range_register(addr, len, retval);
+
+	return retval;
+}
+
 /*
  * pmem_map -- map the entire file for read/write access
  */
@@ -386,3 +846,50 @@ pmem_map(int fd)
 	LOG(3, "returning %p", addr);
 	return addr;
 }
+
+/*
+ * pmem_advise -- give the kernel a hint about how a range will be used
+ *
+ * The range is widened to whole pages.  Returns 0 on success or -1
+ * with errno set.
+ */
+int
+pmem_advise(void *addr, size_t len, int advice)
+{
+	LOG(3, "addr %p len %zu advice %d", addr, len, advice);
+
+	int madv;
+
+	switch (advice) {
+	case PMEM_ADV_NORMAL:
+		madv = MADV_NORMAL;
+		break;
+	case PMEM_ADV_SEQUENTIAL:
+		madv = MADV_SEQUENTIAL;
+		break;
+	case PMEM_ADV_RANDOM:
+		madv = MADV_RANDOM;
+		break;
+	case PMEM_ADV_WILLNEED:
+		madv = MADV_WILLNEED;
+		break;
+	case PMEM_ADV_DONTNEED:
+		madv = MADV_DONTNEED;
+		break;
+	default:
+		LOG(1, "invalid advice %d", advice);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* madvise requires addr to be a multiple of pagesize */
+	len += (uintptr_t)addr & (Pagesize - 1);
+	addr = (void *)((uintptr_t)addr & ~(Pagesize - 1));
+
+	if (madvise(addr, len, madv) < 0) {
+		LOG(1, "!madvise");
+		return -1;
+	}
+
+	return 0;
+}
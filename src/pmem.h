@@ -40,6 +40,8 @@
 
 extern unsigned long Pagesize;
 
+#define	FLUSH_ALIGN 64
+
 typedef void (*Persist_func)(void *addr, size_t len, int flags);
 
 Persist_func Persist;
@@ -47,4 +49,46 @@ Persist_func Persist;
 void pmem_set_persist_func(void (*persist_func)(void *addr,
 			size_t len, int flags));
 
-void libpmem_persist(int is_pmem, void *addr, size_t len);
+int libpmem_persist(int is_pmem, void *addr, size_t len);
+void libpmem_memcpy_persist(int is_pmem, void *dest, const void *src,
+		size_t len);
+void libpmem_memcpy_nodrain(int is_pmem, void *dest, const void *src,
+		size_t len);
+void libpmem_drain(int is_pmem, void *addr, size_t len);
+int libpmem_msync(void *addr, size_t len);
+int libpmem_async_running(void);
+void libpmem_emul_write(const void *addr, size_t len);
+void libpmem_emul_drain(void);
+
+extern struct pmem_persist_stats Persist_stats;
+
+struct pmem_dirty;
+struct pmem_dirty *libpmem_dirty_new(void *addr, size_t len);
+void libpmem_dirty_delete(struct pmem_dirty *dp);
+int libpmem_dirty_mark(struct pmem_dirty *dp, void *addr, size_t len);
+uint64_t libpmem_dirty_errseq(struct pmem_dirty *dp);
+int libpmem_dirty_sync(struct pmem_dirty *dp, uint64_t *errseqp);
+
+/*
+ * The flush set behind PMEMflushset.  Inside the library it's small
+ * enough to live on the stack, or in a lane or transaction, set up by
+ * libpmem_flushset_init() instead of allocated.
+ */
+#define	PMEM_FLUSHSET_MAX 32
+struct pmemflushset {
+	int is_pmem;
+	int pending;		/* fence or page write-back still needed */
+	int error;		/* first write-back failure since the drain */
+	struct pmem_dirty *dirty;	/* page tracker of the pool, if any */
+	uint64_t errseq;	/* tracker failures already reported */
+	unsigned nranges;
+	struct {
+		uintptr_t base;
+		uintptr_t end;
+	} ranges[PMEM_FLUSHSET_MAX];
+};
+
+void libpmem_flushset_init(PMEMflushset *fsp, int is_pmem,
+		struct pmem_dirty *dp);
+void libpmem_flushset_memcpy(PMEMflushset *fsp, void *dest, const void *src,
+		size_t len);
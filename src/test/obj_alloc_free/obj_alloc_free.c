@@ -0,0 +1,880 @@
+/*
+ * Copyright (c) 2015, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * obj_alloc_free.c -- unit test for reuse of freed space
+ *
+ * Several times the size of the pool is allocated and freed again, in
+ * sizes of every kind, so the test only passes if freed blocks and
+ * lines get reused.
+ *
+ * usage: obj_alloc_free file
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+
+#define	POOL_SIZE (50 * 1024 * 1024)
+#define	NTHREADS 4
+#define	NOBJS 16
+#define	NKEPT 10	/* objects kept by unclean(), two of each size */
+#define	NROUNDS 20	/* rounds of threads started by short_lived() */
+
+static PMEMobjpool *Pop;
+
+/*
+ * alloc_free -- allocate and free objects of size bytes, total bytes worth
+ *
+ * The objects are allocated nobjs at a time.
+ */
+static void
+alloc_free(size_t size, size_t total, int nobjs)
+{
+	jmp_buf env;
+	PMEMoid oids[NOBJS];
+
+	ASSERT(nobjs <= NOBJS);
+
+	for (size_t done = 0; done < total; done += nobjs * size) {
+		pmemobj_tx_begin(Pop, env);
+		for (int i = 0; i < nobjs; i++) {
+			oids[i] = pmemobj_alloc(size);
+			ASSERT(!pmemobj_nulloid(oids[i]));
+			memset(pmemobj_direct(oids[i]), i, size);
+		}
+		pmemobj_tx_commit();
+
+		for (int i = 0; i < nobjs; i++)
+			ASSERTeq(*(char *)pmemobj_direct(oids[i]), i);
+
+		pmemobj_tx_begin(Pop, env);
+		for (int i = 0; i < nobjs; i++)
+			pmemobj_free(oids[i]);
+		pmemobj_tx_commit();
+	}
+}
+
+/*
+ * worker -- churn through small objects of a few sizes
+ */
+static void *
+worker(void *arg)
+{
+	size_t size = (size_t)arg;
+
+	alloc_free(size, POOL_SIZE / 2, NOBJS);
+	alloc_free(size * 3, POOL_SIZE / 2, NOBJS);
+
+	return NULL;
+}
+
+/*
+ * reuse -- check a freed small object is what the next allocation gets
+ */
+static void
+reuse(size_t size)
+{
+	jmp_buf env;
+
+	pmemobj_tx_begin(Pop, env);
+	PMEMoid oid = pmemobj_alloc(size);
+	pmemobj_tx_commit();
+
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(oid);
+	pmemobj_tx_commit();
+
+	pmemobj_tx_begin(Pop, env);
+	PMEMoid again = pmemobj_alloc(size);
+	pmemobj_tx_commit();
+
+	ASSERTeq(again.off, oid.off);
+
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(again);
+	pmemobj_tx_commit();
+}
+
+/*
+ * huge_coalesce -- check huge objects are packed and freed ones merge
+ *
+ * Huge objects aren't rounded up to whole lines, so neighbors are less
+ * than a line apart.  Once two neighbors are freed, an object of their
+ * size combined fits in their place.
+ */
+static void
+huge_coalesce(size_t size)
+{
+	jmp_buf env;
+	PMEMoid oids[3];
+
+	pmemobj_tx_begin(Pop, env);
+	for (int i = 0; i < 3; i++) {
+		oids[i] = pmemobj_alloc(size);
+		ASSERT(!pmemobj_nulloid(oids[i]));
+	}
+	pmemobj_tx_commit();
+
+	ASSERT(oids[1].off - oids[0].off < size + 1024 * 1024);
+
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(oids[0]);
+	pmemobj_free(oids[1]);
+	pmemobj_tx_commit();
+
+	pmemobj_tx_begin(Pop, env);
+	PMEMoid both = pmemobj_alloc(2 * size);
+	pmemobj_tx_commit();
+
+	ASSERTeq(both.off, oids[0].off);
+
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(both);
+	pmemobj_free(oids[2]);
+	pmemobj_tx_commit();
+}
+
+/*
+ * aligned -- check aligned objects are, between unaligned ones
+ */
+static void
+aligned(void)
+{
+	jmp_buf env;
+	size_t aligns[] = { 64, 256, 4096 };
+	PMEMoid oids[2 * NOBJS];
+
+	pmemobj_tx_begin(Pop, env);
+	for (int i = 0; i < NOBJS; i++) {
+		size_t align = aligns[i % 3];
+
+		oids[2 * i] = pmemobj_alloc(24);
+		oids[2 * i + 1] = pmemobj_aligned_alloc(align, 100 + i * 1000);
+		ASSERT(!pmemobj_nulloid(oids[2 * i + 1]));
+		ASSERTeq((uintptr_t)pmemobj_direct(oids[2 * i + 1]) % align, 0);
+	}
+
+	PMEMoid huge = pmemobj_aligned_alloc(4096, 5 * 1024 * 1024);
+	ASSERTeq((uintptr_t)pmemobj_direct(huge) % 4096, 0);
+
+	errno = 0;
+	ASSERT(pmemobj_nulloid(pmemobj_aligned_alloc(48, 64)));
+	ASSERTeq(errno, EINVAL);
+	pmemobj_tx_commit();
+
+	pmemobj_tx_begin(Pop, env);
+	for (int i = 0; i < 2 * NOBJS; i++)
+		pmemobj_free(oids[i]);
+	pmemobj_free(huge);
+	pmemobj_tx_commit();
+}
+
+/*
+ * aligned_full -- check aligned objects come from freed blocks once the
+ *	pool is full
+ */
+static void
+aligned_full(void)
+{
+	jmp_buf env;
+	int nhuge = 0;
+	int nsmall = 0;
+	PMEMoid huge[64];
+	PMEMoid small[4096];
+
+	/* leave no lines to carve aligned objects out of */
+	pmemobj_tx_begin(Pop, env);
+	while (nhuge < 64) {
+		huge[nhuge] = pmemobj_alloc(1024 * 1024);
+		if (pmemobj_nulloid(huge[nhuge]))
+			break;
+		nhuge++;
+	}
+	while (nsmall < 4096) {
+		small[nsmall] = pmemobj_aligned_alloc(4096, 2000);
+		if (pmemobj_nulloid(small[nsmall]))
+			break;
+		nsmall++;
+	}
+	pmemobj_tx_commit();
+
+	ASSERT(nhuge < 64);
+	ASSERT(nsmall > 2 && nsmall < 4096);
+
+	/* one block from the thread's cache, one from the free lists */
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(small[0]);
+	pmemobj_tx_commit();
+	ASSERTeq(pmemobj_tcache_flush(Pop), 0);
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(small[1]);
+	pmemobj_tx_commit();
+
+	pmemobj_tx_begin(Pop, env);
+	for (int i = 0; i < 2; i++) {
+		small[i] = pmemobj_aligned_alloc(4096, 2000);
+		ASSERT(!pmemobj_nulloid(small[i]));
+		ASSERTeq((uintptr_t)pmemobj_direct(small[i]) % 4096, 0);
+	}
+	ASSERT(pmemobj_nulloid(pmemobj_aligned_alloc(4096, 2000)));
+	ASSERTeq(errno, ENOMEM);
+	pmemobj_tx_commit();
+
+	pmemobj_tx_begin(Pop, env);
+	for (int i = 0; i < nsmall; i++)
+		pmemobj_free(small[i]);
+	for (int i = 0; i < nhuge; i++)
+		pmemobj_free(huge[i]);
+	pmemobj_tx_commit();
+}
+
+/*
+ * sizes -- check objects are at least as big as asked for
+ */
+static void
+sizes(void)
+{
+	jmp_buf env;
+	size_t sizes[] = { 1, 24, 100, 4000, 300 * 1024, 5 * 1024 * 1024 };
+	PMEMoid oids[6];
+
+	pmemobj_tx_begin(Pop, env);
+	for (int i = 0; i < 6; i++) {
+		oids[i] = pmemobj_alloc(sizes[i]);
+		ASSERT(pmemobj_size(oids[i]) >= sizes[i]);
+		ASSERT(pmemobj_size(oids[i]) < sizes[i] + sizes[i] / 4 + 4096);
+	}
+	for (int i = 0; i < 6; i++)
+		pmemobj_free(oids[i]);
+	pmemobj_tx_commit();
+
+	PMEMoid null = { 0, 0 };
+	ASSERTeq(pmemobj_size(null), 0);
+}
+
+/*
+ * stats -- check the heap statistics follow an allocation and its free
+ */
+static void
+stats(size_t size)
+{
+	jmp_buf env;
+	struct pmemobj_heap_stats before, after;
+	struct pmemobj_class_stats cs;
+
+	pmemobj_heap_stats(Pop, &before);
+	ASSERT(before.used + before.free <= before.heap_size);
+	ASSERT(before.largest_free <= before.free);
+	ASSERT(before.fragmentation >= 0 && before.fragmentation < 1);
+
+	pmemobj_tx_begin(Pop, env);
+	PMEMoid oid = pmemobj_alloc(size);
+	ASSERT(!pmemobj_nulloid(oid));
+	pmemobj_tx_commit();
+
+	pmemobj_heap_stats(Pop, &after);
+	ASSERTeq(after.huge_objects, before.huge_objects + 1);
+	ASSERT(after.used >= before.used + size);
+	ASSERT(after.free < before.free);
+
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(oid);
+	pmemobj_tx_commit();
+
+	pmemobj_heap_stats(Pop, &after);
+	ASSERTeq(after.huge_objects, before.huge_objects);
+	ASSERTeq(after.used, before.used);
+
+	for (unsigned c = 0; c < after.nclasses; c++)
+		ASSERTeq(pmemobj_class_stats(Pop, c, &cs), 0);
+	errno = 0;
+	ASSERTeq(pmemobj_class_stats(Pop, after.nclasses, &cs), -1);
+	ASSERTeq(errno, EINVAL);
+}
+
+/*
+ * tcache -- check a freed object is handed out again by the same thread
+ */
+static void
+tcache(size_t size)
+{
+	jmp_buf env;
+	struct pmemobj_tcache_stats before, after;
+
+	pmemobj_tcache_stats(Pop, &before);
+
+	pmemobj_tx_begin(Pop, env);
+	PMEMoid oid = pmemobj_alloc(size);
+	pmemobj_tx_commit();
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(oid);
+	pmemobj_tx_commit();
+	pmemobj_tx_begin(Pop, env);
+	PMEMoid again = pmemobj_alloc(size);
+	pmemobj_free(again);
+	pmemobj_tx_commit();
+
+	ASSERTeq(again.off, oid.off);
+	pmemobj_tcache_stats(Pop, &after);
+	ASSERTeq(after.hits, before.hits + 1);
+	ASSERT(after.cached > 0);
+
+	/* no other thread has allocated yet */
+	ASSERTeq(pmemobj_tcache_flush(Pop), 0);
+	pmemobj_tcache_stats(Pop, &after);
+	ASSERTeq(after.cached, 0);
+
+	/* with caching off, frees go straight to the heap */
+	ASSERTeq(pmemobj_tcache_limit(Pop, 0), 0);
+	pmemobj_tx_begin(Pop, env);
+	oid = pmemobj_alloc(size);
+	pmemobj_free(oid);
+	pmemobj_tx_commit();
+	pmemobj_tcache_stats(Pop, &after);
+	ASSERTeq(after.cached, 0);
+	ASSERTeq(pmemobj_tcache_limit(Pop, 64), 0);
+}
+
+/*
+ * short_lived_worker -- allocate and free a few objects, then exit
+ */
+static void *
+short_lived_worker(void *arg)
+{
+	size_t size = (size_t)arg;
+
+	alloc_free(size, NOBJS * size, NOBJS);
+
+	return NULL;
+}
+
+/*
+ * short_lived -- check what exited threads had cached is used again
+ *
+ * Each thread leaves the objects it freed in its cache, and has a line
+ * of its own to allocate from.  Once it has exited both must be back in
+ * the heap, so the threads started later, like the ones started before
+ * by main(), never need more lines.
+ */
+static void
+short_lived(size_t size)
+{
+	struct pmemobj_tcache_stats before, after;
+	struct pmemobj_heap_stats first, hs;
+	pthread_t threads[NTHREADS];
+
+	pmemobj_tcache_stats(Pop, &before);
+	pmemobj_heap_stats(Pop, &first);
+
+	for (int round = 0; round < NROUNDS; round++) {
+		for (int i = 0; i < NTHREADS; i++)
+			PTHREAD_CREATE(&threads[i], NULL, short_lived_worker,
+					(void *)size);
+		for (int i = 0; i < NTHREADS; i++)
+			PTHREAD_JOIN(threads[i], NULL);
+
+		pmemobj_tcache_stats(Pop, &after);
+		ASSERTeq(after.caches, before.caches);
+		ASSERTeq(after.cached, before.cached);
+		ASSERT(after.flushed > before.flushed);
+
+		pmemobj_heap_stats(Pop, &hs);
+		ASSERTeq(hs.lines_used, first.lines_used);
+		ASSERTeq(hs.used, first.used);
+	}
+}
+
+/*
+ * abort_alloc -- allocate in aborted transactions
+ */
+static void
+abort_alloc(size_t size, size_t total)
+{
+	jmp_buf env;
+
+	for (size_t done = 0; done < total; done += size) {
+		pmemobj_tx_begin(Pop, env);
+		ASSERT(!pmemobj_nulloid(pmemobj_alloc(size)));
+		pmemobj_tx_abort(0);
+	}
+}
+
+/*
+ * free_blocks -- count the free blocks of all classes, cached included
+ */
+static size_t
+free_blocks(void)
+{
+	struct pmemobj_heap_stats hs;
+	struct pmemobj_class_stats cs;
+	size_t n = 0;
+
+	pmemobj_heap_stats(Pop, &hs);
+	for (unsigned c = 0; c < hs.nclasses; c++) {
+		ASSERTeq(pmemobj_class_stats(Pop, c, &cs), 0);
+		n += cs.free;
+	}
+
+	return n;
+}
+
+/*
+ * unclean -- check a pool left open by a process that died can be used
+ *
+ * A child allocates and frees objects of every kind and exits without
+ * closing the pool, with some of the freed blocks in its thread cache.
+ * The objects it kept must still be there after the pool is opened
+ * again, the cached blocks must be back on the free lists, the freed
+ * space must be reused and new objects must not overlap kept ones.
+ */
+static void
+unclean(const char *path)
+{
+	size_t sizes[] = { 32, 200, 5000, 300 * 1024, 4 * 1024 * 1024 };
+	struct {
+		PMEMoid kept[NKEPT];
+		size_t lines_used;	/* after the frees */
+		size_t free_blocks;	/* on the free lists or cached */
+	} child;
+	PMEMoid *kept = child.kept;
+	struct pmemobj_heap_stats hs;
+	struct pmemobj_tcache_stats ts;
+	jmp_buf env;
+	int fds[2];
+
+	ASSERTeq(pipe(fds), 0);
+
+	pid_t pid = fork();
+	ASSERT(pid >= 0);
+
+	if (pid == 0) {
+		PMEMoid freed[NKEPT];
+
+		Pop = pmemobj_pool_open(path);
+		ASSERTne(Pop, NULL);
+
+		pmemobj_tx_begin(Pop, env);
+		for (int i = 0; i < NKEPT; i++) {
+			size_t size = sizes[i % 5];
+
+			kept[i] = pmemobj_alloc(size);
+			freed[i] = pmemobj_alloc(size);
+			ASSERT(!pmemobj_nulloid(kept[i]));
+			memset(pmemobj_direct(kept[i]), i, size);
+		}
+		pmemobj_tx_commit();
+
+		pmemobj_tx_begin(Pop, env);
+		for (int i = 0; i < NKEPT; i++)
+			pmemobj_free(freed[i]);
+		pmemobj_tx_commit();
+
+		/* the small blocks freed stay in this thread's cache */
+		pmemobj_tcache_stats(Pop, &ts);
+		ASSERT(ts.cached > 0);
+
+		pmemobj_heap_stats(Pop, &hs);
+		child.lines_used = hs.lines_used;
+		child.free_blocks = free_blocks();
+
+		ASSERTeq(write(fds[1], &child, sizeof (child)),
+				sizeof (child));
+		_exit(0);
+	}
+
+	int status;
+	ASSERTeq(waitpid(pid, &status, 0), pid);
+	ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	ASSERTeq(read(fds[0], &child, sizeof (child)), sizeof (child));
+	close(fds[0]);
+	close(fds[1]);
+
+	Pop = pmemobj_pool_open(path);
+	ASSERTne(Pop, NULL);
+
+	for (int i = 0; i < NKEPT; i++) {
+		unsigned char *p = pmemobj_direct(kept[i]);
+
+		for (size_t j = 0; j < sizes[i % 5]; j++)
+			ASSERTeq(p[j], (unsigned char)i);
+	}
+
+	/* what the dead thread had cached is on the free lists again */
+	pmemobj_tcache_stats(Pop, &ts);
+	ASSERTeq(ts.cached, 0);
+	ASSERTeq(free_blocks(), child.free_blocks);
+
+	/* the freed space is found again, nothing new is taken */
+	PMEMoid again[NKEPT];
+	pmemobj_tx_begin(Pop, env);
+	for (int i = 0; i < NKEPT; i++) {
+		again[i] = pmemobj_alloc(sizes[i % 5]);
+		ASSERT(!pmemobj_nulloid(again[i]));
+	}
+	pmemobj_tx_commit();
+
+	pmemobj_heap_stats(Pop, &hs);
+	ASSERTeq(hs.lines_used, child.lines_used);
+
+	pmemobj_tx_begin(Pop, env);
+	for (int i = 0; i < NKEPT; i++)
+		pmemobj_free(again[i]);
+	pmemobj_tx_commit();
+
+	/* new objects fill the heap up, none may overlap a kept one */
+	PMEMoid oid;
+
+	pmemobj_tx_begin(Pop, env);
+	while (!pmemobj_nulloid(oid = pmemobj_alloc(4000)))
+		memset(pmemobj_direct(oid), 0xff, 4000);
+	pmemobj_tx_abort(0);
+
+	for (int i = 0; i < NKEPT; i++) {
+		unsigned char *p = pmemobj_direct(kept[i]);
+
+		for (size_t j = 0; j < sizes[i % 5]; j++)
+			ASSERTeq(p[j], (unsigned char)i);
+	}
+
+	pmemobj_tx_begin(Pop, env);
+	for (int i = 0; i < NKEPT; i++)
+		pmemobj_free(kept[i]);
+	pmemobj_tx_commit();
+
+	pmemobj_pool_close(Pop);
+}
+
+/*
+ * What compact() builds from the root: a list of nodes, each with a blob
+ * of data, plus a huge blob and an aligned one.  Every object starts with
+ * its type so the visitor knows where its PMEMoids are.
+ */
+#define	NNODES 200
+#define	BLOB_SIZE 5000
+#define	HUGE_SIZE (5 * 1024 * 1024)
+#define	ALIGNMENT 4096
+
+enum ctype { C_ROOT = 1, C_NODE, C_BLOB, C_ALIGNED };
+
+struct croot {
+	uint64_t type;
+	PMEMoid head;
+	PMEMoid huge;
+	PMEMoid aligned;
+};
+
+struct cnode {
+	uint64_t type;
+	uint64_t val;
+	PMEMoid next;
+	PMEMoid blob;
+};
+
+/*
+ * cvisit -- report the PMEMoids in an object of compact()'s structure
+ */
+static size_t
+cvisit(void *arg, PMEMoid oid, struct pmemobj_visit *vp)
+{
+	uint64_t *type = pmemobj_direct(oid);
+
+	(*(unsigned *)arg)++;
+
+	switch (*type) {
+	case C_ROOT: {
+		struct croot *r = (struct croot *)type;
+
+		pmemobj_visit_field(vp, &r->head);
+		pmemobj_visit_field(vp, &r->huge);
+		pmemobj_visit_field(vp, &r->aligned);
+		return 0;
+	}
+	case C_NODE: {
+		struct cnode *n = (struct cnode *)type;
+
+		pmemobj_visit_field(vp, &n->next);
+		pmemobj_visit_field(vp, &n->blob);
+		return 0;
+	}
+	case C_ALIGNED:
+		return ALIGNMENT;
+	default:
+		ASSERTeq(*type, C_BLOB);
+		return 0;
+	}
+}
+
+/*
+ * cbad -- report a PMEMoid that isn't in the object
+ */
+static size_t
+cbad(void *arg, PMEMoid oid, struct pmemobj_visit *vp)
+{
+	PMEMoid elsewhere = oid;
+
+	pmemobj_visit_field(vp, &elsewhere);
+	return 0;
+}
+
+/*
+ * cdirect -- direct pointer to an object of the pool open now
+ */
+static void *
+cdirect(PMEMoid oid)
+{
+	oid.pool = (uint64_t)Pop;
+	return pmemobj_direct(oid);
+}
+
+/*
+ * cblob -- allocate a blob of size bytes filled with val
+ */
+static PMEMoid
+cblob(size_t size, unsigned char val)
+{
+	PMEMoid oid = pmemobj_alloc(size);
+	ASSERT(!pmemobj_nulloid(oid));
+
+	unsigned char *p = pmemobj_direct(oid);
+	memset(p, val, size);
+	*(uint64_t *)p = C_BLOB;
+	return oid;
+}
+
+/*
+ * ccheck -- check a blob of size bytes still holds val
+ */
+static void
+ccheck(PMEMoid oid, size_t size, unsigned char val)
+{
+	unsigned char *p = cdirect(oid);
+
+	ASSERTeq(*(uint64_t *)p, C_BLOB);
+	for (size_t i = sizeof (uint64_t); i < size; i++)
+		ASSERTeq(p[i], val);
+}
+
+/*
+ * compact -- check compacting the closed pool moves what's reachable
+ *
+ * Garbage is allocated between the objects reached from the root, so
+ * they're spread over the heap.  After compacting, the garbage must be
+ * gone, the structure must be intact and must take up fewer lines, and
+ * the file fewer blocks.
+ */
+static void
+compact(const char *path)
+{
+	jmp_buf env;
+	struct pmemobj_heap_stats hs;
+	struct pmemobj_compact_stats cs;
+	struct stat before, after;
+
+	Pop = pmemobj_pool_open(path);
+	ASSERTne(Pop, NULL);
+
+	/* the root may reuse a freed block, it still comes zeroed */
+	pmemobj_tx_begin(Pop, env);
+	PMEMoid old = pmemobj_alloc(sizeof (struct croot));
+	ASSERT(!pmemobj_nulloid(old));
+	memset(pmemobj_direct(old), 0xff, sizeof (struct croot));
+	pmemobj_free(old);
+	pmemobj_tx_commit();
+
+	struct croot *r = pmemobj_root_direct(Pop, sizeof (*r));
+	ASSERTne(r, NULL);
+	ASSERTeq(pmemobj_direct(old), r);
+	ASSERTeq(r->type, 0);
+	ASSERT(pmemobj_nulloid(r->head));
+	ASSERT(pmemobj_nulloid(r->huge));
+	ASSERT(pmemobj_nulloid(r->aligned));
+
+	pmemobj_tx_begin(Pop, env);
+	r->type = C_ROOT;
+	r->huge = cblob(HUGE_SIZE, 0xee);
+	for (int i = 0; i < NNODES; i++) {
+		PMEMoid oid = pmemobj_alloc(sizeof (struct cnode));
+		ASSERT(!pmemobj_nulloid(oid));
+
+		struct cnode *n = pmemobj_direct(oid);
+		n->type = C_NODE;
+		n->val = i;
+		n->next = r->head;
+		n->blob = cblob(BLOB_SIZE, (unsigned char)i);
+		r->head = oid;
+
+		/* never referred to, left behind */
+		cblob(100 * 1024, 0);
+		if (i == NNODES / 2) {
+			r->aligned = pmemobj_aligned_alloc(ALIGNMENT, 64);
+			ASSERT(!pmemobj_nulloid(r->aligned));
+			*(uint64_t *)pmemobj_direct(r->aligned) = C_ALIGNED;
+		}
+	}
+	pmemobj_tx_commit();
+
+	pmemobj_pool_close(Pop);
+	STAT(path, &before);
+
+	/* a failed compaction leaves the pool as it was */
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof (tmp), "%s.compact", path);
+	errno = 0;
+	ASSERTeq(pmemobj_pool_compact(path, cbad, NULL, &cs), -1);
+	ASSERTeq(errno, EINVAL);
+	ASSERTeq(access(tmp, F_OK), -1);
+
+	/* so does one that crashed, the next one starts over */
+	int fd = OPEN(tmp, O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
+	WRITE(fd, "stale", 5);
+	CLOSE(fd);
+
+	unsigned visits = 0;
+	ASSERTeq(pmemobj_pool_compact(path, cvisit, &visits, &cs), 0);
+	ASSERTeq(visits, 2 * NNODES + 3);
+	ASSERTeq(cs.objects, 2 * NNODES + 3);
+	ASSERTeq(cs.dropped, NNODES);
+	ASSERT(cs.lines_after < cs.lines_before);
+	ASSERTeq(access(tmp, F_OK), -1);
+
+	STAT(path, &after);
+	ASSERT(after.st_blocks < before.st_blocks);
+
+	Pop = pmemobj_pool_open(path);
+	ASSERTne(Pop, NULL);
+	pmemobj_heap_stats(Pop, &hs);
+	ASSERTeq(hs.lines_used, cs.lines_after);
+
+	r = pmemobj_root_direct(Pop, sizeof (*r));
+	ASSERTeq(r->type, C_ROOT);
+	ccheck(r->huge, HUGE_SIZE, 0xee);
+	ASSERTeq((uintptr_t)cdirect(r->aligned) % ALIGNMENT, 0);
+	ASSERTeq(*(uint64_t *)cdirect(r->aligned), C_ALIGNED);
+
+	/* the list is intact, from the last node made to the first */
+	int i = NNODES;
+	for (PMEMoid oid = r->head; !pmemobj_nulloid(oid); ) {
+		struct cnode *n = cdirect(oid);
+
+		ASSERTeq(n->type, C_NODE);
+		ASSERTeq(n->val, --i);
+		ccheck(n->blob, BLOB_SIZE, (unsigned char)i);
+		oid = n->next;
+	}
+	ASSERTeq(i, 0);
+
+	/* the root stays, the rest goes so later tests have the room */
+	pmemobj_tx_begin(Pop, env);
+	while (!pmemobj_nulloid(r->head)) {
+		PMEMoid oid = r->head;
+		struct cnode *n = cdirect(oid);
+
+		oid.pool = (uint64_t)Pop;
+		r->head = n->next;
+		n->blob.pool = (uint64_t)Pop;
+		pmemobj_free(n->blob);
+		pmemobj_free(oid);
+	}
+	r->huge.pool = r->aligned.pool = (uint64_t)Pop;
+	pmemobj_free(r->huge);
+	pmemobj_free(r->aligned);
+	r->huge.off = r->aligned.off = 0;
+	pmemobj_tx_commit();
+
+	pmemobj_pool_close(Pop);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_alloc_free");
+
+	if (argc < 2)
+		FATAL("usage: %s file", argv[0]);
+
+	Pop = pmemobj_pool_open(argv[1]);
+	ASSERTne(Pop, NULL);
+
+	/* prefaulting a pool that isn't pmem doesn't fill in its holes */
+	struct stat before, after;
+	STAT(argv[1], &before);
+	pmemobj_pool_prefault(Pop, NTHREADS);
+	STAT(argv[1], &after);
+	ASSERTeq(before.st_blocks, after.st_blocks);
+
+	/* small, medium, and objects that need lines of their own */
+	huge_coalesce(4 * 1024 * 1024);
+	reuse(64);
+	aligned();
+	sizes();
+	stats(5 * 1024 * 1024);
+	tcache(200);
+	alloc_free(100 * 1024, 2 * POOL_SIZE, NOBJS);
+	alloc_free(15 * 1024 * 1024, 4 * POOL_SIZE, 2);
+	abort_alloc(1024 * 1024, 2 * POOL_SIZE);
+
+	pthread_t threads[NTHREADS];
+	for (int i = 0; i < NTHREADS; i++)
+		PTHREAD_CREATE(&threads[i], NULL, worker,
+				(void *)(size_t)(16384 + i * 1000));
+	for (int i = 0; i < NTHREADS; i++)
+		PTHREAD_JOIN(threads[i], NULL);
+
+	short_lived(500);
+
+	pmemobj_pool_close(Pop);
+
+	/* free lists survive reopening the pool */
+	Pop = pmemobj_pool_open(argv[1]);
+	ASSERTne(Pop, NULL);
+
+	reuse(2000);
+	alloc_free(100 * 1024, 2 * POOL_SIZE, NOBJS);
+	alloc_free(15 * 1024 * 1024, 4 * POOL_SIZE, 2);
+
+	pmemobj_pool_close(Pop);
+
+	unclean(argv[1]);
+
+	/* last, as it leaves the pool's lines carved up */
+	Pop = pmemobj_pool_open(argv[1]);
+	ASSERTne(Pop, NULL);
+	aligned_full();
+	pmemobj_pool_close(Pop);
+
+	/* on a new pool, with room for the garbage it leaves behind */
+	ASSERTeq(truncate(argv[1], 0), 0);
+	ASSERTeq(truncate(argv[1], POOL_SIZE), 0);
+	compact(argv[1]);
+
+	DONE(NULL);
+}
@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2015, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * obj_realloc.c -- unit test for pmemobj_realloc
+ *
+ * Objects are grown in place, both small ones at the end of their
+ * thread's line or followed by a free block and huge ones followed by
+ * free space, and moved when they can't grow.  Either way their data
+ * must stay, and an aborted realloc must leave the object as it was.
+ *
+ * usage: obj_realloc file [bench]
+ */
+
+#include <time.h>
+#include "unittest.h"
+#include "libpmem.h"
+
+#define	MB (1024 * 1024)
+
+static PMEMobjpool *Pop;
+static PMEMoid Null_oid;
+
+/*
+ * fill -- (internal) fill an object with a pattern
+ */
+static void
+fill(PMEMoid oid, size_t len)
+{
+	unsigned char *p = pmemobj_direct(oid);
+
+	for (size_t i = 0; i < len; i++)
+		p[i] = (unsigned char)(i * 7);
+}
+
+/*
+ * check -- (internal) check the pattern made by fill() is still there
+ */
+static void
+check(PMEMoid oid, size_t len)
+{
+	unsigned char *p = pmemobj_direct(oid);
+
+	for (size_t i = 0; i < len; i++)
+		ASSERTeq(p[i], (unsigned char)(i * 7));
+}
+
+/*
+ * grow -- (internal) realloc an object in a transaction of its own
+ */
+static PMEMoid
+grow(PMEMoid oid, size_t size)
+{
+	jmp_buf env;
+
+	pmemobj_tx_begin(Pop, env);
+	oid = pmemobj_realloc(oid, size);
+	pmemobj_tx_commit();
+
+	return oid;
+}
+
+/*
+ * small_inplace -- grow the object carved last out of the thread's line
+ */
+static void
+small_inplace(void)
+{
+	PMEMoid oid = grow(Null_oid, 100);
+
+	ASSERT(!pmemobj_nulloid(oid));
+	fill(oid, 100);
+
+	PMEMoid n = grow(oid, 1000);
+	ASSERTeq(n.off, oid.off);
+	ASSERT(pmemobj_size(n) >= 1000);
+	check(n, 100);
+
+	/* shrinking never moves it */
+	n = grow(n, 10);
+	ASSERTeq(n.off, oid.off);
+
+	ASSERT(pmemobj_nulloid(grow(n, 0)));
+}
+
+/*
+ * small_abort -- abort growing an object in place
+ */
+static void
+small_abort(void)
+{
+	jmp_buf env;
+
+	PMEMoid oid = grow(Null_oid, 100);
+	size_t size = pmemobj_size(oid);
+	fill(oid, 100);
+
+	/* the object is cut back, the space it took is free again */
+	pmemobj_tx_begin(Pop, env);
+	PMEMoid n = pmemobj_realloc(oid, 1000);
+	ASSERTeq(n.off, oid.off);
+	pmemobj_tx_abort(0);
+	ASSERTeq(pmemobj_size(oid), size);
+	check(oid, 100);
+
+	n = grow(oid, 1000);
+	ASSERTeq(n.off, oid.off);
+	check(n, 100);
+
+	ASSERT(pmemobj_nulloid(grow(n, 0)));
+}
+
+/*
+ * absorber -- grow an object carved by another thread, see small_absorb()
+ */
+static void *
+absorber(void *arg)
+{
+	PMEMoid *oidp = arg;
+	PMEMoid n = grow(*oidp, 300);
+
+	ASSERTeq(n.off, oidp->off);
+	check(n, 200);
+
+	return NULL;
+}
+
+/*
+ * small_absorb -- grow an object into the freed one after it
+ */
+static void
+small_absorb(void)
+{
+	jmp_buf env;
+	PMEMoid oid[2], next[2], after[2];
+
+	for (int i = 0; i < 2; i++) {
+		oid[i] = grow(Null_oid, 200);
+		next[i] = grow(Null_oid, 200);
+		after[i] = grow(Null_oid, 200);
+		fill(oid[i], 200);
+	}
+
+	/* the neighbor is in the thread's cache */
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(next[0]);
+	pmemobj_tx_commit();
+
+	PMEMoid n = grow(oid[0], 300);
+	ASSERTeq(n.off, oid[0].off);
+	ASSERT(pmemobj_size(n) >= 300);
+	check(n, 200);
+
+	/* on a free list, found by any thread */
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(next[1]);
+	pmemobj_tx_commit();
+	ASSERTeq(pmemobj_tcache_flush(Pop), 0);
+
+	pthread_t thread;
+	PTHREAD_CREATE(&thread, NULL, absorber, &oid[1]);
+	PTHREAD_JOIN(thread, NULL);
+
+	pmemobj_tx_begin(Pop, env);
+	for (int i = 0; i < 2; i++) {
+		pmemobj_free(oid[i]);
+		pmemobj_free(after[i]);
+	}
+	pmemobj_tx_commit();
+}
+
+/*
+ * small_move -- grow an object with another one right after it
+ */
+static void
+small_move(void)
+{
+	jmp_buf env;
+
+	PMEMoid oid = grow(Null_oid, 200);
+	PMEMoid next = grow(Null_oid, 200);
+	fill(oid, 200);
+
+	PMEMoid n = grow(oid, 3000);
+	ASSERTne(n.off, oid.off);
+	check(n, 200);
+
+	/* an aborted move leaves the old object alone */
+	PMEMoid after = grow(Null_oid, 20000);
+	pmemobj_tx_begin(Pop, env);
+	PMEMoid m = pmemobj_realloc(n, 100000);
+	ASSERTne(m.off, n.off);
+	pmemobj_tx_abort(0);
+	check(n, 200);
+
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(n);
+	pmemobj_free(next);
+	pmemobj_free(after);
+	pmemobj_tx_commit();
+}
+
+/*
+ * huge_inplace -- grow a huge object into the freed one after it
+ */
+static void
+huge_inplace(void)
+{
+	jmp_buf env;
+
+	PMEMoid oid = grow(Null_oid, 4 * MB);
+	PMEMoid next = grow(Null_oid, 4 * MB);
+	PMEMoid last = grow(Null_oid, 4 * MB);
+	ASSERT(!pmemobj_nulloid(last));
+	fill(oid, 4 * MB);
+
+	/* can't grow yet, only moved */
+	pmemobj_tx_begin(Pop, env);
+	PMEMoid m = pmemobj_realloc(oid, 6 * MB);
+	ASSERTne(m.off, oid.off);
+	pmemobj_tx_abort(0);
+
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(next);
+	pmemobj_tx_commit();
+
+	/* an aborted growth gives the extent back */
+	struct pmemobj_heap_stats before, after;
+	size_t size = pmemobj_size(oid);
+	pmemobj_heap_stats(Pop, &before);
+
+	pmemobj_tx_begin(Pop, env);
+	m = pmemobj_realloc(oid, 6 * MB);
+	ASSERTeq(m.off, oid.off);
+	pmemobj_tx_abort(0);
+
+	pmemobj_heap_stats(Pop, &after);
+	ASSERTeq(pmemobj_size(oid), size);
+	ASSERTeq(after.huge_bytes, before.huge_bytes);
+	ASSERTeq(after.free, before.free);
+
+	PMEMoid n = grow(oid, 6 * MB);
+	ASSERTeq(n.off, oid.off);
+	ASSERT(pmemobj_size(n) >= 6 * MB);
+	check(n, 4 * MB);
+
+	pmemobj_tx_begin(Pop, env);
+	pmemobj_free(n);
+	pmemobj_free(last);
+	pmemobj_tx_commit();
+}
+
+/*
+ * bench -- (internal) time growing objects from min by step bytes up to max
+ *
+ * With junk, an object of that many bytes is allocated after each
+ * realloc, taking the space following the object, so the object has to
+ * be moved to grow.  It's allocated in the same transaction, before the
+ * space the object moved out of is freed and could be taken instead.
+ * Huge objects only have room for junk after them while they're less
+ * than 4.5MB, as the rest of their 8MB segment must hold more than the
+ * smallest huge object.
+ */
+static void
+bench(const char *name, size_t min, size_t step, size_t max, int nobjs,
+	size_t junk)
+{
+	jmp_buf env;
+	struct timespec t0, t1;
+	PMEMoid junks[(max - min) / step + 1];
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < nobjs; i++) {
+		PMEMoid oid = { 0, 0 };
+		int njunk = 0;
+
+		for (size_t size = min; size <= max; size += step) {
+			pmemobj_tx_begin(Pop, env);
+			oid = pmemobj_realloc(oid, size);
+			ASSERT(!pmemobj_nulloid(oid));
+
+			if (junk) {
+				junks[njunk] = pmemobj_alloc(junk);
+				ASSERT(!pmemobj_nulloid(junks[njunk]));
+				njunk++;
+			}
+			pmemobj_tx_commit();
+		}
+
+		pmemobj_tx_begin(Pop, env);
+		pmemobj_free(oid);
+		for (int j = 0; j < njunk; j++)
+			pmemobj_free(junks[j]);
+		pmemobj_tx_commit();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	OUT("%s: %.3f s", name, (double)(t1.tv_sec - t0.tv_sec) +
+			(t1.tv_nsec - t0.tv_nsec) / 1e9);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_realloc");
+
+	if (argc < 2)
+		FATAL("usage: %s file [bench]", argv[0]);
+
+	Pop = pmemobj_pool_open(argv[1]);
+	ASSERTne(Pop, NULL);
+
+	if (argc > 2 && strcmp(argv[2], "bench") == 0) {
+		bench("small, in place", 16, 16, 4096, 100, 0);
+		bench("small, moved", 16, 16, 4096, 100, 16);
+		bench("huge, in place", 4 * MB, MB / 16, 4 * MB + 7 * MB / 16,
+				20, 0);
+		bench("huge, moved", 4 * MB, MB / 16, 4 * MB + 7 * MB / 16,
+				20, 3 * MB + MB / 2);
+	} else {
+		small_inplace();
+		small_abort();
+		small_absorb();
+		small_move();
+		huge_inplace();
+	}
+
+	pmemobj_pool_close(Pop);
+
+	DONE(NULL);
+}
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2015, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_async.c -- unit test for asynchronous persistence
+ *
+ * usage: pmem_async file logfile blkfile
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+
+#define	NTHREADS 4
+#define	NREQS 1000
+#define	NRECORDS 500
+#define	NBLOCKS 200
+#define	NRESTARTS 1000
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static int Completed;
+static int Errors;
+
+/*
+ * callback -- count completed requests
+ */
+static void
+callback(void *arg, int error)
+{
+	pthread_mutex_lock(&Lock);
+	Completed++;
+	if (error)
+		Errors++;
+	pthread_mutex_unlock(&Lock);
+}
+
+/*
+ * writer -- write and persist a stripe of the file asynchronously
+ */
+static void *
+writer(void *arg)
+{
+	char *start = arg;
+	uint64_t ticket = 0;
+
+	for (int i = 0; i < NREQS; i++) {
+		char *p = start + (i * 97) % (1024 * 1024);
+		*p = (char)i;
+		ticket = pmem_persist_async(p, 1, callback, NULL);
+		ASSERTne(ticket, 0);
+	}
+
+	ASSERTeq(pmem_async_wait(ticket), 0);
+
+	return NULL;
+}
+
+static volatile int Restarting;
+
+/*
+ * submitter -- persist and wait while async mode is toggled underneath
+ */
+static void *
+submitter(void *arg)
+{
+	char *p = arg;
+
+	while (Restarting) {
+		(*p)++;
+		uint64_t ticket = pmem_persist_async(p, 1, NULL, NULL);
+		ASSERTne(ticket, 0);
+
+		/* a request queued as the threads stop must still complete */
+		ASSERTeq(pmem_async_wait(ticket), 0);
+	}
+
+	return NULL;
+}
+
+/*
+ * start_stop -- race starting and stopping async mode against submitters
+ */
+static void
+start_stop(char *addr)
+{
+	pthread_t threads[NTHREADS];
+
+	Restarting = 1;
+	for (int i = 0; i < NTHREADS; i++)
+		PTHREAD_CREATE(&threads[i], NULL, submitter,
+				addr + i * 4096);
+
+	for (int i = 0; i < NRESTARTS; i++) {
+		ASSERTeq(pmem_async_start(1 + i % NTHREADS), 0);
+		pmem_async_stop();
+	}
+
+	Restarting = 0;
+	for (int i = 0; i < NTHREADS; i++)
+		PTHREAD_JOIN(threads[i], NULL);
+}
+
+/*
+ * check_record -- walk callback, check the records appended by log_async
+ */
+static int
+check_record(const void *buf, size_t len, void *arg)
+{
+	int *np = arg;
+
+	ASSERTeq(len, sizeof (int));
+	ASSERTeq(*(const int *)buf, *np);
+	(*np)++;
+
+	return 1;
+}
+
+/*
+ * log_async -- append to a log in async mode, then reopen it
+ */
+static void
+log_async(char *path)
+{
+	int fd = OPEN(path, O_RDWR);
+	PMEMlog *plp = pmemlog_map(fd);
+	if (plp == NULL)
+		FATAL("!pmemlog_map");
+
+	for (int i = 0; i < NRECORDS; i++)
+		ASSERTeq(pmemlog_append(plp, &i, sizeof (i)), 0);
+
+	/* appends in flight are visible right away */
+	ASSERTeq(pmemlog_tell(plp), NRECORDS * sizeof (int));
+
+	int n = 0;
+	pmemlog_walk(plp, sizeof (int), check_record, &n);
+	ASSERTeq(n, NRECORDS);
+
+	/* the durability point for everything appended so far */
+	ASSERTeq(pmemlog_sync(plp), 0);
+
+	/* unmapping waits for the write point to reach the media */
+	pmemlog_unmap(plp);
+
+	plp = pmemlog_map(fd);
+	if (plp == NULL)
+		FATAL("!pmemlog_map");
+	CLOSE(fd);
+
+	ASSERTeq(pmemlog_tell(plp), NRECORDS * sizeof (int));
+
+	n = 0;
+	pmemlog_walk(plp, sizeof (int), check_record, &n);
+	ASSERTeq(n, NRECORDS);
+
+	pmemlog_rewind(plp);
+	ASSERTeq(pmemlog_tell(plp), 0);
+
+	pmemlog_unmap(plp);
+}
+
+/*
+ * blk_async -- write blocks in async mode, then reopen the pool
+ */
+static void
+blk_async(char *path)
+{
+	int fd = OPEN(path, O_RDWR);
+	PMEMblk *pbp = pmemblk_map(fd, 512);
+	if (pbp == NULL)
+		FATAL("!pmemblk_map");
+
+	unsigned char buf[512];
+	for (int i = 0; i < NBLOCKS; i++) {
+		memset(buf, i, sizeof (buf));
+		ASSERTeq(pmemblk_write(pbp, buf, i), 0);
+	}
+
+	pmemblk_unmap(pbp);
+
+	pbp = pmemblk_map(fd, 512);
+	if (pbp == NULL)
+		FATAL("!pmemblk_map");
+	CLOSE(fd);
+
+	for (int i = 0; i < NBLOCKS; i++) {
+		ASSERTeq(pmemblk_read(pbp, buf, i), 0);
+		ASSERTeq(buf[0], (unsigned char)i);
+		ASSERTeq(buf[sizeof (buf) - 1], (unsigned char)i);
+	}
+
+	pmemblk_unmap(pbp);
+}
+
+int
+main(int argc, char *argv[])
+{
+	START(argc, argv, "pmem_async");
+
+	if (argc != 4)
+		FATAL("usage: %s file logfile blkfile", argv[0]);
+
+	int fd = OPEN(argv[1], O_RDWR);
+	char *addr = pmem_map(fd);
+	if (addr == NULL)
+		FATAL("!pmem_map");
+	CLOSE(fd);
+
+	/* without async mode the range is persistent right away */
+	uint64_t ticket = pmem_persist_async(addr, 4096, callback, NULL);
+	ASSERTeq(Completed, 1);
+	ASSERTeq(pmem_async_wait(ticket), 0);
+
+	start_stop(addr);
+
+	ASSERTeq(pmem_async_start(0), -1);
+	ASSERTeq(errno, EINVAL);
+	ASSERTeq(pmem_async_start(NTHREADS), 0);
+	ASSERTeq(pmem_async_start(NTHREADS), -1);
+	ASSERTeq(errno, EBUSY);
+
+	pthread_t threads[NTHREADS];
+	for (int i = 0; i < NTHREADS; i++)
+		PTHREAD_CREATE(&threads[i], NULL, writer,
+				addr + i * 1024 * 1024);
+	for (int i = 0; i < NTHREADS; i++)
+		PTHREAD_JOIN(threads[i], NULL);
+
+	/* waiting on the newest ticket waits for every older one */
+	ticket = pmem_persist_async(addr, 1, NULL, NULL);
+	ASSERTeq(pmem_async_wait(ticket), 0);
+	ASSERTeq(Completed, NTHREADS * NREQS + 1);
+	ASSERTeq(Errors, 0);
+
+	ASSERTeq(pmem_async_wait(ticket + 1), -1);
+	ASSERTeq(errno, EINVAL);
+
+	log_async(argv[2]);
+	blk_async(argv[3]);
+
+	char *gone = mmap(NULL, 4096, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	ASSERTne(gone, MAP_FAILED);
+	ASSERTeq(munmap(gone, 4096), 0);
+
+	/* a failed write-back is reported for its own ticket only */
+	Errors = 0;
+	uint64_t failed = pmem_persist_async(gone, 1, callback, NULL);
+	ticket = pmem_persist_async(addr, 1, NULL, NULL);
+	ASSERTeq(pmem_async_wait(ticket), 0);
+	ASSERTeq(Errors, 1);
+	ASSERTeq(pmem_async_wait(failed), -1);
+	ASSERTeq(errno, ENOMEM);
+
+	pmem_async_stop();
+
+	/* the same holds for a range that fails inline */
+	Errors = 0;
+	ticket = pmem_persist_async(gone, 1, callback, NULL);
+	ASSERTeq(Errors, 1);
+	ASSERTeq(pmem_async_wait(ticket), -1);
+	ASSERTeq(errno, ENOMEM);
+	ASSERTeq(pmem_async_wait(failed), -1);
+
+	ticket = pmem_persist_async(addr, 1, NULL, NULL);
+	ASSERTeq(pmem_async_wait(ticket), 0);
+
+	DONE(NULL);
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2015, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_emul.c -- unit test for pmem emulation
+ *
+ * Run with PMEM_EMUL_LINE_NS and PMEM_EMUL_FENCE_NS set, or with
+ * PMEM_EMUL_BW.  Drains are checked to take at least as long as the
+ * lines written before them cost.  Where a drain must not wait for
+ * lines, it's checked against half of what those lines would cost, to
+ * leave room for a busy machine.  With PMEM_IS_PMEM_FORCE=0 the file
+ * isn't pmem, and ranges written back with msync() are checked to be
+ * charged as well.
+ *
+ * usage: pmem_emul file
+ */
+
+#include <time.h>
+#include "unittest.h"
+#include "libpmem.h"
+
+#define	MB (1024 * 1024)
+#define	LINE 64		/* emulated writes are counted in cache lines */
+
+static uint64_t Line_ns;
+static uint64_t Fence_ns;
+static uint64_t Bw;
+
+/*
+ * env -- return the value of a numeric environment variable, or 0
+ */
+static uint64_t
+env(const char *name)
+{
+	char *ptr = getenv(name);
+
+	return ptr ? strtoull(ptr, NULL, 0) : 0;
+}
+
+/*
+ * now -- monotonic time in nanoseconds
+ */
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * persist_ns -- return how long pmem_persist() of a range takes
+ */
+static uint64_t
+persist_ns(void *addr, size_t len)
+{
+	uint64_t t0 = now();
+
+	pmem_persist(addr, len, 0);
+	return now() - t0;
+}
+
+/*
+ * drain_ns -- return how long pmem_drain() takes
+ */
+static uint64_t
+drain_ns(void)
+{
+	uint64_t t0 = now();
+
+	pmem_drain();
+	return now() - t0;
+}
+
+/*
+ * drainer -- time a drain in a thread that wrote nothing
+ */
+static void *
+drainer(void *arg)
+{
+	*(uint64_t *)arg = drain_ns();
+
+	return NULL;
+}
+
+/*
+ * latency -- check drains wait for the lines written and the fence
+ */
+static void
+latency(char *addr)
+{
+	/* nothing written, only the fence is paid for */
+	ASSERT(drain_ns() >= Fence_ns);
+
+	memset(addr, 1, 20 * LINE);
+	ASSERT(persist_ns(addr, 20 * LINE) >= Fence_ns + 20 * Line_ns);
+
+	/* the drain forgot the lines */
+	ASSERT(drain_ns() < Fence_ns + 10 * Line_ns);
+
+	/* a range straddling a line boundary costs both lines */
+	ASSERT(persist_ns(addr + LINE / 2, LINE) >= Fence_ns + 2 * Line_ns);
+
+	/* streamed lines are counted too */
+	char src[64 * LINE];
+	memset(src, 2, sizeof (src));
+	uint64_t t0 = now();
+	pmem_memcpy_persist(addr + 4096, src, sizeof (src));
+	ASSERT(now() - t0 >= Fence_ns + 64 * Line_ns);
+	ASSERTeq(memcmp(addr + 4096, src, sizeof (src)), 0);
+
+	/* lines are counted per thread, only the writer's drain waits */
+	pmem_flush(addr, 20 * LINE, 0);
+
+	pthread_t thread;
+	uint64_t other;
+	PTHREAD_CREATE(&thread, NULL, drainer, &other);
+	PTHREAD_JOIN(thread, NULL);
+	ASSERT(other < Fence_ns + 10 * Line_ns);
+
+	ASSERT(drain_ns() >= Fence_ns + 20 * Line_ns);
+}
+
+static int Persists;	/* calls to hook_persist() */
+
+/*
+ * hook_persist -- persist function handed to pmem_set_funcs()
+ */
+static void
+hook_persist(void *addr, size_t len, int flags)
+{
+	/* the file is in DRAM, only emulation makes this take time */
+	Persists++;
+}
+
+/*
+ * hook -- check a persist function replaced by the application is charged
+ */
+static void
+hook(char *addr)
+{
+	pmem_set_funcs(NULL, NULL, NULL, NULL, NULL, hook_persist);
+
+	PMEMflushset *fsp = pmem_flushset_new();
+	ASSERTne(fsp, NULL);
+	memset(addr, 4, 20 * LINE);
+	pmem_flushset_add(fsp, addr, 20 * LINE);
+
+	uint64_t t0 = now();
+	ASSERTeq(pmem_flushset_drain(fsp), 0);
+	ASSERT(now() - t0 >= Fence_ns + 20 * Line_ns);
+	ASSERTne(Persists, 0);
+	pmem_flushset_delete(fsp);
+
+	pmem_set_funcs(NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+/*
+ * async_done -- pmem_persist_async() callback, record the result
+ */
+static void
+async_done(void *arg, int error)
+{
+	*(int *)arg = error;
+}
+
+/*
+ * msync_charged -- check ranges written back with msync() are charged
+ */
+static void
+msync_charged(char *addr)
+{
+	memset(addr, 5, 20 * LINE);
+
+	int error = -1;
+	uint64_t t0 = now();
+	uint64_t ticket = pmem_persist_async(addr, 20 * LINE,
+			async_done, &error);
+	ASSERTne(ticket, 0);
+	ASSERT(now() - t0 >= Fence_ns + 20 * Line_ns);
+
+	ASSERTeq(pmem_async_wait(ticket), 0);
+	ASSERTeq(error, 0);
+}
+
+/*
+ * writer -- persist a range in a thread of its own
+ */
+static void *
+writer(void *arg)
+{
+	pmem_persist(arg, MB, 0);
+
+	return NULL;
+}
+
+/*
+ * bandwidth -- check the write bandwidth cap is shared by all threads
+ */
+static void
+bandwidth(char *addr)
+{
+	/* bytes / (MB/s) is microseconds */
+	uint64_t mb_ns = (uint64_t)MB * 1000 / Bw;
+
+	memset(addr, 3, 2 * MB);
+	ASSERT(persist_ns(addr, MB) >= mb_ns);
+
+	pthread_t threads[2];
+	uint64_t t0 = now();
+	for (int i = 0; i < 2; i++)
+		PTHREAD_CREATE(&threads[i], NULL, writer, addr + i * MB);
+	for (int i = 0; i < 2; i++)
+		PTHREAD_JOIN(threads[i], NULL);
+	ASSERT(now() - t0 >= 2 * mb_ns);
+}
+
+int
+main(int argc, char *argv[])
+{
+	START(argc, argv, "pmem_emul");
+
+	if (argc != 2)
+		FATAL("usage: %s file", argv[0]);
+
+	Line_ns = env("PMEM_EMUL_LINE_NS");
+	Fence_ns = env("PMEM_EMUL_FENCE_NS");
+	Bw = env("PMEM_EMUL_BW");
+
+	if (Line_ns + Fence_ns + Bw == 0)
+		FATAL("no PMEM_EMUL_* variable set");
+
+	int fd = OPEN(argv[1], O_RDWR);
+	char *addr = pmem_map(fd);
+	if (addr == NULL)
+		FATAL("!pmem_map");
+	CLOSE(fd);
+
+	if (!pmem_is_pmem(addr, 4096)) {
+		ASSERTeq(Bw, 0);
+		msync_charged(addr);
+	} else if (Bw) {
+		bandwidth(addr);
+	} else {
+		latency(addr);
+		hook(addr);
+	}
+
+	DONE(NULL);
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2015, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_map_sync.c -- unit test for MAP_SYNC mappings
+ *
+ * usage: pmem_map_sync file
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+
+/*
+ * is_map_sync -- check the smaps VmFlags of a mapping for "sf"
+ *
+ * The kernel shows "sf" (synchronous page faults) for MAP_SYNC mappings.
+ */
+static int
+is_map_sync(void *addr)
+{
+	FILE *fp = fopen("/proc/self/smaps", "r");
+	if (fp == NULL)
+		FATAL("!/proc/self/smaps");
+
+	char line[4096];
+	int found = 0;
+	int retval = 0;
+
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		unsigned long lo, hi;
+
+		if (sscanf(line, "%lx-%lx", &lo, &hi) == 2) {
+			found = (lo == (uintptr_t)addr);
+			continue;
+		}
+
+		if (found && strncmp(line, "VmFlags:", 8) == 0) {
+			retval = strstr(line, " sf") != NULL;
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	return retval;
+}
+
+int
+main(int argc, char *argv[])
+{
+	START(argc, argv, "pmem_map_sync");
+
+	if (argc != 2)
+		FATAL("usage: %s file", argv[0]);
+
+	int fd = OPEN(argv[1], O_RDWR);
+	char *addr = pmem_map(fd);
+	if (addr == NULL)
+		FATAL("!pmem_map");
+	CLOSE(fd);
+
+	/* MAP_SYNC or not, the mapping must work */
+	memset(addr, 0x5a, 4096);
+	pmem_persist(addr, 4096, 0);
+
+	int sync = is_map_sync(addr);
+
+	ASSERTeq(pmem_is_pmem(addr, 4096), sync);
+	ASSERTeq(pmem_is_pmem_refresh(addr, 4096), sync);
+	ASSERTeq(pmem_is_pmem(addr, 4096), sync);
+
+	DONE(NULL);
+}
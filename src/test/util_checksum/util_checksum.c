@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2015, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * util_checksum.c -- unit test for the pool header checksums
+ *
+ * usage: util_checksum file
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include "util.h"
+
+#define	MAXLEN 300	/* longest range summed */
+#define	NOFFS 8		/* alignments of the range tried */
+#define	NPOS 4		/* places of the checksum field tried */
+
+static unsigned char Pattern[MAXLEN];
+static unsigned char Buf[MAXLEN + NOFFS + sizeof (uint64_t)];
+
+/* checksums of the plain C implementation, the reference */
+static uint64_t Fletcher_ref[NOFFS][MAXLEN + 1][NPOS];
+static uint64_t Crc_ref[NOFFS][MAXLEN + 1][NPOS];
+
+/*
+ * sum -- checksum Pattern[0..len) copied to Buf + off
+ *
+ * pos 0 keeps the checksum field out of the range, the others put it
+ * at the start, the middle and the end of it.
+ */
+static uint64_t
+sum(int crc, unsigned off, size_t len, int pos)
+{
+	unsigned char *p = Buf + off;
+	uint64_t out = 0;
+	uint64_t *csump = &out;
+	size_t hole = 0;
+
+	memcpy(p, Pattern, len);
+
+	if (pos == 2)
+		hole = len / 2 & ~(size_t)3;
+	else if (pos == 3)
+		hole = (len - sizeof (uint64_t)) & ~(size_t)3;
+	if (pos > 0 && len >= sizeof (uint64_t))
+		csump = (uint64_t *)(p + hole);
+
+	if (crc)
+		util_checksum_crc32c(p, len, csump, 1);
+	else
+		util_checksum(p, len, csump, 1);
+
+	memcpy(&out, csump, sizeof (out));
+	return out;
+}
+
+/*
+ * compare -- check an implementation matches the reference
+ */
+static void
+compare(int crc, const char *name)
+{
+	for (unsigned off = 0; off < NOFFS; off++)
+		for (size_t len = 0; len <= MAXLEN; len++)
+			for (int pos = 0; pos < NPOS; pos++) {
+				uint64_t ref = crc ? Crc_ref[off][len][pos] :
+					Fletcher_ref[off][len][pos];
+				uint64_t csum = sum(crc, off, len, pos);
+
+				if (csum != ref)
+					FATAL("%s off %u len %zu pos %d: "
+						"%jx != %jx", name, off, len,
+						pos, (uintmax_t)csum,
+						(uintmax_t)ref);
+			}
+
+	OUT("%s matches", name);
+}
+
+/*
+ * crc_pool -- check a log pool with a CRC32C header checksum opens
+ */
+static void
+crc_pool(char *path)
+{
+	int fd = OPEN(path, O_RDWR);
+	PMEMlog *plp = pmemlog_map(fd);
+	if (plp == NULL)
+		FATAL("!pmemlog_map");
+	ASSERTeq(pmemlog_append(plp, Pattern, MAXLEN), 0);
+	pmemlog_unmap(plp);
+
+	/* switch the header over to CRC32C */
+	struct pool_hdr *hdrp = MMAP(NULL, sizeof (*hdrp),
+			PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	uint32_t incompat = le32toh(hdrp->incompat_features) |
+			POOL_FEAT_CKSUM_CRC32C;
+
+	hdrp->incompat_features = htole32(incompat);
+	util_checksum_hdr(hdrp, incompat, 1);
+	hdrp->checksum = htole64(hdrp->checksum);
+
+	/* the Fletcher64 checksum doesn't match anymore */
+	ASSERTeq(util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 0), 0);
+
+	struct pool_hdr hdr;
+	memcpy(&hdr, hdrp, sizeof (hdr));
+	ASSERT(util_convert_hdr(&hdr));
+
+	/* a damaged header is noticed */
+	memcpy(&hdr, hdrp, sizeof (hdr));
+	hdr.crtime ^= 1;
+	ASSERT(!util_convert_hdr(&hdr));
+
+	MUNMAP(hdrp, sizeof (*hdrp));
+
+	/* the data is still there after opening it again */
+	plp = pmemlog_map(fd);
+	if (plp == NULL)
+		FATAL("!pmemlog_map");
+	CLOSE(fd);
+
+	ASSERTeq(pmemlog_tell(plp), MAXLEN);
+	pmemlog_unmap(plp);
+}
+
+int
+main(int argc, char *argv[])
+{
+	START(argc, argv, "util_checksum");
+
+	if (argc != 2)
+		FATAL("usage: %s file", argv[0]);
+
+	util_init();
+
+	for (size_t i = 0; i < MAXLEN; i++)
+		Pattern[i] = (unsigned char)(i * 151 + 7);
+
+	ASSERTeq(util_checksum_force(CKSUM_IMPL_SCALAR), 0);
+
+	/* the standard CRC32C check value */
+	uint64_t csum;
+	util_checksum_crc32c("123456789", 9, &csum, 1);
+	ASSERTeq(csum, 0xe3069283);
+
+	for (unsigned off = 0; off < NOFFS; off++)
+		for (size_t len = 0; len <= MAXLEN; len++)
+			for (int pos = 0; pos < NPOS; pos++) {
+				Fletcher_ref[off][len][pos] =
+					sum(0, off, len, pos);
+				Crc_ref[off][len][pos] = sum(1, off, len, pos);
+			}
+
+	/* the other implementations, where the CPU has them */
+	if (util_checksum_force(CKSUM_IMPL_SSE2) == 0)
+		compare(0, "sse2 fletcher64");
+	if (util_checksum_force(CKSUM_IMPL_AVX2) == 0)
+		compare(0, "avx2 fletcher64");
+	if (util_checksum_force(CKSUM_IMPL_SSE42) == 0) {
+		compare(1, "sse4.2 crc32c");
+
+		util_checksum_crc32c("123456789", 9, &csum, 1);
+		ASSERTeq(csum, 0xe3069283);
+	}
+
+	crc_pool(argv[1]);
+
+	DONE(NULL);
+}
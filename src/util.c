@@ -34,6 +34,8 @@
  * util.c -- general utilities used in the library
  */
 
+#define	_GNU_SOURCE	/* for sched_getcpu() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,10 +46,15 @@
 #include <stdint.h>
 #include <endian.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <immintrin.h>
 #include "util.h"
+#include "cpu.h"
 #include "out.h"
 
-#define	PROCMAXLEN 2048 /* maximum expected line length in /proc files */
 
 #define	GIGABYTE ((uintptr_t)1 << 30)
 #define	TERABYTE ((uintptr_t)1 << 40)
@@ -63,6 +70,62 @@ Free_func Free = free;
 Realloc_func Realloc = realloc;
 Strdup_func Strdup = strdup;
 
+/*
+ * Registry of the address ranges mapped by util_map(), along with their
+ * pmem status, so pmem_is_pmem() doesn't have to parse /proc for every
+ * call.  Entries are kept sorted by address and never overlap.
+ */
+struct map_range {
+	uintptr_t base;
+	uintptr_t end;
+	int is_pmem;		/* 1, 0, or -1 if not looked up yet */
+	int sync;		/* is_pmem decided by how it was mapped */
+};
+
+static struct map_range *Ranges;
+static unsigned Nranges;
+static unsigned Maxranges;
+static pthread_rwlock_t Range_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define	RANGES_GROW 16
+
+/*
+ * NUMA topology, read from sysfs by util_init().  With a single node,
+ * Cpu_node stays NULL and everything is on node 0.
+ */
+static int Numa_nodes;		/* highest node ID + 1, 0 until looked up */
+static int *Cpu_node;		/* NUMA node of each CPU */
+static int Ncpus;		/* entries in Cpu_node */
+
+/* mempolicy definitions, to avoid depending on libnuma's numaif.h */
+#define	MPOL_PREFERRED 1
+#define	MPOL_F_NODE (1 << 0)
+#define	MPOL_F_ADDR (1 << 1)
+#define	NODEMASK_BITS 1024
+
+#define	PREFAULT_MAX_THREADS 64
+#define	PREFAULT_ALIGN ((size_t)(2 * 1024 * 1024))
+
+static int range_register(void *addr, size_t len, int is_pmem, int sync);
+static void util_numa_init(void);
+static void util_checksum_init(void);
+
+/* in case the system headers predate MADV_POPULATE_* (Linux 5.14) */
+#ifndef MADV_POPULATE_READ
+#define	MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define	MADV_POPULATE_WRITE 23
+#endif
+
+/* in case the system headers predate MAP_SYNC (Linux 4.15) */
+#ifndef MAP_SHARED_VALIDATE
+#define	MAP_SHARED_VALIDATE 0x03
+#endif
+#ifndef MAP_SYNC
+#define	MAP_SYNC 0x80000
+#endif
+
 /*
  * util_init -- initialize the utils
  *
@@ -74,6 +137,208 @@ util_init(void)
 	LOG(3, NULL);
 	if (Pagesize == 0)
 		Pagesize = (unsigned long) sysconf(_SC_PAGESIZE);
+
+	if (Numa_nodes == 0)
+		util_numa_init();
+
+	util_checksum_init();
+}
+
+/*
+ * numa_online -- (internal) count the online NUMA nodes
+ *
+ * The online file lists node IDs as ranges, like "0-1,4", and there
+ * may be gaps between them.  *maxp is set to the highest ID.
+ */
+static int
+numa_online(int *maxp)
+{
+	FILE *fp = fopen("/sys/devices/system/node/online", "r");
+	char buf[1024];
+	int count = 0;
+
+	*maxp = 0;
+
+	if (fp == NULL)
+		return 0;
+
+	if (fgets(buf, sizeof (buf), fp) != NULL) {
+		char *p = buf;
+
+		for (;;) {
+			char *end;
+			long first = strtol(p, &end, 10);
+			long last = first;
+
+			if (end == p || first < 0)
+				break;
+			if (*end == '-') {
+				p = end + 1;
+				last = strtol(p, &end, 10);
+				if (end == p || last < first)
+					break;
+			}
+
+			count += last - first + 1;
+			if (last > *maxp)
+				*maxp = last;
+
+			if (*end != ',')
+				break;
+			p = end + 1;
+		}
+	}
+
+	fclose(fp);
+
+	return count;
+}
+
+/*
+ * util_numa_init -- (internal) read the NUMA topology from sysfs
+ */
+static void
+util_numa_init(void)
+{
+	char path[PATH_MAX];
+	int maxnode;
+
+	if (numa_online(&maxnode) <= 1 || maxnode >= NODEMASK_BITS) {
+		Numa_nodes = 1;
+		return;
+	}
+
+	/* node IDs index the per-node tables, offline ones stay empty */
+	int nnodes = maxnode + 1;
+
+	int ncpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+	int *cpu_node;
+
+	if (ncpus < 1 || (cpu_node = Malloc(ncpus * sizeof (int))) == NULL) {
+		Numa_nodes = 1;
+		return;
+	}
+
+	/* each cpuN directory has a nodeM link to its node */
+	for (int cpu = 0; cpu < ncpus; cpu++) {
+		cpu_node[cpu] = 0;
+
+		snprintf(path, sizeof (path),
+				"/sys/devices/system/cpu/cpu%d", cpu);
+
+		DIR *dir = opendir(path);
+		if (dir == NULL)
+			continue;
+
+		struct dirent *d;
+		while ((d = readdir(dir)) != NULL) {
+			int node;
+			if (sscanf(d->d_name, "node%d", &node) == 1 &&
+					node < nnodes) {
+				cpu_node[cpu] = node;
+				break;
+			}
+		}
+
+		closedir(dir);
+	}
+
+	Cpu_node = cpu_node;
+	Ncpus = ncpus;
+	Numa_nodes = nnodes;
+
+	LOG(3, "NUMA node IDs below %d, %d cpus", nnodes, ncpus);
+}
+
+/*
+ * util_numa_nodes -- return one past the highest NUMA node ID
+ *
+ * Node IDs may have gaps, some of the nodes below it may not exist.
+ */
+int
+util_numa_nodes(void)
+{
+	return Numa_nodes;
+}
+
+/*
+ * util_cpu_node -- return the NUMA node of a CPU
+ */
+int
+util_cpu_node(int cpu)
+{
+	if (Cpu_node == NULL || cpu < 0 || cpu >= Ncpus)
+		return 0;
+
+	return Cpu_node[cpu];
+}
+
+/*
+ * util_current_node -- return the NUMA node the calling thread runs on
+ *
+ * The thread may be migrated any time, so this is just a hint.
+ */
+int
+util_current_node(void)
+{
+	if (Cpu_node == NULL)
+		return 0;
+
+	return util_cpu_node(sched_getcpu());
+}
+
+/*
+ * util_addr_node -- return the NUMA node backing an address, or -1
+ *
+ * The page gets faulted in if it isn't yet.
+ */
+int
+util_addr_node(void *addr)
+{
+	int node;
+
+	if (Cpu_node == NULL)
+		return 0;
+
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+			MPOL_F_NODE|MPOL_F_ADDR) < 0) {
+		LOG(4, "!get_mempolicy");
+		return -1;
+	}
+
+	return node;
+}
+
+/*
+ * util_mbind_node -- prefer a NUMA node for the pages of a range
+ *
+ * Only affects pages not faulted in yet, and only anonymous memory.
+ * The pages of a shared file mapping come from the page cache, or are
+ * the pmem itself, so their placement can't be changed this way.
+ */
+int
+util_mbind_node(void *addr, size_t len, int node)
+{
+	unsigned long mask[NODEMASK_BITS / (8 * sizeof (unsigned long))];
+
+	if (Cpu_node == NULL || node < 0 || node >= NODEMASK_BITS)
+		return 0;
+
+	memset(mask, 0, sizeof (mask));
+	mask[node / (8 * sizeof (unsigned long))] |=
+			1UL << (node % (8 * sizeof (unsigned long)));
+
+	/* mbind requires addr to be a multiple of pagesize */
+	len += (uintptr_t)addr & (Pagesize - 1);
+	addr = (void *)((uintptr_t)addr & ~(Pagesize - 1));
+
+	if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+			NODEMASK_BITS + 1, 0) < 0) {
+		LOG(4, "!mbind");
+		return -1;
+	}
+
+	return 0;
 }
 
 /*
@@ -95,75 +360,182 @@ util_set_alloc_funcs(void *(*malloc_func)(size_t size),
 }
 
 /*
- * util_map_hint -- (internal) use /proc to determine a hint address for mmap()
+ * Address space reservation for pool mappings.
  *
- * This is a helper function for util_map().  It opens up /proc/self/maps
- * and looks for the first unused address in the process address space that is:
- * - greater or equal 1TB,
- * - large enough to hold range of given length,
- * - 1GB aligned.
+ * The first time a pool is mapped, RESERVE_SIZE bytes of address space
+ * starting at a 1GB boundary are reserved with a PROT_NONE mapping,
+ * at or above 1TB if the kernel agrees.  Pools get mapped over whole
+ * 1GB slots of it with MAP_FIXED, so every pool starts 1GB aligned,
+ * which allows the DAX code to use large mappings, and nothing else in
+ * the process can grab the address range in the meantime.  Unmapping
+ * a pool puts the PROT_NONE mapping back and frees its slots.
  *
- * Asking for aligned address like this will allow the DAX code to use large
- * mappings.  It is not an error if mmap() ignores the hint and chooses
- * different address.
+ * Pools which don't fit in the free slots are mapped wherever the
+ * kernel puts them.
  */
-static char *
-util_map_hint(size_t len)
+#define	RESERVE_SIZE TERABYTE
+#define	RESERVE_NSLOTS (RESERVE_SIZE / GIGABYTE)
+
+static struct {
+	pthread_mutex_t lock;
+	int tried;		/* reservation attempted */
+	char *base;		/* NULL if the reservation failed */
+	uint64_t used[RESERVE_NSLOTS / 64];	/* one bit per slot in use */
+} Reserve = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * reserve_init -- (internal) reserve the address space, first time only
+ *
+ * Called with Reserve.lock held.
+ */
+static void
+reserve_init(void)
 {
-	FILE *fp;
-	if ((fp = fopen("/proc/self/maps", "r")) == NULL) {
-		LOG(1, "!/proc/self/maps");
-		return NULL;
+	Reserve.tried = 1;
+
+	/* over-allocate by one slot so the start can be aligned */
+	size_t len = RESERVE_SIZE + GIGABYTE;
+	char *addr = mmap((void *)TERABYTE, len, PROT_NONE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+
+	if (addr == MAP_FAILED) {
+		LOG(1, "!mmap reserving %zu bytes", len);
+		return;
 	}
 
-	char line[PROCMAXLEN];	/* for fgets() */
-	char *lo = NULL;	/* beginning of current range in maps file */
-	char *hi = NULL;	/* end of current range in maps file */
-	char *raddr = (char *)TERABYTE;	/* ignore regions below 1TB */
-
-	while (fgets(line, PROCMAXLEN, fp) != NULL) {
-		/* check for range line */
-		if (sscanf(line, "%p-%p", &lo, &hi) == 2) {
-			LOG(4, "%p-%p", lo, hi);
-			if (lo > raddr) {
-				if (lo - raddr >= len) {
-					LOG(4, "unused region of size %zu "
-							"found at %p",
-							lo - raddr, raddr);
-					break;
-				} else {
-					LOG(4, "region is too small: %zu < %zu",
-							lo - raddr, len);
-				}
-			}
+	char *base = (char *)roundup((uintptr_t)addr, GIGABYTE);
 
-			if (hi > raddr) {
-				/* align to 1GB */
-				raddr = (char *)roundup((uintptr_t)hi,
-						GIGABYTE);
-				LOG(4, "nearest aligned addr %p", raddr);
-			}
+	if (base > addr)
+		munmap(addr, base - addr);
+	munmap(base + RESERVE_SIZE, (addr + len) - (base + RESERVE_SIZE));
 
-			if (raddr == 0) {
-				LOG(4, "end of address space reached");
-				break;
-			}
+	Reserve.base = base;
+
+	LOG(3, "reserved %p len %zu", base, (size_t)RESERVE_SIZE);
+}
+
+/*
+ * reserve_slots -- (internal) find and claim nslots consecutive free slots
+ *
+ * Called with Reserve.lock held.  Returns the first slot, or -1.
+ */
+static int
+reserve_slots(unsigned nslots)
+{
+	unsigned run = 0;
+
+	for (unsigned i = 0; i < RESERVE_NSLOTS; i++) {
+		if (Reserve.used[i / 64] & (1ULL << (i % 64))) {
+			run = 0;
+			continue;
+		}
+
+		if (++run == nslots) {
+			unsigned first = i + 1 - nslots;
+
+			for (i = first; i < first + nslots; i++)
+				Reserve.used[i / 64] |= 1ULL << (i % 64);
+
+			return (int)first;
 		}
 	}
 
-	/*
-	 * Check for a case when this is the last unused range in the address
-	 * space, but is not large enough. (very unlikely)
-	 */
-	if ((raddr != NULL) && (UINTPTR_MAX - (uintptr_t)raddr < len)) {
-		LOG(4, "end of address space reached");
-		raddr = NULL;
+	return -1;
+}
+
+/*
+ * util_reserve -- (internal) get 1GB aligned address space for len bytes
+ *
+ * Returns NULL if the reservation has no room.
+ */
+static char *
+util_reserve(size_t len)
+{
+	unsigned nslots = (len + GIGABYTE - 1) / GIGABYTE;
+	char *addr = NULL;
+
+	pthread_mutex_lock(&Reserve.lock);
+
+	if (!Reserve.tried)
+		reserve_init();
+
+	if (Reserve.base != NULL && nslots <= RESERVE_NSLOTS) {
+		int slot = reserve_slots(nslots);
+
+		if (slot >= 0)
+			addr = Reserve.base + (uintptr_t)slot * GIGABYTE;
 	}
 
-	fclose(fp);
+	pthread_mutex_unlock(&Reserve.lock);
 
-	LOG(3, "returning %p", raddr);
-	return raddr;
+	LOG(3, "len %zu returning %p", len, addr);
+	return addr;
+}
+
+/*
+ * util_unreserve -- (internal) hand address space back to the reservation
+ *
+ * Puts the PROT_NONE mapping back over [addr, addr + len) and frees
+ * the slots.  Returns -1 if the range isn't part of the reservation.
+ */
+static int
+util_unreserve(void *addr, size_t len)
+{
+	char *caddr = addr;
+
+	if (Reserve.base == NULL || caddr < Reserve.base ||
+			caddr >= Reserve.base + RESERVE_SIZE)
+		return -1;
+
+	unsigned first = (caddr - Reserve.base) / GIGABYTE;
+	unsigned nslots = (len + GIGABYTE - 1) / GIGABYTE;
+
+	if (mmap(addr, (size_t)nslots * GIGABYTE, PROT_NONE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED,
+			-1, 0) == MAP_FAILED) {
+		/* can't keep the slots reserved, so never reuse them */
+		LOG(1, "!mmap re-reserving %p", addr);
+		munmap(addr, len);
+		return 0;
+	}
+
+	pthread_mutex_lock(&Reserve.lock);
+
+	for (unsigned i = first; i < first + nslots; i++)
+		Reserve.used[i / 64] &= ~(1ULL << (i % 64));
+
+	pthread_mutex_unlock(&Reserve.lock);
+
+	return 0;
+}
+
+/*
+ * map_sync_supported -- (internal) check if a file can be mapped MAP_SYNC
+ *
+ * Maps a single page to find out.  Some filesystems only refuse
+ * MAP_SYNC after the kernel tore down whatever was mapped at the
+ * requested address, so this can't be left to the MAP_FIXED mapping
+ * made over the reservation.
+ */
+static int
+map_sync_supported(int fd)
+{
+	void *addr = mmap(NULL, Pagesize, PROT_READ|PROT_WRITE,
+			MAP_SHARED_VALIDATE|MAP_SYNC, fd, 0);
+
+	if (addr == MAP_FAILED) {
+		/*
+		 * EOPNOTSUPP when the filesystem isn't DAX, EINVAL
+		 * when the kernel predates MAP_SHARED_VALIDATE.
+		 */
+		LOG(3, "MAP_SYNC refused: %s", strerror(errno));
+		return 0;
+	}
+
+	munmap(addr, Pagesize);
+	return 1;
 }
 
 /*
@@ -172,48 +544,669 @@ util_map_hint(size_t len)
  * This is just a convenience function that calls mmap() with the
  * appropriate arguments and includes our trace points.
  *
- * If cow is set, the file is mapped copy-on-write.
+ * If cow is set, the file is mapped copy-on-write.  Otherwise it is
+ * mapped MAP_SYNC if possible.  The kernel only grants that on a
+ * DAX filesystem, where it guarantees the file metadata for every page
+ * written through the mapping is already persistent, so flushing the
+ * CPU caches is all it takes to make the data persistent.  Anywhere
+ * else the file is mapped the plain MAP_SHARED way and data has to go
+ * through msync().  Which one worked decides the pmem status of the
+ * mapping recorded in the range registry.
+ *
+ * The mapping goes into the address space reservation when there's
+ * room for it.
  */
 void *
 util_map(int fd, size_t len, int cow)
 {
 	void *base;
+	int is_pmem = 0;
 
 	LOG(3, "fd %d len %zu cow %d", fd, len, cow);
 
-	void *addr = util_map_hint(len);
+	int flags;
+
+	if (cow) {
+		flags = MAP_PRIVATE|MAP_NORESERVE;
+	} else if (map_sync_supported(fd)) {
+		flags = MAP_SHARED_VALIDATE|MAP_SYNC;
+		is_pmem = 1;
+	} else {
+		flags = MAP_SHARED;
+	}
+
+	void *addr = util_reserve(len);
+	if (addr)
+		flags |= MAP_FIXED;
 
-	if ((base = mmap(addr, len, PROT_READ|PROT_WRITE,
-			(cow) ? MAP_PRIVATE|MAP_NORESERVE : MAP_SHARED,
-					fd, 0)) == MAP_FAILED) {
+	base = mmap(addr, len, PROT_READ|PROT_WRITE, flags, fd, 0);
+
+	if (base == MAP_FAILED) {
+		int oerrno = errno;
 		LOG(1, "!mmap %zu bytes", len);
+		if (addr)
+			util_unreserve(addr, len);
+		errno = oerrno;
 		return NULL;
 	}
 
-	LOG(3, "mapped at %p", base);
+	LOG(3, "mapped at %p is_pmem %d", base, is_pmem);
+
+	/* not fatal, pmem_is_pmem() just won't be able to use the cache */
+	range_register(base, len, is_pmem, 1);
 
 	return base;
 }
 
+/*
+ * arguments for one prefault thread
+ */
+struct prefault_chunk {
+	char *addr;
+	size_t len;
+	int advice;		/* MADV_POPULATE_READ or _WRITE */
+};
+
+/*
+ * prefault_thread -- (internal) fault in the pages of one chunk
+ *
+ * Kernels without MADV_POPULATE_* get a read of every page instead,
+ * which maps the pages without dirtying them.  Any other failure, like
+ * pages protected by a debug build, just ends the prefault early.
+ */
+static void *
+prefault_thread(void *arg)
+{
+	struct prefault_chunk *cp = arg;
+
+	if (madvise(cp->addr, cp->len, cp->advice) == 0 || errno != EINVAL)
+		return NULL;
+
+	madvise(cp->addr, cp->len, MADV_WILLNEED);
+
+	for (size_t off = 0; off < cp->len; off += Pagesize)
+		(void) *(volatile char *)(cp->addr + off);
+
+	return NULL;
+}
+
+/*
+ * util_prefault -- fault in all the pages of a mapping using nthreads
+ *
+ * The range is split in chunks of whole large pages, one per thread.
+ * Pages are faulted in writable only on pmem (a MAP_SYNC mapping).
+ * Anywhere else that would dirty every page, writing back the whole
+ * pool and filling in the holes of a sparse file, so they're only
+ * read in.  If a thread can't be created, its chunk is done by the
+ * calling thread.
+ */
+void
+util_prefault(void *addr, size_t len, unsigned nthreads, int is_pmem)
+{
+	LOG(3, "addr %p len %zu nthreads %u is_pmem %d", addr, len,
+			nthreads, is_pmem);
+
+	if (nthreads == 0)
+		nthreads = 1;
+	if (nthreads > PREFAULT_MAX_THREADS)
+		nthreads = PREFAULT_MAX_THREADS;
+
+	size_t chunk = (len + nthreads - 1) / nthreads;
+	chunk = (chunk + PREFAULT_ALIGN - 1) & ~(PREFAULT_ALIGN - 1);
+
+	struct prefault_chunk chunks[PREFAULT_MAX_THREADS];
+	pthread_t threads[PREFAULT_MAX_THREADS];
+	int started[PREFAULT_MAX_THREADS];
+	unsigned n = 0;
+
+	for (size_t off = 0; off < len; off += chunk, n++) {
+		chunks[n].addr = (char *)addr + off;
+		chunks[n].len = (len - off < chunk) ? len - off : chunk;
+		chunks[n].advice = is_pmem ? MADV_POPULATE_WRITE :
+				MADV_POPULATE_READ;
+
+		/* the calling thread takes the last chunk itself */
+		started[n] = off + chunk < len && pthread_create(&threads[n],
+				NULL, prefault_thread, &chunks[n]) == 0;
+		if (!started[n])
+			prefault_thread(&chunks[n]);
+	}
+
+	for (unsigned i = 0; i < n; i++)
+		if (started[i])
+			pthread_join(threads[i], NULL);
+
+	LOG(3, "prefaulted %p len %zu in %u chunks", addr, len, n);
+}
+
+/*
+ * range_find -- (internal) find the first range which ends past addr
+ *
+ * Called with Range_lock held.  Returns Nranges if there is none.
+ */
+static unsigned
+range_find(uintptr_t addr)
+{
+	unsigned lo = 0;
+	unsigned hi = Nranges;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+
+		if (Ranges[mid].end <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * range_grow -- (internal) make room for one more range
+ *
+ * Called with Range_lock held for writing.
+ */
+static int
+range_grow(void)
+{
+	if (Nranges < Maxranges)
+		return 0;
+
+	struct map_range *nranges = Realloc(Ranges,
+			(Maxranges + RANGES_GROW) * sizeof (*nranges));
+	if (nranges == NULL) {
+		LOG(1, "!Realloc");
+		return -1;
+	}
+
+	Ranges = nranges;
+	Maxranges += RANGES_GROW;
+
+	return 0;
+}
+
+/*
+ * range_remove -- (internal) drop [base, end) from the registry
+ *
+ * Ranges partially covered are trimmed, or split in two.
+ * Called with Range_lock held for writing.
+ */
+static int
+range_remove(uintptr_t base, uintptr_t end)
+{
+	unsigned i = range_find(base);
+
+	while (i < Nranges && Ranges[i].base < end) {
+		struct map_range *rp = &Ranges[i];
+
+		if (rp->base < base && rp->end > end) {
+			/* hole punched in the middle of the range */
+			if (range_grow() < 0)
+				return -1;
+			rp = &Ranges[i];
+			memmove(rp + 2, rp + 1,
+				(Nranges - i - 1) * sizeof (*rp));
+			rp[1] = *rp;
+			rp[1].base = end;
+			rp->end = base;
+			Nranges++;
+			break;
+		} else if (rp->base < base) {
+			rp->end = base;
+			i++;
+		} else if (rp->end > end) {
+			rp->base = end;
+			i++;
+		} else {
+			memmove(rp, rp + 1, (Nranges - i - 1) * sizeof (*rp));
+			Nranges--;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * range_register -- (internal) add a range to the registry
+ */
+static int
+range_register(void *addr, size_t len, int is_pmem, int sync)
+{
+	LOG(3, "addr %p len %zu is_pmem %d sync %d", addr, len, is_pmem, sync);
+
+	uintptr_t base = (uintptr_t)addr;
+	int retval = -1;
+
+	if ((errno = pthread_rwlock_wrlock(&Range_lock))) {
+		LOG(1, "!pthread_rwlock_wrlock");
+		return -1;
+	}
+
+	if (range_remove(base, base + len) < 0 || range_grow() < 0)
+		goto out;
+
+	unsigned i = range_find(base);
+	memmove(&Ranges[i + 1], &Ranges[i],
+			(Nranges - i) * sizeof (struct map_range));
+	Ranges[i].base = base;
+	Ranges[i].end = base + len;
+	Ranges[i].is_pmem = is_pmem;
+	Ranges[i].sync = sync;
+	Nranges++;
+	retval = 0;
+
+out:
+	pthread_rwlock_unlock(&Range_lock);
+	return retval;
+}
+
+/*
+ * util_range_register -- remember the pmem status of a range
+ *
+ * Any previous information about the range is replaced.  An is_pmem
+ * of -1 means the status isn't known yet and will be looked up by
+ * util_range_is_pmem() the first time it is needed.
+ */
+int
+util_range_register(void *addr, size_t len, int is_pmem)
+{
+	return range_register(addr, len, is_pmem, 0);
+}
+
+/*
+ * util_range_is_pmem_sync -- pmem status of a range, if util_map() set it
+ *
+ * Returns 1 or 0 if the entire range was mapped by util_map(), which
+ * knows whether the mapping is pmem from the mmap() flags it got, or -1
+ * if some part of it wasn't.
+ */
+int
+util_range_is_pmem_sync(void *addr, size_t len)
+{
+	uintptr_t base = (uintptr_t)addr;
+	uintptr_t end = base + (len ? len : 1);
+	int retval = 1;
+
+	if (pthread_rwlock_rdlock(&Range_lock))
+		return -1;
+
+	for (unsigned i = range_find(base); base < end; i++) {
+		if (i == Nranges || Ranges[i].base > base ||
+				!Ranges[i].sync) {
+			retval = -1;
+			break;
+		}
+
+		if (!Ranges[i].is_pmem)
+			retval = 0;
+
+		base = Ranges[i].end;
+	}
+
+	pthread_rwlock_unlock(&Range_lock);
+
+	return retval;
+}
+
+/*
+ * util_range_unregister -- forget about a range
+ */
+int
+util_range_unregister(void *addr, size_t len)
+{
+	LOG(3, "addr %p len %zu", addr, len);
+
+	if ((errno = pthread_rwlock_wrlock(&Range_lock))) {
+		LOG(1, "!pthread_rwlock_wrlock");
+		return -1;
+	}
+
+	int retval = range_remove((uintptr_t)addr, (uintptr_t)addr + len);
+
+	pthread_rwlock_unlock(&Range_lock);
+	return retval;
+}
+
+/*
+ * range_lookup -- (internal) check the registry for a range
+ *
+ * Returns 1 or 0 if the answer is known, -1 if part of the range
+ * isn't registered.  If a registered range hasn't been looked up yet,
+ * it is passed to probe() and the result is remembered.  When probe is
+ * NULL -2 is returned instead, so the caller can retry with the write
+ * lock held.
+ */
+static int
+range_lookup(uintptr_t addr, uintptr_t end, int (*probe)(void *, size_t))
+{
+	for (unsigned i = range_find(addr); addr < end; i++) {
+		if (i == Nranges || Ranges[i].base > addr)
+			return -1;
+
+		if (Ranges[i].is_pmem < 0) {
+			if (probe == NULL)
+				return -2;
+			Ranges[i].is_pmem = (*probe)((void *)Ranges[i].base,
+					Ranges[i].end - Ranges[i].base);
+		}
+
+		if (!Ranges[i].is_pmem)
+			return 0;
+
+		addr = Ranges[i].end;
+	}
+
+	return 1;
+}
+
+/*
+ * util_range_is_pmem -- look up the pmem status of a range
+ *
+ * Returns true only if the entire range is registered as pmem, false
+ * if any part of it is registered as not pmem, or -1 if some part of
+ * the range is not registered at all.
+ */
+int
+util_range_is_pmem(void *addr, size_t len, int (*probe)(void *, size_t))
+{
+	uintptr_t base = (uintptr_t)addr;
+	uintptr_t end = base + (len ? len : 1);
+	int retval;
+
+	if (pthread_rwlock_rdlock(&Range_lock))
+		return -1;
+	retval = range_lookup(base, end, NULL);
+	pthread_rwlock_unlock(&Range_lock);
+
+	if (retval != -2)
+		return retval;
+
+	/* some range needs to be probed first */
+	if (pthread_rwlock_wrlock(&Range_lock))
+		return -1;
+	retval = range_lookup(base, end, probe);
+	pthread_rwlock_unlock(&Range_lock);
+
+	return retval;
+}
+
 /*
  * util_unmap -- unmap a file
  *
  * This is just a convenience function that calls munmap() with the
- * appropriate arguments and includes our trace points.
+ * appropriate arguments and includes our trace points.  Mappings made
+ * in the address space reservation are replaced with PROT_NONE instead,
+ * keeping the range reserved.
  */
 int
 util_unmap(void *addr, size_t len)
 {
 	LOG(3, "addr %p len %zu", addr, len);
 
-	int retval = munmap(addr, len);
+	int retval = 0;
 
-	if (retval < 0)
+	if (util_unreserve(addr, len) < 0 && (retval = munmap(addr, len)) < 0)
 		LOG(1, "!munmap");
+	else
+		util_range_unregister(addr, len);
 
 	return retval;
 }
 
+/*
+ * Fletcher64 running sums, so a range can be summed in pieces
+ */
+struct fletcher {
+	uint32_t lo;
+	uint32_t hi;
+};
+
+/*
+ * fletcher64_scalar -- (internal) add n 32-bit words to the running sums
+ */
+static void
+fletcher64_scalar(struct fletcher *f, const uint32_t *p32, size_t n)
+{
+	uint32_t lo32 = f->lo;
+	uint32_t hi32 = f->hi;
+
+	while (n--) {
+		lo32 += *p32++;
+		hi32 += lo32;
+	}
+
+	f->lo = lo32;
+	f->hi = hi32;
+}
+
+/*
+ * fletcher64_fold -- (internal) fold vector lane sums into the running sums
+ *
+ * After nvec vectors of nlanes words, a[l] is the sum of the words in
+ * lane l and b[l] weights each of them by the number of vectors from it
+ * to the end.  Word i of the N = nvec * nlanes words adds (N - i) times
+ * to the high sum, which for lane l is nlanes * b[l] - l * a[l].
+ */
+static void
+fletcher64_fold(struct fletcher *f, const uint32_t *a, const uint32_t *b,
+		unsigned nlanes, size_t nvec)
+{
+	uint32_t suma = 0;
+	uint32_t sumb = 0;
+
+	for (unsigned l = 0; l < nlanes; l++) {
+		suma += a[l];
+		sumb += nlanes * b[l] - l * a[l];
+	}
+
+	f->hi += (uint32_t)(nvec * nlanes) * f->lo + sumb;
+	f->lo += suma;
+}
+
+/*
+ * fletcher64_sse2 -- (internal) SSE2 version of fletcher64_scalar()
+ */
+__attribute__((target("sse2")))
+static void
+fletcher64_sse2(struct fletcher *f, const uint32_t *p32, size_t n)
+{
+	size_t nvec = n / 4;
+	__m128i a = _mm_setzero_si128();
+	__m128i b = _mm_setzero_si128();
+	uint32_t av[4];
+	uint32_t bv[4];
+
+	for (size_t i = 0; i < nvec; i++) {
+		a = _mm_add_epi32(a, _mm_loadu_si128((__m128i *)p32 + i));
+		b = _mm_add_epi32(b, a);
+	}
+
+	_mm_storeu_si128((__m128i *)av, a);
+	_mm_storeu_si128((__m128i *)bv, b);
+	fletcher64_fold(f, av, bv, 4, nvec);
+
+	fletcher64_scalar(f, p32 + nvec * 4, n - nvec * 4);
+}
+
+/*
+ * fletcher64_avx2 -- (internal) AVX2 version of fletcher64_scalar()
+ */
+__attribute__((target("avx2")))
+static void
+fletcher64_avx2(struct fletcher *f, const uint32_t *p32, size_t n)
+{
+	size_t nvec = n / 8;
+	__m256i a = _mm256_setzero_si256();
+	__m256i b = _mm256_setzero_si256();
+	uint32_t av[8];
+	uint32_t bv[8];
+
+	for (size_t i = 0; i < nvec; i++) {
+		a = _mm256_add_epi32(a, _mm256_loadu_si256((__m256i *)p32 + i));
+		b = _mm256_add_epi32(b, a);
+	}
+
+	_mm256_storeu_si256((__m256i *)av, a);
+	_mm256_storeu_si256((__m256i *)bv, b);
+	fletcher64_fold(f, av, bv, 8, nvec);
+
+	fletcher64_scalar(f, p32 + nvec * 8, n - nvec * 8);
+}
+
+/*
+ * the Fletcher64 and CRC32C implementations picked by util_checksum_init()
+ */
+static void (*Fletcher64)(struct fletcher *f, const uint32_t *p32,
+		size_t n) = fletcher64_scalar;
+static uint32_t (*Crc32c)(uint32_t crc, const void *addr, size_t len);
+
+/* CRC32C (Castagnoli) polynomial, bit-reflected */
+#define	CRC32C_POLY 0x82f63b78
+
+static uint32_t Crc32c_table[256];
+
+/*
+ * crc32c_sw -- (internal) table-driven CRC32C, one byte at a time
+ */
+static uint32_t
+crc32c_sw(uint32_t crc, const void *addr, size_t len)
+{
+	const unsigned char *p = addr;
+
+	while (len--)
+		crc = Crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+/*
+ * crc32c_hw -- (internal) CRC32C using the SSE4.2 CRC32 instruction
+ */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const void *addr, size_t len)
+{
+	const unsigned char *p = addr;
+	uint64_t crc64 = crc;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t word;
+		memcpy(&word, p, sizeof (word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+
+	crc = (uint32_t)crc64;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+/*
+ * util_checksum_init -- (internal) pick the checksum implementations
+ */
+static void
+util_checksum_init(void)
+{
+	if (Crc32c != NULL)
+		return;
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		Crc32c_table[i] = crc;
+	}
+
+	if (is_cpu_avx2_present()) {
+		LOG(3, "using avx2 fletcher64");
+		Fletcher64 = fletcher64_avx2;
+	} else if (is_cpu_sse2_present()) {
+		LOG(3, "using sse2 fletcher64");
+		Fletcher64 = fletcher64_sse2;
+	}
+
+	if (is_cpu_sse42_present()) {
+		LOG(3, "using sse4.2 crc32c");
+		Crc32c = crc32c_hw;
+	} else {
+		Crc32c = crc32c_sw;
+	}
+}
+
+/*
+ * util_checksum_force -- switch to one of the checksum implementations
+ *
+ * CKSUM_IMPL_SCALAR switches both checksums to plain C, the others
+ * only the checksum they implement.  Meant for the unit tests, which
+ * compare them.  Returns -1 if the CPU can't run the implementation.
+ */
+int
+util_checksum_force(int impl)
+{
+	LOG(3, "impl %d", impl);
+
+	util_checksum_init();
+
+	switch (impl) {
+	case CKSUM_IMPL_SCALAR:
+		Fletcher64 = fletcher64_scalar;
+		Crc32c = crc32c_sw;
+		return 0;
+	case CKSUM_IMPL_SSE2:
+		if (!is_cpu_sse2_present())
+			break;
+		Fletcher64 = fletcher64_sse2;
+		return 0;
+	case CKSUM_IMPL_AVX2:
+		if (!is_cpu_avx2_present())
+			break;
+		Fletcher64 = fletcher64_avx2;
+		return 0;
+	case CKSUM_IMPL_SSE42:
+		if (!is_cpu_sse42_present())
+			break;
+		Crc32c = crc32c_hw;
+		return 0;
+	}
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+/*
+ * checksum_hole -- (internal) locate the checksum field in a range
+ *
+ * Returns the number of bytes before *csump, or len if csump doesn't
+ * point to a word inside the range, in which case nothing is skipped.
+ */
+static size_t
+checksum_hole(void *addr, size_t len, uint64_t *csump)
+{
+	uintptr_t off = (uintptr_t)csump - (uintptr_t)addr;
+
+	if ((uintptr_t)csump < (uintptr_t)addr || off >= len ||
+			off % sizeof (uint32_t))
+		return len;
+
+	return (size_t)off;
+}
+
+/*
+ * checksum_result -- (internal) insert or verify a calculated checksum
+ */
+static int
+checksum_result(uint64_t *csump, uint64_t csum, int insert)
+{
+	if (insert) {
+		*csump = csum;
+		return 1;
+	}
+
+	return *csump == csum;
+}
+
 /*
  * util_checksum -- compute Fletcher64 checksum
  *
@@ -227,33 +1220,62 @@ util_unmap(void *addr, size_t len)
 int
 util_checksum(void *addr, size_t len, uint64_t *csump, int insert)
 {
-	uint32_t *p32 = addr;
-	uint32_t *p32end = addr + len;
-	uint32_t lo32 = 0;
-	uint32_t hi32 = 0;
-	uint64_t csum;
-
-	while (p32 < p32end)
-		if (p32 == (uint32_t *)csump) {
-			/* lo32 += 0; treat first 32-bits as zero */
-			p32++;
-			hi32 += lo32;
-			/* lo32 += 0; treat second 32-bits as zero */
-			p32++;
-			hi32 += lo32;
-		} else {
-			lo32 += *p32++;
-			hi32 += lo32;
-		}
+	size_t nwords = len / sizeof (uint32_t);
+	size_t hole = checksum_hole(addr, len, csump) / sizeof (uint32_t);
+	struct fletcher f = { 0, 0 };
+
+	/* sum around the checksum, instead of testing for it every word */
+	Fletcher64(&f, addr, hole);
+	if (hole < nwords) {
+		/* two zero words: lo32 stays put, hi32 gets it twice */
+		f.hi += 2 * f.lo;
+		hole += 2;
+		if (hole < nwords)
+			Fletcher64(&f, (uint32_t *)addr + hole, nwords - hole);
+	}
 
-	csum = (uint64_t)hi32 << 32 | lo32;
+	return checksum_result(csump, (uint64_t)f.hi << 32 | f.lo, insert);
+}
 
-	if (insert) {
-		*csump = csum;
-		return 1;
+/*
+ * util_checksum_crc32c -- compute CRC32C checksum
+ *
+ * Same as util_checksum(), but the checksum is the CRC32C of the range,
+ * zero-extended to 64 bits.  The SSE4.2 CRC32 instruction is used when
+ * the CPU has it.
+ */
+int
+util_checksum_crc32c(void *addr, size_t len, uint64_t *csump, int insert)
+{
+	static const uint64_t zero;
+	size_t hole = checksum_hole(addr, len, csump);
+	uint32_t crc = ~0U;
+
+	crc = Crc32c(crc, addr, hole);
+	if (hole < len) {
+		size_t skip = MIN(sizeof (zero), len - hole);
+		crc = Crc32c(crc, &zero, skip);
+		hole += skip;
+		crc = Crc32c(crc, (char *)addr + hole, len - hole);
 	}
 
-	return *csump == csum;
+	return checksum_result(csump, (uint64_t)~crc, insert);
+}
+
+/*
+ * util_checksum_hdr -- compute a pool header's checksum
+ *
+ * The checksum type is picked by the header's incompat feature mask,
+ * passed in host byte order since callers hold the header in either.
+ */
+int
+util_checksum_hdr(struct pool_hdr *hdrp, uint32_t incompat, int insert)
+{
+	if (incompat & POOL_FEAT_CKSUM_CRC32C)
+		return util_checksum_crc32c(hdrp, sizeof (*hdrp),
+				&hdrp->checksum, insert);
+
+	return util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, insert);
 }
 
 /*
@@ -281,7 +1303,7 @@ util_convert_hdr(struct pool_hdr *hdrp)
 	hdrp->checksum = le64toh(hdrp->checksum);
 
 	/* and to be valid, the fields must checksum correctly */
-	if (!util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 0)) {
+	if (!util_checksum_hdr(hdrp, hdrp->incompat_features, 0)) {
 		LOG(3, "invalid checksum");
 		return 0;
 	}
@@ -377,6 +1399,172 @@ util_range_none(void *addr, size_t len)
 	return retval;
 }
 
+/*
+ * Write guard for the debug version: a range kept read-only except for
+ * the pages some writer currently holds open.  Each page counts its
+ * writers, so concurrent writers to the same page don't have to be
+ * serialized around the copy -- only the first one in makes the page
+ * writable and only the last one out protects it again.  The counts
+ * are guarded by striped locks, a stripe per page modulo GUARD_STRIPES.
+ */
+#define	GUARD_STRIPES 64
+
+struct util_guard {
+	uintptr_t base;			/* first page guarded */
+	size_t npages;			/* pages guarded */
+	uint16_t *writers;		/* writers holding each page open */
+	size_t writers_size;		/* size of the writers mapping */
+	pthread_mutex_t locks[GUARD_STRIPES];
+};
+
+/*
+ * util_guard_new -- start guarding a range, which must be read-only
+ */
+struct util_guard *
+util_guard_new(void *addr, size_t len)
+{
+	LOG(3, "addr %p len %zu", addr, len);
+
+	struct util_guard *g;
+
+	if ((g = Malloc(sizeof (*g))) == NULL) {
+		LOG(1, "!Malloc for write guard");
+		return NULL;
+	}
+
+	g->base = (uintptr_t)addr & ~(Pagesize - 1);
+	g->npages = ((uintptr_t)addr + len - g->base + Pagesize - 1) /
+			Pagesize;
+
+	/* counts for pages never written never get touched */
+	g->writers_size = roundup(g->npages * sizeof (uint16_t), Pagesize);
+	g->writers = mmap(NULL, g->writers_size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (g->writers == MAP_FAILED) {
+		LOG(1, "!mmap for write guard");
+		Free(g);
+		return NULL;
+	}
+
+	for (int i = 0; i < GUARD_STRIPES; i++)
+		pthread_mutex_init(&g->locks[i], NULL);
+
+	return g;
+}
+
+/*
+ * util_guard_delete -- stop guarding a range
+ */
+void
+util_guard_delete(struct util_guard *g)
+{
+	LOG(3, "g %p", g);
+
+	for (int i = 0; i < GUARD_STRIPES; i++)
+		pthread_mutex_destroy(&g->locks[i]);
+	munmap(g->writers, g->writers_size);
+	Free(g);
+}
+
+/*
+ * guard_update -- (internal) open or close up to GUARD_STRIPES pages
+ *
+ * The stripes covering the pages are taken in stripe order, so two
+ * updates never wait for each other in a loop, and the pages changing
+ * protection are mprotect()ed in runs.
+ */
+static int
+guard_update(struct util_guard *g, size_t first, size_t n, int open)
+{
+	size_t rot = first % GUARD_STRIPES;
+	int prot = open ? PROT_READ|PROT_WRITE : PROT_READ;
+	int ret = 0;
+
+	for (size_t s = 0; s < GUARD_STRIPES; s++)
+		if ((s + GUARD_STRIPES - rot) % GUARD_STRIPES < n)
+			if (pthread_mutex_lock(&g->locks[s]))
+				LOG(1, "!pthread_mutex_lock");
+
+	size_t run = 0;		/* pages in the current run to mprotect */
+
+	for (size_t i = first; i <= first + n; i++) {
+		int change = 0;
+
+		if (i < first + n) {
+			if (open)
+				change = g->writers[i]++ == 0;
+			else
+				change = --g->writers[i] == 0;
+		}
+
+		if (change) {
+			run++;
+		} else if (run) {
+			void *addr = (void *)(g->base + (i - run) * Pagesize);
+			if (mprotect(addr, run * Pagesize, prot) < 0) {
+				LOG(1, "!mprotect");
+				ret = -1;
+			}
+			run = 0;
+		}
+	}
+
+	for (size_t s = 0; s < GUARD_STRIPES; s++)
+		if ((s + GUARD_STRIPES - rot) % GUARD_STRIPES < n)
+			if (pthread_mutex_unlock(&g->locks[s]))
+				LOG(1, "!pthread_mutex_unlock");
+
+	return ret;
+}
+
+/*
+ * guard_range -- (internal) open or close the pages covering a range
+ */
+static int
+guard_range(struct util_guard *g, void *addr, size_t len, int open)
+{
+	if (len == 0)
+		return 0;
+
+	uintptr_t uptr = (uintptr_t)addr;
+
+	ASSERT(uptr >= g->base && uptr + len <= g->base +
+			g->npages * Pagesize);
+
+	size_t first = (uptr - g->base) / Pagesize;
+	size_t end = (uptr + len - 1 - g->base) / Pagesize + 1;
+	int ret = 0;
+
+	for (; first < end; first += GUARD_STRIPES)
+		if (guard_update(g, first, MIN(GUARD_STRIPES, end - first),
+				open) < 0)
+			ret = -1;
+
+	return ret;
+}
+
+/*
+ * util_guard_rw -- make a range writable until the matching util_guard_ro
+ */
+int
+util_guard_rw(struct util_guard *g, void *addr, size_t len)
+{
+	LOG(13, "g %p addr %p len %zu", g, addr, len);
+
+	return guard_range(g, addr, len, 1);
+}
+
+/*
+ * util_guard_ro -- drop a writer, protecting pages nobody else holds open
+ */
+int
+util_guard_ro(struct util_guard *g, void *addr, size_t len)
+{
+	LOG(13, "g %p addr %p len %zu", g, addr, len);
+
+	return guard_range(g, addr, len, 0);
+}
+
 /*
  * util_feature_check -- check features masks
  */
@@ -392,7 +1580,8 @@ util_feature_check(struct pool_hdr *hdrp, uint32_t incompat,
 	uint32_t ubits;	/* unsupported bits */
 
 	/* check incompatible ("must support") features */
-	ubits = GET_NOT_MASKED_BITS(hdrp->incompat_features, incompat);
+	ubits = GET_NOT_MASKED_BITS(hdrp->incompat_features,
+					incompat | POOL_FEAT_INCOMPAT_COMMON);
 	if (ubits) {
 		LOG(1, "unsafe to continue due to unknown incompat "\
 							"features: %#x", ubits);
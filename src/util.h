@@ -53,8 +53,21 @@ void util_set_alloc_funcs(
 		void *(*realloc_func)(void *ptr, size_t size),
 		char *(*strdup_func)(const char *s));
 void *util_map(int fd, size_t len, int cow);
+void util_prefault(void *addr, size_t len, unsigned nthreads, int is_pmem);
+
+int util_numa_nodes(void);
+int util_cpu_node(int cpu);
+int util_current_node(void);
+int util_addr_node(void *addr);
+int util_mbind_node(void *addr, size_t len, int node);
 int util_unmap(void *addr, size_t len);
 
+int util_range_register(void *addr, size_t len, int is_pmem);
+int util_range_unregister(void *addr, size_t len);
+int util_range_is_pmem(void *addr, size_t len,
+		int (*probe)(void *addr, size_t len));
+int util_range_is_pmem_sync(void *addr, size_t len);
+
 /*
  * header used at the beginning of all types of memory pools
  *
@@ -75,7 +88,24 @@ struct pool_hdr {
 	uint64_t checksum;		/* checksum of above fields */
 };
 
+/*
+ * incompat feature bits common to all pool types, understood by
+ * util_feature_check() whatever the pool type says it supports
+ */
+#define	POOL_FEAT_CKSUM_CRC32C	0x0001	/* header checksum is CRC32C */
+#define	POOL_FEAT_INCOMPAT_COMMON POOL_FEAT_CKSUM_CRC32C
+
 int util_checksum(void *addr, size_t len, uint64_t *csump, int insert);
+int util_checksum_crc32c(void *addr, size_t len, uint64_t *csump, int insert);
+int util_checksum_hdr(struct pool_hdr *hdrp, uint32_t incompat, int insert);
+
+/* checksum implementations, for util_checksum_force() */
+#define	CKSUM_IMPL_SCALAR 0	/* Fletcher64 and CRC32C in plain C */
+#define	CKSUM_IMPL_SSE2 1	/* Fletcher64, 4 words at a time */
+#define	CKSUM_IMPL_AVX2 2	/* Fletcher64, 8 words at a time */
+#define	CKSUM_IMPL_SSE42 3	/* CRC32C using the CRC32 instruction */
+
+int util_checksum_force(int impl);
 int util_convert_hdr(struct pool_hdr *hdrp);
 
 /*
@@ -100,5 +130,10 @@ int util_range_ro(void *addr, size_t len);
 int util_range_rw(void *addr, size_t len);
 int util_range_none(void *addr, size_t len);
 
+struct util_guard *util_guard_new(void *addr, size_t len);
+void util_guard_delete(struct util_guard *g);
+int util_guard_rw(struct util_guard *g, void *addr, size_t len);
+int util_guard_ro(struct util_guard *g, void *addr, size_t len);
+
 int util_feature_check(struct pool_hdr *hdrp, uint32_t incompat,
 				uint32_t ro_compat, uint32_t compat);